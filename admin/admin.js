@@ -60,7 +60,9 @@ Admin.SocketBroker({
 				{data: 'source_ip'},
                 {data: 'file_name'},
                 {data: 'file_ext'},
-                {data: 'to_pdf'}
+                {data: 'to_pdf'},
+                {data: 'queue_ms', defaultContent: 0},
+                {data: 'convert_ms', defaultContent: 0}
 			],
 			columnDefs: [
 				{
@@ -82,6 +84,12 @@ Admin.SocketBroker({
 						return data ? '<span class="text-success">' + _('Yes') + '</span>' : '';
 					},
 				},
+				{
+					targets: [6, 7], // queue_ms, convert_ms
+					render: function(data, type, row) {
+						return row.to_pdf ? data : '';
+					},
+				},
 				{	// 標題和訊息不需排序功能
 					targets: [4, 5],
 					orderable: false
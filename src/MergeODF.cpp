@@ -7,29 +7,488 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <config.h>
+
 #include <OxOOL/ModuleManager.h>
 #include <OxOOL/Module/Base.h>
 #include <OxOOL/HttpHelper.h>
 #include <OxOOL/ConvertBroker.h>
 
 #include "MergeODF.h"
+#include "MergeODFJson.h"
 #include "MergeODFParser.h"
+#include "MergeODFPicture.h"
 
-#include <Poco/RegularExpression.h>
-#include <Poco/Glob.h>
+#include <Poco/DateTimeFormat.h>
+#include <Poco/DateTimeFormatter.h>
+#include <Poco/DateTimeParser.h>
+#include <Poco/Exception.h>
+#include <Poco/SHA1Engine.h>
 #include <Poco/StringTokenizer.h>
 #include <Poco/MemoryStream.h>
+#include <Poco/NumberFormatter.h>
+#include <Poco/NumberParser.h>
+#include <Poco/FileStream.h>
+#include <Poco/Path.h>
+#include <Poco/TemporaryFile.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/HTMLForm.h>
-#include <Poco/JSON/Parser.h>
+#include <Poco/Net/MultipartWriter.h>
 #include <Poco/JSON/Array.h>
 #include <Poco/JSON/Object.h>
+#include <Poco/Util/XMLConfiguration.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
 
 using namespace Poco::Data::Keywords;
 
+namespace
+{
+/// 非同步工作的路徑(jobs/<id>)，不可作爲範本代碼
+const std::string JOBS_PATH = "jobs";
+
+/// 群組資料總列數達到此值時，改用串流方式產生 content.xml
+constexpr std::size_t STREAM_RENDER_MIN_ROWS = 1000;
+
+/// 設定檔沒有指定時，跨請求圖片快取的容量
+constexpr Poco::UInt64 DEFAULT_PICTURE_CACHE_CAPACITY = 64 * 1024 * 1024;
+
+/// 設定檔沒有指定時，執行緒池的等待佇列上限
+constexpr unsigned DEFAULT_RENDER_QUEUE_SIZE = 64;
+
+/// 設定檔沒有指定時，非同步工作結果暫存區的容量及保留秒數
+constexpr Poco::UInt64 DEFAULT_JOB_STORE_CAPACITY = 256 * 1024 * 1024;
+constexpr unsigned DEFAULT_JOB_TTL = 600;
+
+/// 設定檔沒有指定時，PDF 轉檔的等待佇列上限及每個轉檔的時間上限(秒)
+constexpr unsigned DEFAULT_CONVERT_QUEUE_SIZE = 32;
+constexpr unsigned DEFAULT_CONVERT_TIMEOUT = 120;
+
+/// 設定檔沒有指定時，互動請求的成本上限，超過時改爲批次處理
+constexpr Poco::UInt64 DEFAULT_HEAVY_COST = 100000;
+
+/// 估計成本用的權重，單位約為填入一個變數
+constexpr Poco::UInt64 BASE_COST = 100; // 複製範本、壓縮輸出
+constexpr Poco::UInt64 GROUP_ROW_COST = 10; // 群組的一列(複製樣板列並填值)
+constexpr std::size_t IMAGE_STRING_LENGTH = 1024; // 這麼長的字串視為 base64 圖片
+constexpr std::size_t IMAGE_COST_BYTES = 1024; // 圖片每 1KB(解碼、壓縮)
+
+/// 在排入執行緒池之前估計產生報表的成本。
+/// 只掃描請求內容的字元，不建立 JSON 物件: 統計資料筆數(最上層的陣列或 NDJSON)、
+/// 內層陣列的元素數(群組列數)及長字串(圖片)的位元組數，再依範本的變數數量加權。
+/// @param plan 範本的編譯結果，尚未編譯時為空指標
+Poco::UInt64 estimateRenderCost(const TemplatePlan* plan, const std::string& body, bool toPDF)
+{
+    struct Frame
+    {
+        bool array;
+        bool expectItem; // 陣列中下一個值是新的元素
+        std::size_t items;
+    };
+    std::vector<Frame> stack;
+    std::size_t records = 0;
+    std::size_t elements = 0;
+    std::size_t imageBytes = 0;
+
+    // 遇到值的開頭時，計入所在的陣列
+    auto markItem = [&stack]()
+    {
+        if (!stack.empty() && stack.back().array && stack.back().expectItem)
+        {
+            stack.back().items++;
+            stack.back().expectItem = false;
+        }
+    };
+
+    for (std::size_t i = 0; i < body.size(); i++)
+    {
+        switch (body[i])
+        {
+            case '"':
+            {
+                markItem();
+                const std::size_t begin = ++i;
+                while (i < body.size() && body[i] != '"')
+                    i += body[i] == '\\' ? 2 : 1;
+                if (i - begin >= IMAGE_STRING_LENGTH)
+                    imageBytes += (i - begin) / 4 * 3;
+                break;
+            }
+            case '[':
+            case '{':
+                markItem();
+                if (stack.empty() && body[i] == '{')
+                    records++; // 單筆資料或 NDJSON
+                stack.push_back({ body[i] == '[', true, 0 });
+                break;
+            case ']':
+            case '}':
+                if (stack.empty())
+                    break;
+                if (stack.back().array)
+                {
+                    if (stack.size() == 1)
+                        records += stack.back().items; // 批次請求的資料陣列
+                    else
+                        elements += stack.back().items;
+                }
+                stack.pop_back();
+                break;
+            case ',':
+                if (!stack.empty())
+                    stack.back().expectItem = true;
+                break;
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+            case ':':
+                break;
+            default: // 數字、true、false、null
+                markItem();
+                break;
+        }
+    }
+
+    // 範本沒有群組時，陣列只是一般的值
+    const Poco::UInt64 singleCost = plan ? plan->singleVarPaths.size() : 0;
+    const Poco::UInt64 rowCost = plan && plan->groupVarPaths.empty() ? 1 : GROUP_ROW_COST;
+    Poco::UInt64 cost = BASE_COST * std::max<std::size_t>(1, records)
+                        + singleCost * std::max<std::size_t>(1, records) + rowCost * elements
+                        + imageBytes / IMAGE_COST_BYTES;
+    // 轉 PDF 的時間與文件大小相近
+    if (toPDF)
+        cost *= 2;
+    return cost;
+}
+
+/// 將文件寫到暫存檔供轉檔使用，寫入失敗時刪除暫存檔並丟出例外
+/// @return 暫存檔完整路徑
+std::string writeTemporaryFile(const std::string& extName,
+                               const std::function<void(std::ostream&)>& write)
+{
+    const std::string file = Poco::TemporaryFile::tempName() + extName;
+    try
+    {
+        Poco::FileOutputStream fos(file, std::ios::binary);
+        write(fos);
+        fos.close();
+        if (!fos)
+            throw Poco::WriteFileException(file);
+    }
+    catch (const std::exception&)
+    {
+        if (Poco::File(file).exists())
+            Poco::File(file).remove();
+        throw;
+    }
+    return file;
+}
+
+/// 有帶 ?async=1 表示在背景產生，立即傳回工作代碼
+bool isAsyncRequest(const Poco::Net::HTMLForm& urlParam)
+{
+    return urlParam.has("async") && urlParam.get("async") != "0"
+           && urlParam.get("async") != "false";
+}
+
+/// 複製請求內容，socket 的緩衝區在 handleRequest() 結束後就不再有效
+std::shared_ptr<const std::string> copyRequestBody(const std::shared_ptr<StreamSocket>& socket)
+{
+    auto& buffer = socket->getInBuffer();
+    return std::make_shared<const std::string>(
+        buffer.empty() ? std::string() : std::string(&buffer[0], buffer.size()));
+}
+
+/// 計算 JSON 中所有群組(陣列)資料的總列數
+std::size_t countGroupRows(const Poco::JSON::Object::Ptr& object)
+{
+    std::size_t rows = 0;
+    if (object.isNull())
+        return rows;
+
+    for (const auto& it : *object)
+    {
+        if (it.second.type() == typeid(Poco::JSON::Array::Ptr))
+            rows += it.second.extract<Poco::JSON::Array::Ptr>()->size();
+    }
+    return rows;
+}
+
+/// 拆解群組欄位名稱 "群組[序號][欄位]"，群組及欄位名稱不可含有中括號
+/// @return false: 不是群組欄位
+/// @exception Poco::DataFormatException 序號不是數字
+bool splitGroupField(const std::string& varname, std::string& grpname, unsigned& grpidx,
+                     std::string& grpkey)
+{
+    const std::size_t open1 = varname.find_first_of("[]");
+    if (open1 == std::string::npos || varname[open1] != '[')
+        return false;
+    const std::size_t close1 = varname.find_first_of("[]", open1 + 1);
+    if (close1 == std::string::npos || varname[close1] != ']')
+        return false;
+    const std::size_t open2 = close1 + 1;
+    if (open2 >= varname.size() || varname[open2] != '[')
+        return false;
+    const std::size_t close2 = varname.find_first_of("[]", open2 + 1);
+    if (close2 != varname.size() - 1 || varname[close2] != ']')
+        return false;
+
+    const std::size_t idxBegin = open1 + 1;
+    const std::size_t idxLength = close1 - idxBegin;
+    if (idxLength == 0 || idxLength > 9
+        || varname.find_first_not_of("0123456789", idxBegin) < close1)
+        throw Poco::DataFormatException("Invalid group index", varname);
+
+    grpidx = 0;
+    for (std::size_t i = idxBegin; i < close1; i++)
+        grpidx = grpidx * 10 + (varname[i] - '0');
+    grpname.assign(varname, 0, open1);
+    grpkey.assign(varname, open2 + 1, close2 - open2 - 1);
+    return true;
+}
+
+/// 用戶端快取的 API 文件是否仍是最新版本(If-None-Match 優先於 If-Modified-Since)
+bool isNotModified(const Poco::Net::HTTPRequest& request, const std::string& etag,
+                   const Poco::Timestamp& lastModified)
+{
+    if (request.has("If-None-Match"))
+    {
+        const Poco::StringTokenizer tags(request.get("If-None-Match"), ",",
+                                         Poco::StringTokenizer::TOK_IGNORE_EMPTY
+                                             | Poco::StringTokenizer::TOK_TRIM);
+        for (const auto& tag : tags)
+        {
+            if (tag == "*" || tag == etag || tag == "W/" + etag)
+                return true;
+        }
+        return false;
+    }
+
+    if (request.has("If-Modified-Since"))
+    {
+        Poco::DateTime since;
+        int tzd = 0;
+        if (Poco::DateTimeParser::tryParse(Poco::DateTimeFormat::HTTP_FORMAT,
+                                           request.get("If-Modified-Since"), since, tzd))
+            return lastModified.epochTime() <= since.timestamp().epochTime();
+    }
+    return false;
+}
+
+/// 把資料放進範本，依資料量選擇產生方式，傳回的 Parser 以 zipback() 寫出
+std::shared_ptr<Parser> renderDocument(const std::shared_ptr<const TemplatePlan>& plan,
+                                       const Poco::JSON::Object::Ptr& object)
+{
+    std::shared_ptr<Parser> parser = std::make_shared<Parser>();
+
+    if (plan->segments)
+    {
+        // 簡單的 Writer 範本: 直接串接預先切好的內容
+        parser->attach(plan);
+        parser->renderSegmented(object);
+    }
+    else if (countGroupRows(object) >= STREAM_RENDER_MIN_ROWS)
+    {
+        // 資料量大時不建立整份 DOM，邊讀範本邊輸出
+        parser->attach(plan);
+        parser->renderStreaming(object);
+    }
+    else
+    {
+        auto allVar = parser->load(plan);
+        std::list<Poco::XML::Element*> singleVar = allVar[0];
+        std::list<Poco::XML::Element*> groupVar = allVar[1];
+
+        parser->setSingleVar(object, singleVar);
+        parser->setGroupVar(object, groupVar);
+    }
+    return parser;
+}
+
+/// 批次中一筆資料的產生結果
+struct BatchResult
+{
+    bool success = false;
+    std::string data; // 成功時爲文件內容，失敗時爲錯誤訊息
+    std::string mimeType;
+};
+
+/// 平行產生 count 筆結果，並在目前的執行緒依序交給 emit。
+/// 目前的執行緒也會產生資料，另外最多排入 batchWorkers - 1 個批次工作到 pool 協助；
+/// 協助的工作排不進或還沒輪到時由目前的執行緒產生，不會互相等待。
+/// 未交出的結果最多保留 2 倍執行緒數，輸出較慢時會暫停產生，記憶體用量不隨筆數增加
+/// @param endpt 範本代碼，協助的工作與其他工作共用範本的上限
+/// @param render 產生第 n 筆結果，須可在多個執行緒同時呼叫，不可丟出例外
+/// @param emit emit 丟出例外時停止產生，並將例外傳給呼叫者
+void renderInOrder(RenderPool& pool, const std::string& endpt, std::size_t count,
+                   const std::function<BatchResult(std::size_t)>& render,
+                   const std::function<void(std::size_t, BatchResult&)>& emit)
+{
+    if (count == 0)
+        return;
+
+    // 協助的工作可能在這裡返回後才輪到，共用的資料由它們一起持有
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::function<BatchResult(std::size_t)> render;
+        std::vector<BatchResult> results;
+        std::vector<bool> ready;
+        std::size_t window = 0;
+        std::size_t next = 0; // 下一筆要產生的資料
+        std::size_t emitted = 0; // 已交出的筆數
+        std::size_t rendering = 0; // 產生中的筆數
+        bool stop = false;
+
+        /// 產生下一筆，沒有可產生的資料時傳回 false(呼叫前須已鎖定)
+        bool renderNext(std::unique_lock<std::mutex>& lock)
+        {
+            if (stop || next >= results.size() || next >= emitted + window)
+                return false;
+
+            const std::size_t n = next++;
+            rendering++;
+            lock.unlock();
+            BatchResult result = render(n);
+            lock.lock();
+            results[n] = std::move(result);
+            ready[n] = true;
+            rendering--;
+            cond.notify_all();
+            return true;
+        }
+    };
+
+    const std::size_t workers = std::clamp<std::size_t>(pool.settings().batchWorkers, 1, count);
+    auto state = std::make_shared<State>();
+    state->render = render;
+    state->results.resize(count);
+    state->ready.resize(count, false);
+    state->window = workers * 2;
+
+    // 排不進 pool 就少一個協助的工作
+    for (std::size_t i = 1; i < workers; i++)
+    {
+        RenderPool::Ticket ticket;
+        ticket.endpt = endpt;
+        ticket.priority = RenderPool::Priority::BATCH;
+        pool.post(ticket,
+                  [state]()
+                  {
+                      std::unique_lock<std::mutex> lock(state->mutex);
+                      while (!state->stop && state->next < state->results.size())
+                      {
+                          if (!state->renderNext(lock))
+                              state->cond.wait(lock);
+                      }
+                  });
+    }
+
+    // 結束前須等產生中的資料完成，render 參照的是呼叫者的變數
+    auto finish = [&state]()
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->stop = true;
+        state->cond.notify_all();
+        state->cond.wait(lock, [&state]() { return state->rendering == 0; });
+        state->render = nullptr;
+    };
+
+    try
+    {
+        for (std::size_t n = 0; n < count; n++)
+        {
+            BatchResult result;
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                while (!state->ready[n])
+                {
+                    // 第 n 筆由其他執行緒產生中，先產生後面的資料
+                    if (!state->renderNext(lock))
+                        state->cond.wait(lock);
+                }
+                result = std::move(state->results[n]);
+                state->emitted = n + 1;
+            }
+            state->cond.notify_all();
+            emit(n, result);
+        }
+    }
+    catch (...)
+    {
+        finish();
+        throw;
+    }
+    finish();
+}
+
+/// 以 chunked transfer encoding 將資料送到 socket，資料量達 CHUNK_SIZE 就送出一段
+class ChunkedStreamBuf : public std::streambuf
+{
+public:
+    static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+    explicit ChunkedStreamBuf(const std::shared_ptr<StreamSocket>& socket)
+        : mSocket(socket)
+        , mBuffer(CHUNK_SIZE)
+    {
+        setp(mBuffer.data(), mBuffer.data() + mBuffer.size());
+    }
+
+    /// 送出剩餘的資料及結尾的空 chunk
+    void close()
+    {
+        sendChunk();
+        mSocket->send(std::string("0\r\n\r\n"));
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        sendChunk();
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override
+    {
+        sendChunk();
+        return 0;
+    }
+
+private:
+    void sendChunk()
+    {
+        const auto count = pptr() - pbase();
+        if (count <= 0)
+            return;
+
+        mSocket->send(Poco::NumberFormatter::formatHex(static_cast<unsigned>(count)) + "\r\n", false);
+        mSocket->send(pbase(), static_cast<int>(count), false);
+        mSocket->send(std::string("\r\n"));
+        setp(mBuffer.data(), mBuffer.data() + mBuffer.size());
+    }
+
+    std::shared_ptr<StreamSocket> mSocket;
+    std::vector<char> mBuffer;
+};
+}
 
 MergeODF::MergeODF()
+    : mRegistry(std::make_shared<const TemplateRegistry>())
 {
     // 註冊 SQLite 連結
     Poco::Data::SQLite::Connector::registerConnector();
@@ -39,7 +498,13 @@ MergeODF::MergeODF()
     initDocApiMap();
 }
 
-MergeODF::~MergeODF() { Poco::Data::SQLite::Connector::unregisterConnector(); }
+MergeODF::~MergeODF()
+{
+    // 背景工作會寫入轉檔紀錄，須先結束
+    mRenderPool.stop();
+    mConvertScheduler.stop();
+    Poco::Data::SQLite::Connector::unregisterConnector();
+}
 
 void MergeODF::initialize()
 {
@@ -58,9 +523,23 @@ void MergeODF::initialize()
             << "source_ip TEXT NOT NULL DEFAULT '',"
             << "file_name TEXT NOT NULL DEFAULT '',"
             << "file_ext  TEXT NOT NULL DEFAULT '',"
-            << "timestamp TIMESTAMP DEFAULT CURRENT_TIMESTAMP)",
+            << "timestamp TIMESTAMP DEFAULT CURRENT_TIMESTAMP,"
+            << "queue_ms   INTEGER NOT NULL DEFAULT 0," // PDF 轉檔排隊時間(毫秒)
+            << "convert_ms INTEGER NOT NULL DEFAULT 0)", // PDF 轉檔時間(毫秒)
         now;
 
+    // 舊版建立的紀錄表沒有轉檔時間欄位
+    for (std::string column : { "queue_ms", "convert_ms" })
+    {
+        int exists = 0;
+        session << "SELECT COUNT(*) FROM pragma_table_info('logging') WHERE name = ?",
+            use(column), into(exists), now;
+        if (!exists)
+            session << "ALTER TABLE logging ADD COLUMN " << column
+                    << " INTEGER NOT NULL DEFAULT 0",
+                now;
+    }
+
     // ODF 報表範本對照檔
     session << "CREATE TABLE IF NOT EXISTS repository ("
             << "id      INTEGER PRIMARY KEY AUTOINCREMENT,"
@@ -76,6 +555,61 @@ void MergeODF::initialize()
     session << "DELETE FROM logging WHERE (strftime('%s', 'now') "
             << "- strftime('%s', timestamp)) > 86400 * 365",
         now;
+
+    // 跨請求的圖片快取容量及非同步工作的結果暫存區
+    Poco::UInt64 pictureCacheCapacity = DEFAULT_PICTURE_CACHE_CAPACITY;
+    Poco::UInt64 jobStoreCapacity = DEFAULT_JOB_STORE_CAPACITY;
+    unsigned jobTtl = DEFAULT_JOB_TTL;
+    unsigned renderWorkers = 0;
+    unsigned renderQueueSize = DEFAULT_RENDER_QUEUE_SIZE;
+    unsigned batchWorkers = 0;
+    unsigned endpointLimit = 0;
+    Poco::UInt64 heavyCost = DEFAULT_HEAVY_COST;
+    unsigned maxConversions = 0;
+    unsigned convertQueueSize = DEFAULT_CONVERT_QUEUE_SIZE;
+    unsigned convertTimeout = DEFAULT_CONVERT_TIMEOUT;
+    try
+    {
+        const Poco::AutoPtr<Poco::Util::XMLConfiguration> config(
+            new Poco::Util::XMLConfiguration(MODULE_CONFIG_FILE));
+        pictureCacheCapacity = config->getUInt64("pictureCache.capacity", pictureCacheCapacity);
+        jobStoreCapacity = config->getUInt64("asyncJobs.capacity", jobStoreCapacity);
+        jobTtl = config->getUInt("asyncJobs.ttl", jobTtl);
+        renderWorkers = config->getUInt("renderPool.workers", renderWorkers);
+        renderQueueSize = config->getUInt("renderPool.queueSize", renderQueueSize);
+        batchWorkers = config->getUInt("renderPool.batchWorkers", batchWorkers);
+        endpointLimit = config->getUInt("renderPool.endpointLimit", endpointLimit);
+        heavyCost = config->getUInt64("renderPool.heavyCost", heavyCost);
+        maxConversions = config->getUInt("pdfConvert.maxConversions", maxConversions);
+        convertQueueSize = config->getUInt("pdfConvert.queueSize", convertQueueSize);
+        convertTimeout = config->getUInt("pdfConvert.timeout", convertTimeout);
+    }
+    catch (const Poco::Exception& e)
+    {
+        LOG_WRN(logTitle() << "Failed to read " << MODULE_CONFIG_FILE << ": " << e.displayText());
+    }
+    PictureCache::instance().setCapacity(pictureCacheCapacity);
+    mJobStore.configure(jobStoreCapacity, std::chrono::seconds(jobTtl));
+    // 報表在執行緒池產生，0 表示與核心數相同；
+    // 批次工作及同一範本預設最多用一半的執行緒，其餘保留給其他的請求
+    RenderPool::Settings poolSettings;
+    poolSettings.workers
+        = renderWorkers ? renderWorkers : std::max(1U, std::thread::hardware_concurrency());
+    poolSettings.maxQueued = renderQueueSize;
+    poolSettings.batchWorkers = batchWorkers ? batchWorkers : std::max(1U, poolSettings.workers / 2);
+    poolSettings.endpointLimit
+        = endpointLimit ? endpointLimit : std::max(1U, poolSettings.workers / 2);
+    poolSettings.heavyCost = heavyCost;
+    mRenderPool.start(poolSettings);
+
+    // 每個轉檔都會載入一份文件，預設最多同時進行核心數一半的轉檔
+    ConvertScheduler::Settings convertSettings;
+    convertSettings.maxConversions
+        = maxConversions ? maxConversions
+                         : std::max(1U, std::thread::hardware_concurrency() / 2);
+    convertSettings.maxQueued = convertQueueSize;
+    convertSettings.timeout = std::chrono::seconds(convertTimeout);
+    mConvertScheduler.start(convertSettings);
 }
 
 void MergeODF::handleRequest(const Poco::Net::HTTPRequest& request,
@@ -105,6 +639,12 @@ void MergeODF::handleRequest(const Poco::Net::HTTPRequest& request,
                                             Poco::StringTokenizer::TOK_IGNORE_EMPTY
                                                 | Poco::StringTokenizer::TOK_TRIM);
         const std::size_t tokenSize = tokens.count();
+        // 非同步工作
+        if (tokenSize > 0 && tokens[0] == JOBS_PATH)
+        {
+            jobAPI(request, socket, tokens);
+            return;
+        }
         //
         if (tokenSize > 0 && tokenSize <= 2)
         {
@@ -126,12 +666,42 @@ void MergeODF::handleRequest(const Poco::Net::HTTPRequest& request,
                         return;
                     }
 
-                    makeODFReportFile(request, socket, repo, templateFile);
+                    if (OxOOL::HttpHelper::isOPTIONS(request))
+                    {
+                        makeODFReportFile(request, socket, repo, templateFile, nullptr);
+                        return;
+                    }
+
+                    // 非同步工作(?async=1)也在執行緒池編譯範本及解析資料後回覆工作代碼，
+                    // 產生報表再另外排入批次工作
+                    dispatchRender(request, socket, repo,
+                        [this, repo, templateFile](const Poco::Net::HTTPRequest& copy,
+                                                   const std::shared_ptr<StreamSocket>& client,
+                                                   const std::shared_ptr<const std::string>& body)
+                        { makeODFReportFile(copy, client, repo, templateFile, body); });
                     return;
                 }
                 else // 列出與該報表有關的 api 資訊
                 {
                     const std::string apiName = tokens[1]; // 取得 doc api 名稱
+                    // 產生報表的 API 交給執行緒池
+                    if (auto renderIt = mRenderApiMap.find(apiName); renderIt != mRenderApiMap.end())
+                    {
+                        auto renderApi = renderIt->second;
+                        if (requestMethod != renderApi.method)
+                        {
+                            OxOOL::HttpHelper::sendErrorAndShutdown(
+                                Poco::Net::HTTPResponse::HTTP_METHOD_NOT_ALLOWED, socket);
+                            return;
+                        }
+
+                        dispatchRender(request, socket, repo,
+                            [renderApi, repo](const Poco::Net::HTTPRequest& copy,
+                                              const std::shared_ptr<StreamSocket>& client,
+                                              const std::shared_ptr<const std::string>& body)
+                            { renderApi.function(copy, client, repo, body); });
+                        return;
+                    }
                     if (auto docIt = mDocApiMap.find(apiName); docIt != mDocApiMap.end())
                     {
                         auto docApi = docIt->second;
@@ -191,13 +761,178 @@ std::string MergeODF::handleAdminMessage(const StringVector& tokens)
         return result;
 
     }
+
+    // 圖片快取的使用情形
+    if (tokens.equals(0, "pictureCacheStats"))
+    {
+        const PictureCache::Statistics stats = PictureCache::instance().statistics();
+        Poco::JSON::Object json;
+        json.set("hits", stats.hits);
+        json.set("misses", stats.misses);
+        json.set("entries", stats.entries);
+        json.set("bytes", stats.bytes);
+        json.set("capacity", stats.capacity);
+
+        std::ostringstream oss;
+        json.stringify(oss);
+        return "pictureCacheStats " + oss.str();
+    }
+
+    // 執行緒池的使用情形
+    if (tokens.equals(0, "renderPoolStats"))
+    {
+        const RenderPool::Statistics stats = mRenderPool.statistics();
+        // 各類工作的佇列長度及等待時間
+        auto classJson = [](const RenderPool::ClassStatistics& cls)
+        {
+            Poco::JSON::Object::Ptr json = new Poco::JSON::Object();
+            json->set("running", cls.running);
+            json->set("queued", cls.queued);
+            json->set("queuedCost", cls.queuedCost);
+            json->set("completed", cls.completed);
+            json->set("rejected", cls.rejected);
+            json->set("averageWaitSeconds", cls.averageWaitSeconds);
+            json->set("longestWaitSeconds", cls.longestWaitSeconds);
+            return json;
+        };
+
+        Poco::JSON::Object json;
+        json.set("workers", stats.settings.workers);
+        json.set("batchWorkers", stats.settings.batchWorkers);
+        json.set("endpointLimit", stats.settings.endpointLimit);
+        json.set("heavyCost", stats.settings.heavyCost);
+        json.set("maxQueued", stats.settings.maxQueued);
+        json.set("completed", stats.completed);
+        json.set("rejected", stats.rejected);
+        json.set("limited", stats.limited);
+        json.set("demoted", stats.demoted);
+        json.set("averageSeconds", stats.averageSeconds);
+        json.set("interactive", classJson(stats.interactive));
+        json.set("batch", classJson(stats.batch));
+
+        std::ostringstream oss;
+        json.stringify(oss);
+        return "renderPoolStats " + oss.str();
+    }
+
+    // PDF 轉檔的排隊情形
+    if (tokens.equals(0, "pdfConvertStats"))
+    {
+        const ConvertScheduler::Statistics stats = mConvertScheduler.statistics();
+        Poco::JSON::Object json;
+        json.set("maxConversions", stats.settings.maxConversions);
+        json.set("maxQueued", stats.settings.maxQueued);
+        json.set("timeout", static_cast<Poco::Int64>(stats.settings.timeout.count()));
+        json.set("active", stats.active);
+        json.set("queued", stats.queued);
+        json.set("completed", stats.completed);
+        json.set("failed", stats.failed);
+        json.set("timedOut", stats.timedOut);
+        json.set("rejected", stats.rejected);
+        json.set("averageWaitSeconds", stats.averageWaitSeconds);
+        json.set("averageConvertSeconds", stats.averageConvertSeconds);
+
+        std::ostringstream oss;
+        json.stringify(oss);
+        return "pdfConvertStats " + oss.str();
+    }
+
+    // 非同步工作的數量及結果暫存區用量
+    if (tokens.equals(0, "asyncJobStats"))
+    {
+        const JobStore::Statistics stats = mJobStore.statistics();
+        Poco::JSON::Object json;
+        json.set("queued", stats.queued);
+        json.set("running", stats.running);
+        json.set("done", stats.done);
+        json.set("failed", stats.failed);
+        json.set("bytes", stats.bytes);
+        json.set("capacity", stats.capacity);
+
+        std::ostringstream oss;
+        json.stringify(oss);
+        return "asyncJobStats " + oss.str();
+    }
     return "";
 }
 
+void MergeODF::dispatchRender(const Poco::Net::HTTPRequest& request,
+                              const std::shared_ptr<StreamSocket>& socket,
+                              const RepositoryStruct& repo,
+                              const RenderHandler& handler)
+{
+    // 請求物件及內容在 handleRequest() 結束後就不再有效，複製一份給執行緒池
+    auto copy = std::make_shared<Poco::Net::HTTPRequest>(request.getMethod(), request.getURI(),
+                                                         request.getVersion());
+    for (const auto& header : request)
+        copy->add(header.first, header.second);
+    auto body = copyRequestBody(socket);
+
+    // 有帶 ?priority=batch 的請求與其他批次工作排在一起，不影響互動的請求
+    const Poco::Net::HTMLForm urlParam(request);
+    RenderPool::Ticket ticket;
+    ticket.endpt = repo.endpt;
+    if (urlParam.get("priority", "") == "batch")
+        ticket.priority = RenderPool::Priority::BATCH;
+    // 範本尚未編譯時只依資料估計
+    const auto state = findTemplateState(repo.endpt);
+    ticket.cost = estimateRenderCost(state ? state->plan.get() : nullptr, *body,
+                                     urlParam.has("outputPDF")
+                                         && urlParam.get("outputPDF") != "false");
+
+    const RenderPool::Admission admission = mRenderPool.post(ticket,
+        [this, handler, copy, socket, body]()
+        {
+            try
+            {
+                handler(*copy, socket, body);
+            }
+            catch (const std::exception& e)
+            {
+                // 尚未回應就失敗(例如範本無法編譯)
+                LOG_ERR(logTitle() << "Failed to handle " << copy->getURI() << ": " << e.what());
+                OxOOL::HttpHelper::sendErrorAndShutdown(
+                    Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR, socket);
+            }
+        },
+        [socket]()
+        {
+            // 服務停止時還在排隊
+            OxOOL::HttpHelper::sendErrorAndShutdown(
+                Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE, socket, "Server is shutting down");
+        });
+
+    if (admission != RenderPool::Admission::ACCEPTED)
+    {
+        LOG_WRN(logTitle() << "Reject " << copy->getURI() << " (cost " << ticket.cost << "): "
+                           << (admission == RenderPool::Admission::LIMITED
+                                   ? "too many requests for this template"
+                                   : "render queue is full"));
+        sendRejected(socket, admission, ticket.priority);
+    }
+}
+
+void MergeODF::sendRejected(const std::shared_ptr<StreamSocket>& socket,
+                            const RenderPool::Admission admission,
+                            const RenderPool::Priority priority)
+{
+    OxOOL::HttpHelper::KeyValueMap extraHeader;
+    extraHeader["Access-Control-Allow-Origin"] = "*";
+    extraHeader["Retry-After"] = std::to_string(mRenderPool.retryAfter(priority));
+    if (admission == RenderPool::Admission::LIMITED)
+        OxOOL::HttpHelper::sendErrorAndShutdown(Poco::Net::HTTPResponse::HTTP_TOO_MANY_REQUESTS,
+                                                socket, "Too many requests for this template",
+                                                extraHeader);
+    else
+        OxOOL::HttpHelper::sendErrorAndShutdown(Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
+                                                socket, "Server is busy", extraHeader);
+}
+
 void MergeODF::makeODFReportFile(const Poco::Net::HTTPRequest& request,
                                  const std::shared_ptr<StreamSocket>& socket,
                                  const RepositoryStruct& repo,
-                                 const std::string& templateFile)
+                                 const std::string& templateFile,
+                                 const std::shared_ptr<const std::string>& body)
 {
     OxOOL::HttpHelper::KeyValueMap extraHeader;
     extraHeader["Access-Control-Allow-Origin"] = "*";
@@ -219,37 +954,23 @@ void MergeODF::makeODFReportFile(const Poco::Net::HTTPRequest& request,
     Poco::Net::HTMLForm urlParam(request); // 網址列參數
     // 有帶 ?outputPDF 且不等於 false，表示要輸出爲 PDF 格式
     bool toPDF = (urlParam.has("outputPDF") && urlParam.get("outputPDF") != "false");
+    const bool async = isAsyncRequest(urlParam);
+
+    // 範本的解壓縮與 XML 前處理只在範本變動時做一次，之後沿用編譯結果
+    const auto plan = getTemplatePlan(repo.endpt, templateFile);
 
     Poco::JSON::Object::Ptr object;
+    auto binder = std::make_shared<JsonBinder>(plan->binding);
     std::string jsonParseMessage;
-    Poco::MemoryInputStream message(&socket->getInBuffer()[0], socket->getInBuffer().size());
+    Poco::MemoryInputStream message(body->data(), body->size());
     // 讀取 POST 資料
     // 直接傳遞 json 內容
     if (request.getContentType() == "application/json")
     {
-        std::string line, data;
-        std::istream &iss(message);
-        while (!iss.eof())
-        {
-            std::getline(iss, line);
-            data += line;
-        }
-        // 解析 request body to json
-        std::string jstr = data;
-
-        jstr = keyword2Lower(jstr, "null");
-        jstr = keyword2Lower(jstr, "true");
-        jstr = keyword2Lower(jstr, "false");
-
-        Poco::JSON::Parser jparser;
-        jparser.setAllowComments(true);
-        Poco::Dynamic::Var result;
-
-        // Parse data to PocoJSON
+        // 直接讀取請求內容，只保留範本用到的鍵值，圖片在讀取時就解碼
         try
         {
-            result = jparser.parse(jstr);
-            object = result.extract<Poco::JSON::Object::Ptr>();
+            object = binder->bind(body->data(), body->size());
         }
         catch (Poco::Exception& e)
         {
@@ -259,7 +980,8 @@ void MergeODF::makeODFReportFile(const Poco::Net::HTTPRequest& request,
     else
     {
         Poco::Net::HTMLForm form;
-        OxOOL::HttpHelper::PartHandler partHandler;
+        // 圖片變數可以直接以檔案上傳，不需 base64 編碼
+        PicturePartHandler partHandler(plan->binding);
         // 不限制欄位數量
         form.setFieldLimit(0);
         // 讀取 HTTML Form.
@@ -268,7 +990,7 @@ void MergeODF::makeODFReportFile(const Poco::Net::HTTPRequest& request,
         // 資料形式如果是 post HTML Form 上來
         try
         {
-            object = parseArray2Form(form);
+            object = parseArray2Form(form, partHandler, plan->binding);
         }
         catch (Poco::Exception& e)
         {
@@ -285,167 +1007,361 @@ void MergeODF::makeODFReportFile(const Poco::Net::HTTPRequest& request,
         return;
     }
 
-    std::shared_ptr<Parser> parser = std::make_shared<Parser>();
-    parser->extract(templateFile); // 解壓縮範本檔
+    if (async)
+    {
+        submitReportJob(socket, repo, plan, binder, body, object, toPDF);
+        return;
+    }
 
-    // XML 前處理:  遍歷文件的步驟都要在這裡處理,不然隨著文件的內容增加,會導致遍歷時間大量增長
     //把 form 的資料放進 xml 檔案
-    auto allVar = parser->scanVarPtr();
-    std::list<Poco::XML::Element*> singleVar = allVar[0];
-    std::list<Poco::XML::Element*> groupVar = allVar[1];
-
-    parser->setSingleVar(object, singleVar);
-    parser->setGroupVar(object, groupVar);
-    const auto zip2 = parser->zipback();
+    std::shared_ptr<Parser> parser = renderDocument(plan, object);
+    // 背景解碼的圖片要在寫出前完成
+    binder->waitPictures();
+    const std::string extName = plan->doctype == DocType::SPREADSHEET ? ".ods" : ".odt";
+    sendReport(socket, repo, parser, extName, toPDF, extraHeader);
+}
 
+void MergeODF::sendReport(const std::shared_ptr<StreamSocket>& socket,
+                          const RepositoryStruct& repo,
+                          const std::shared_ptr<Parser>& parser,
+                          const std::string& extName,
+                          const bool toPDF,
+                          const std::map<std::string, std::string>& extraHeader)
+{
     if (!toPDF)
     {
-        const std::string mimeType = OxOOL::HttpHelper::getMimeType(zip2);
+        // 邊產生邊送出，不必等整份文件完成
         Poco::Net::HTTPResponse response;
         for (auto it : extraHeader)
         {
             response.set(it.first, it.second);
         }
-        response.set("Content-Disposition", "attachment; filename=\"" + zip2 + "\"");
-        OxOOL::HttpHelper::sendFileAndShutdown(socket, zip2, mimeType, &response, true);
-        Poco::File(zip2).remove(); // 移除檔案
+        response.setContentType(parser->getMimeType());
+        response.set("Content-Disposition", "attachment; filename=\"" + repo.endpt + extName + "\"");
+        response.setChunkedTransferEncoding(true);
+        response.set("Connection", "close");
+        socket->send(response);
+
+        bool success = true;
+        ChunkedStreamBuf chunked(socket);
+        std::ostream body(&chunked);
+        try
+        {
+            parser->zipback(body);
+            body.flush();
+            chunked.close();
+        }
+        catch (const std::exception& e)
+        {
+            // 檔頭已送出，只能中斷連線讓用戶端知道資料不完整
+            LOG_ERR(logTitle() << "Failed to generate " << repo.endpt << extName << ": " << e.what());
+            success = false;
+        }
+        socket->shutdown();
+        log(socket, success, repo, toPDF);
+        return;
     }
     else
     {
-        LOG_INF(logTitle() << "Convert " << zip2 << " to PDF.");
-        // 取得轉檔用的 Broker
-        auto docBroker = OxOOL::ConvertBroker::create(zip2, "pdf");
-        // 以唯讀開啟
-        if (!docBroker->loadDocumentReadonly(socket))
+        // 轉檔需要實體檔案
+        const std::string zip2
+            = writeTemporaryFile(extName, [&parser](std::ostream& out) { parser->zipback(out); });
+
+        // 轉檔結束後才記錄，包含排隊及轉檔的時間
+        const std::string sourceIP = socket->clientAddress();
+        convertToPDF(socket, zip2, repo.endpt,
+                     [this, sourceIP, repo](const ConvertScheduler::Result& result)
+                     {
+                         // 文件沒有載入就結束表示轉檔失敗
+                         log(sourceIP, result.finished && result.loaded, repo, true,
+                             result.queued.count(), result.converting.count());
+                     });
+    }
+}
+
+void MergeODF::convertToPDF(const std::shared_ptr<StreamSocket>& socket,
+                            const std::string& file,
+                            const std::string& owner,
+                            const ConvertScheduler::Callback& done)
+{
+    LOG_INF(logTitle() << "Convert " << file << " to PDF.");
+    auto finished = [this, socket, file, done](const ConvertScheduler::Result& result)
+    {
+        if (result.timedOut)
+            LOG_ERR(logTitle() << "PDF conversion of " << file << " timed out after "
+                               << result.converting.count() << " ms.");
+        else if (!result.finished)
+        {
+            // ConvertBroker 沒有接手，須自行回應
+            LOG_ERR(logTitle() << "Failed to create Client Session for " << file << ".");
+            OxOOL::HttpHelper::sendErrorAndShutdown(
+                Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR, socket);
+        }
+        else if (!result.loaded)
+            LOG_ERR(logTitle() << "PDF conversion of " << file << " ended before the document was loaded.");
+        if (done)
+            done(result);
+    };
+
+    if (!mConvertScheduler.submit(file, socket, owner, finished))
+    {
+        LOG_WRN(logTitle() << "PDF conversion queue is full, reject " << file << ".");
+        Poco::File(file).remove();
+
+        OxOOL::HttpHelper::KeyValueMap extraHeader;
+        extraHeader["Access-Control-Allow-Origin"] = "*";
+        extraHeader["Retry-After"] = std::to_string(mConvertScheduler.retryAfter());
+        OxOOL::HttpHelper::sendErrorAndShutdown(Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
+                                                socket, "PDF conversion is busy", extraHeader);
+        if (done)
+            done(ConvertScheduler::Result());
+    }
+}
+
+void MergeODF::submitReportJob(const std::shared_ptr<StreamSocket>& socket,
+                               const RepositoryStruct& repo,
+                               const std::shared_ptr<const TemplatePlan>& plan,
+                               const std::shared_ptr<JsonBinder>& binder,
+                               const std::shared_ptr<const std::string>& body,
+                               const Poco::JSON::Object::Ptr& object,
+                               const bool toPDF)
+{
+    const std::string sourceIP = socket->clientAddress();
+    // body 須保留到工作結束: 背景解碼的圖片直接讀取其中的 base64 字串
+    auto work = [this, repo, plan, binder, body, object, toPDF, sourceIP]()
+    {
+        JobStore::Output output;
+        try
+        {
+            std::shared_ptr<Parser> parser = renderDocument(plan, object);
+            binder->waitPictures();
+
+            std::ostringstream document;
+            parser->zipback(document);
+            output.mimeType = parser->getMimeType();
+            output.data = document.str();
+        }
+        catch (const std::exception& e)
         {
-            LOG_ERR(logTitle() << "Failed to create Client Session on docKey ["
-                               << docBroker->getDocKey() << "].");
-            log(socket, false, repo, toPDF);
+            LOG_ERR(logTitle() << "Failed to generate " << repo.endpt << " in background: "
+                               << e.what());
+            log(sourceIP, false, repo, toPDF);
+            throw;
+        }
+        // 轉 PDF 的工作在取回結果、轉檔結束後才記錄
+        if (!toPDF)
+            log(sourceIP, true, repo, toPDF);
+        return output;
+    };
+
+    const std::string extName = plan->doctype == DocType::SPREADSHEET ? ".ods" : ".odt";
+    const std::string id = mJobStore.create(repo.endpt, repo.endpt + extName, toPDF);
+    // 沒有人在等候回應，一律以批次處理
+    RenderPool::Ticket ticket;
+    ticket.endpt = repo.endpt;
+    ticket.priority = RenderPool::Priority::BATCH;
+    ticket.cost = estimateRenderCost(plan.get(), *body, toPDF);
+    const RenderPool::Admission admission
+        = mRenderPool.post(ticket, [this, id, work]() { mJobStore.run(id, work); },
+                           [this, id]() { mJobStore.cancel(id, "Server is shutting down"); });
+    if (admission != RenderPool::Admission::ACCEPTED)
+    {
+        mJobStore.remove(id);
+        sendRejected(socket, admission, ticket.priority);
+        log(socket, false, repo, toPDF);
+        return;
+    }
+
+    const std::string url = getDetail().serviceURI + JOBS_PATH + "/" + id;
+    Poco::JSON::Object json;
+    json.set("id", id);
+    json.set("status", RenderJob::statusName(RenderJob::Status::QUEUED));
+    json.set("url", url);
+    json.set("result", url + "/result");
+    std::ostringstream oss;
+    json.stringify(oss);
+
+    OxOOL::HttpHelper::KeyValueMap extraHeader;
+    extraHeader["Access-Control-Allow-Origin"] = "*";
+    extraHeader["Location"] = url;
+    OxOOL::HttpHelper::sendResponseAndShutdown(socket, oss.str(),
+        Poco::Net::HTTPResponse::HTTP_ACCEPTED, "application/json", extraHeader);
+}
+
+void MergeODF::jobAPI(const Poco::Net::HTTPRequest& request,
+                      const std::shared_ptr<StreamSocket>& socket,
+                      const Poco::StringTokenizer& tokens)
+{
+    if (request.getMethod() != Poco::Net::HTTPRequest::HTTP_GET)
+    {
+        OxOOL::HttpHelper::sendErrorAndShutdown(
+            Poco::Net::HTTPResponse::HTTP_METHOD_NOT_ALLOWED, socket);
+        return;
+    }
+
+    RenderJob job;
+    const bool wantResult = tokens.count() == 3 && tokens[2] == "result";
+    if ((tokens.count() != 2 && !wantResult) || !mJobStore.find(tokens[1], job))
+    {
+        // 沒有這個工作，或結果已過期移除
+        OxOOL::HttpHelper::sendErrorAndShutdown(Poco::Net::HTTPResponse::HTTP_NOT_FOUND, socket);
+        return;
+    }
+
+    OxOOL::HttpHelper::KeyValueMap extraHeader;
+    extraHeader["Access-Control-Allow-Origin"] = "*";
+
+    // 取回結果
+    if (wantResult && job.status == RenderJob::Status::DONE)
+    {
+        if (!job.toPDF)
+        {
+            extraHeader["Content-Disposition"] = "attachment; filename=\"" + job.fileName + "\"";
+            OxOOL::HttpHelper::sendResponseAndShutdown(socket, *job.result,
+                Poco::Net::HTTPResponse::HTTP_OK, job.mimeType, extraHeader);
             return;
         }
+
+        // 轉檔需要實體檔案
+        std::string zip2;
+        try
+        {
+            zip2 = writeTemporaryFile("." + Poco::Path(job.fileName).getExtension(),
+                                      [&job](std::ostream& out)
+                                      { out.write(job.result->data(), job.result->size()); });
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERR(logTitle() << "Failed to write " << job.fileName << " for PDF conversion: "
+                               << e.what());
+            OxOOL::HttpHelper::sendErrorAndShutdown(
+                Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR, socket);
+            return;
+        }
+        // 每次取回都重新轉檔(ConvertBroker 直接回應連線，無法保留 PDF)，每次都記錄
+        std::string endpt = job.endpt;
+        RepositoryStruct repo = getRepository(endpt);
+        if (repo.endpt.empty())
+        {
+            // 範本已刪除
+            repo.endpt = job.endpt;
+            repo.docname = Poco::Path(job.fileName).getBaseName();
+            repo.extname = Poco::Path(job.fileName).getExtension();
+        }
+        const std::string sourceIP = socket->clientAddress();
+        convertToPDF(socket, zip2, job.endpt,
+                     [this, sourceIP, repo](const ConvertScheduler::Result& result)
+                     {
+                         log(sourceIP, result.finished && result.loaded, repo, true,
+                             result.queued.count(), result.converting.count());
+                     });
+        return;
+    }
+
+    // 工作狀態；尚未完成時取回結果也傳回狀態(202)
+    Poco::JSON::Object json;
+    json.set("id", job.id);
+    json.set("endpt", job.endpt);
+    json.set("status", RenderJob::statusName(job.status));
+    json.set("created", Poco::DateTimeFormatter::format(job.created, Poco::DateTimeFormat::ISO8601_FORMAT));
+    if (job.status == RenderJob::Status::DONE)
+    {
+        json.set("size", job.result->size());
+        json.set("result", getDetail().serviceURI + JOBS_PATH + "/" + job.id + "/result");
     }
+    else if (job.status == RenderJob::Status::FAILED)
+        json.set("error", job.error);
 
-    log(socket, true, repo, toPDF);
+    std::ostringstream oss;
+    json.stringify(oss);
+
+    Poco::Net::HTTPResponse::HTTPStatus status = Poco::Net::HTTPResponse::HTTP_OK;
+    if (wantResult)
+        status = job.status == RenderJob::Status::FAILED
+                     ? Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR
+                     : Poco::Net::HTTPResponse::HTTP_ACCEPTED;
+    OxOOL::HttpHelper::sendResponseAndShutdown(socket, oss.str(), status, "application/json",
+                                               extraHeader);
 }
 
 void MergeODF::log(const std::shared_ptr<StreamSocket>& socket,
                    const bool success,
                    const RepositoryStruct& repo,
                    const bool toPDF)
+{
+    // 來源 IP
+    log(socket->clientAddress(), success, repo, toPDF);
+}
+
+void MergeODF::log(const std::string& sourceIP,
+                   const bool success,
+                   const RepositoryStruct& repo,
+                   const bool toPDF,
+                   const Poco::Int64 queueMs,
+                   const Poco::Int64 convertMs)
 {
     bool status = success;
     bool to_pdf = toPDF;
     std::string file_name = repo.docname;
     std::string file_ext = repo.extname;
+    std::string source_ip = sourceIP;
+    Poco::Int64 queue_ms = queueMs;
+    Poco::Int64 convert_ms = convertMs;
 
-    // 來源 IP
-    std::string sourceIP = socket->clientAddress();
     auto session = getDataSession();
-    session << "INSERT INTO logging (status, to_pdf, source_ip, file_name, file_ext) "
-            << "VALUES(?, ?, ?, ?, ?)",
-            use(status), use(to_pdf), use(sourceIP), use(file_name), use(file_ext), now;
+    session << "INSERT INTO logging (status, to_pdf, source_ip, file_name, file_ext, "
+            << "queue_ms, convert_ms) VALUES(?, ?, ?, ?, ?, ?, ?)",
+            use(status), use(to_pdf), use(source_ip), use(file_name), use(file_ext),
+            use(queue_ms), use(convert_ms), now;
 }
 
-/// json: 關鍵字轉小寫，但以quote包起來的字串不處理
-std::string MergeODF::keyword2Lower(const std::string& in, const std::string& keyword)
+/// 解析表單陣列： 詳細資料[0][姓名] => 詳細資料:姓名
+Poco::JSON::Object::Ptr MergeODF::parseArray2Form(const Poco::Net::HTMLForm& form,
+                                                  const PicturePartHandler& parts,
+                                                  const JsonBinding& binding)
 {
-    std::string newStr = in;
-
-    Poco::RegularExpression re(keyword, Poco::RegularExpression::RE_CASELESS);
-    Poco::RegularExpression::Match match;
-
-    auto matchSize = re.match(newStr, 0, match);
+    // 詳細資料[0][姓名] => {"詳細資料": [ {"姓名": ""} ]}
+    Poco::JSON::Object::Ptr formJson = new Poco::JSON::Object();
+    // 各群組的資料列，依序號排序
+    // 序號有可能 1, 3, 2, 6 不照順序或不連續，只建立有出現的列，輸出時略過沒有的序號
+    std::map<std::string, std::map<unsigned, Poco::JSON::Object::Ptr>> groups;
 
-    while (matchSize > 0)
+    std::string grpname, grpkey;
+    unsigned grpidx = 0;
+    auto addField = [&](const std::string& varname, const Poco::Dynamic::Var& value)
     {
-        // @TODO: add check for "   null   "
-        if (newStr[match.offset - 1] != '"' &&
-                newStr[match.offset + keyword.size()] != '"')
+        if (!splitGroupField(varname, grpname, grpidx, grpkey))
         {
-            for(unsigned idx = 0; idx < keyword.size(); idx ++)
-                newStr[match.offset + idx] = keyword[idx];
+            if (binding.keys.count(varname))
+                formJson->set(varname, value);
+            return;
         }
-        matchSize = re.match(newStr, match.offset + match.length, match);
-    }
-    return newStr;
-}
 
-/// 解析表單陣列： 詳細資料[0][姓名] => 詳細資料:姓名
-Poco::JSON::Object::Ptr MergeODF::parseArray2Form(const Poco::Net::HTMLForm& form)
-{
-    // {"詳細資料": [ {"姓名": ""} ]}
-    std::map <std::string,
-        std::vector<std::map<std::string, std::string>>
-            > grpNames;
-    // 詳細資料[0][姓名] => {"詳細資料": [ {"姓名": ""} ]}
-    Poco::JSON::Object::Ptr formJson = new Poco::JSON::Object();
+        // 範本沒有用到的群組或欄位不保留
+        if (!binding.keys.count(grpname))
+            return;
+        const auto groupKeys = binding.groupKeys.find(grpname);
+        if (groupKeys != binding.groupKeys.end() && !groupKeys->second.count(grpkey))
+            return;
 
-    for (auto iterator = form.begin();
-            iterator != form.end();
-            iterator ++)
-    {
-        const auto varname = iterator->first;
-        const auto value = iterator->second;
-
-        auto res = "^([^\\]\\[]*)\\[([^\\]\\[]*)\\]\\[([^\\]\\[]*)\\]$";
-        Poco::RegularExpression re(res);
-        Poco::RegularExpression::MatchVec posVec;
-        re.match(varname, 0, posVec);
-        if (posVec.empty())
-        {
-            formJson->set(varname, Poco::Dynamic::Var(value));
-            continue;
-        }
-
-        const auto grpname = varname.substr(posVec[1].offset,
-                posVec[1].length);
-        const auto grpidxRaw = varname.substr(posVec[2].offset,
-                posVec[2].length);
-        const auto grpkey = varname.substr(posVec[3].offset,
-                posVec[3].length);
-        const int grpidx = std::stoi(grpidxRaw);
-
-        //std::vector<std::map<std::string, std::string>> dummy;
-        if (grpNames.find(grpname) == grpNames.end())
-        {  // default array
-            std::vector<std::map<std::string, std::string>> dummy;
-            grpNames[grpname] = dummy;
-        }
-
-        // 詳細資料[n][姓名]: n to resize
-        // n 有可能 1, 3, 2, 6 不照順序, 這裡以 n 當作 resize 依據
-        // 就可以調整陣列大小了
-        if (grpNames[grpname].size() < (unsigned)(grpidx + 1))
-            grpNames[grpname].resize(grpidx + 1);
-        grpNames[grpname].at(grpidx)[grpkey] = value;
-    }
-    // {"詳細資料": [ {"姓名": ""} ]} => 詳細資料:姓名=value
-    //
-    for(auto itgrp = grpNames.begin();
-            itgrp != grpNames.end();
-            itgrp++)
-    {
-        auto gNames = itgrp->second;
-        for(unsigned grpidx = 0; grpidx < gNames.size(); grpidx ++)
-        {
-            auto names = gNames.at(grpidx);
-            Poco::JSON::Object::Ptr tempData = new Poco::JSON::Object();
-            for(auto itname = names.begin();
-                    itname != names.end();
-                    itname++)
-            {
-                tempData->set(itname->first, Poco::Dynamic::Var(itname->second));
-            }
-            if (names.size() != 0 )
-            {
-                if(!formJson->has(itgrp->first))
-                {
-                    Poco::JSON::Array::Ptr newArr = new Poco::JSON::Array();
-                    formJson->set(itgrp->first, newArr);
-                }
-                formJson->getArray(itgrp->first)->add(tempData);
-            }
-        }
+        Poco::JSON::Object::Ptr& row = groups[grpname][grpidx];
+        if (row.isNull())
+            row = new Poco::JSON::Object();
+        row->set(grpkey, value);
+    };
+
+    for (const auto& field : form)
+        addField(field.first, Poco::Dynamic::Var(field.second));
+    // 以檔案上傳的圖片，同名時取代文字欄位
+    for (const auto& picture : parts.pictures())
+        addField(picture.first, Poco::Dynamic::Var(picture.second));
+
+    for (const auto& group : groups)
+    {
+        Poco::JSON::Array::Ptr rows = new Poco::JSON::Array();
+        for (const auto& row : group.second)
+            rows->add(row.second);
+        formJson->set(group.first, rows);
     }
     return formJson;
 }
@@ -550,27 +1466,45 @@ void MergeODF::initDocApiMap()
                     function : std::bind(&MergeODF::docAccessTimes, this, std::placeholders::_1,
                                         std::placeholders::_2, std::placeholders::_3)
                 } } };
+
+    mRenderApiMap
+        = { { // doc_id/batch
+                "batch",
+                {
+                    method : Poco::Net::HTTPRequest::HTTP_POST,
+                    function : std::bind(&MergeODF::docBatch, this, std::placeholders::_1,
+                                        std::placeholders::_2, std::placeholders::_3,
+                                        std::placeholders::_4)
+                } },
+            { // doc_id/mailmerge
+                "mailmerge",
+                {
+                    method : Poco::Net::HTTPRequest::HTTP_POST,
+                    function : std::bind(&MergeODF::docMailMerge, this, std::placeholders::_1,
+                                        std::placeholders::_2, std::placeholders::_3,
+                                        std::placeholders::_4)
+                } } };
 }
 
 void MergeODF::docApi(const Poco::Net::HTTPRequest& request,
             const std::shared_ptr<StreamSocket>& socket,
             const RepositoryStruct& repo)
 {
-    apiHelper(request, socket, true, repo.endpt);
+    apiHelper(request, socket, { repo });
 }
 
 void MergeODF::docYaml(const Poco::Net::HTTPRequest& request,
                        const std::shared_ptr<StreamSocket>& socket,
                        const RepositoryStruct& repo)
 {
-    apiHelper(request, socket, true, repo.endpt, false, true);
+    apiHelper(request, socket, { repo }, false, true);
 }
 
 void MergeODF::docJson(const Poco::Net::HTTPRequest& request,
                        const std::shared_ptr<StreamSocket>& socket,
                        const RepositoryStruct& repo)
 {
-    apiHelper(request, socket, true, repo.endpt, true);
+    apiHelper(request, socket, { repo }, true);
 }
 
 void MergeODF::docAccessTimes(const Poco::Net::HTTPRequest& /* request */,
@@ -582,6 +1516,196 @@ void MergeODF::docAccessTimes(const Poco::Net::HTTPRequest& /* request */,
         socket, jsonStr, Poco::Net::HTTPResponse::HTTP_OK, "application/json");
 }
 
+void MergeODF::docBatch(const Poco::Net::HTTPRequest& request,
+                        const std::shared_ptr<StreamSocket>& socket,
+                        const RepositoryStruct& repo,
+                        const std::shared_ptr<const std::string>& body)
+{
+    // 範本查詢、呼叫次數及範本編譯結果整批只處理一次
+    updateAccessTimes(repo.endpt);
+    const std::string templateFile = getRepositoryPath() + "/" + repo.endpt + "." + repo.extname;
+    const auto plan = getTemplatePlan(repo.endpt, templateFile);
+
+    // JSON 陣列或 NDJSON，每筆資料產生一份文件
+    JsonBinder binder(plan->binding);
+    std::vector<Poco::JSON::Object::Ptr> records;
+    std::string jsonParseMessage;
+    try
+    {
+        records = binder.bindBatch(body->data(), body->size());
+        if (records.empty())
+            jsonParseMessage = "No records";
+    }
+    catch (const Poco::Exception&)
+    {
+        jsonParseMessage = "Json format error";
+    }
+
+    if (!jsonParseMessage.empty())
+    {
+        OxOOL::HttpHelper::sendErrorAndShutdown(
+            Poco::Net::HTTPResponse::HTTPStatus::HTTP_BAD_REQUEST, socket, jsonParseMessage);
+        log(socket, false, repo, false);
+        return;
+    }
+    // 圖片在所有資料間共用，產生文件前先解碼完成
+    binder.waitPictures();
+
+    // ?format=multipart 以 multipart/mixed 輸出，否則整批包成一個 zip 檔
+    Poco::Net::HTMLForm urlParam(request);
+    const bool multipart = urlParam.get("format", "zip") == "multipart";
+    const std::string extName = plan->doctype == DocType::SPREADSHEET ? ".ods" : ".odt";
+    const std::string boundary = Poco::Net::MultipartWriter::createBoundary();
+
+    Poco::Net::HTTPResponse response;
+    response.set("Access-Control-Allow-Origin", "*");
+    if (multipart)
+        response.setContentType("multipart/mixed; boundary=\"" + boundary + "\"");
+    else
+    {
+        response.setContentType("application/zip");
+        response.set("Content-Disposition", "attachment; filename=\"" + repo.endpt + ".zip\"");
+    }
+    response.setChunkedTransferEncoding(true);
+    response.set("Connection", "close");
+    socket->send(response);
+
+    bool success = true;
+    std::size_t failures = 0;
+    ChunkedStreamBuf chunked(socket);
+    std::ostream out(&chunked);
+    try
+    {
+        std::unique_ptr<ZipWriter> zip;
+        std::unique_ptr<Poco::Net::MultipartWriter> parts;
+        if (multipart)
+            parts.reset(new Poco::Net::MultipartWriter(out, boundary));
+        else
+            zip.reset(new ZipWriter(out));
+
+        // 各筆資料平行產生，依原本的順序輸出
+        renderInOrder(
+            mRenderPool, repo.endpt, records.size(),
+            [&](std::size_t n)
+            {
+                BatchResult result;
+                try
+                {
+                    std::shared_ptr<Parser> parser = renderDocument(plan, records[n]);
+                    std::ostringstream document;
+                    parser->zipback(document);
+                    result.data = document.str();
+                    result.mimeType = parser->getMimeType();
+                    result.success = true;
+                }
+                catch (const Poco::Exception& e)
+                {
+                    result.data = e.displayText();
+                }
+                catch (const std::exception& e)
+                {
+                    result.data = e.what();
+                }
+                records[n] = nullptr; // 資料用完就釋放
+                return result;
+            },
+            [&](std::size_t n, BatchResult& result)
+            {
+                // 檔名依資料順序編號，失敗的資料以同編號的 .error.txt 記錄錯誤訊息
+                const std::string name = repo.endpt + "-" + std::to_string(n + 1)
+                                         + (result.success ? extName : ".error.txt");
+                if (!result.success)
+                {
+                    LOG_ERR(logTitle() << "Failed to generate " << name << ": " << result.data);
+                    failures++;
+                }
+
+                if (zip)
+                {
+                    // ODF 文件本身已壓縮，不再壓縮一次
+                    zip->add(name, result.data, !result.success);
+                }
+                else
+                {
+                    Poco::Net::MessageHeader header;
+                    header.set("Content-Type",
+                               result.success ? result.mimeType : "text/plain; charset=utf-8");
+                    header.set("Content-Disposition", "attachment; filename=\"" + name + "\"");
+                    parts->nextPart(header);
+                    out.write(result.data.data(), result.data.size());
+                }
+            });
+
+        if (zip)
+            zip->close();
+        else
+            parts->close();
+        out.flush();
+        chunked.close();
+    }
+    catch (const std::exception& e)
+    {
+        // 檔頭已送出，只能中斷連線讓用戶端知道資料不完整
+        LOG_ERR(logTitle() << "Failed to generate batch of " << repo.endpt << ": " << e.what());
+        success = false;
+    }
+    socket->shutdown();
+    LOG_INF(logTitle() << "Batch of " << repo.endpt << ": " << records.size() << " records, "
+                       << failures << " failed.");
+    log(socket, success && failures == 0, repo, false);
+}
+
+void MergeODF::docMailMerge(const Poco::Net::HTTPRequest& request,
+                            const std::shared_ptr<StreamSocket>& socket,
+                            const RepositoryStruct& repo,
+                            const std::shared_ptr<const std::string>& body)
+{
+    OxOOL::HttpHelper::KeyValueMap extraHeader;
+    extraHeader["Access-Control-Allow-Origin"] = "*";
+
+    updateAccessTimes(repo.endpt); // 呼叫次數 +1
+
+    // 有帶 ?outputPDF 且不等於 false，表示要輸出爲 PDF 格式(整份文件只轉檔一次)
+    Poco::Net::HTMLForm urlParam(request);
+    const bool toPDF = (urlParam.has("outputPDF") && urlParam.get("outputPDF") != "false");
+
+    const std::string templateFile = getRepositoryPath() + "/" + repo.endpt + "." + repo.extname;
+    const auto plan = getTemplatePlan(repo.endpt, templateFile);
+
+    // JSON 陣列或 NDJSON，每筆資料產生一段內容
+    JsonBinder binder(plan->binding);
+    std::vector<Poco::JSON::Object::Ptr> records;
+    std::string jsonParseMessage;
+    try
+    {
+        records = binder.bindBatch(body->data(), body->size());
+        if (records.empty())
+            jsonParseMessage = "No records";
+    }
+    catch (const Poco::Exception&)
+    {
+        jsonParseMessage = "Json format error";
+    }
+
+    if (!jsonParseMessage.empty())
+    {
+        OxOOL::HttpHelper::sendErrorAndShutdown(
+            Poco::Net::HTTPResponse::HTTPStatus::HTTP_BAD_REQUEST, socket, jsonParseMessage);
+        log(socket, false, repo, toPDF);
+        return;
+    }
+
+    std::shared_ptr<Parser> parser = std::make_shared<Parser>();
+    parser->attach(plan);
+    parser->renderMerged(records);
+    records.clear(); // 由 parser 保存，每筆輸出後即釋放
+
+    // 背景解碼的圖片要在寫出前完成
+    binder.waitPictures();
+    const std::string extName = plan->doctype == DocType::SPREADSHEET ? ".ods" : ".odt";
+    sendReport(socket, repo, parser, extName, toPDF, extraHeader);
+}
+
 void MergeODF::okAPI(const Poco::Net::HTTPRequest& /*request*/,
             const std::shared_ptr<StreamSocket>& socket)
 {
@@ -591,13 +1715,13 @@ void MergeODF::okAPI(const Poco::Net::HTTPRequest& /*request*/,
 void MergeODF::apiListsAPI(const Poco::Net::HTTPRequest& request,
                     const std::shared_ptr<StreamSocket>& socket)
 {
-    apiHelper(request, socket);
+    apiHelper(request, socket, templLists(request));
 }
 
 void MergeODF::yamlListsAPI(const Poco::Net::HTTPRequest& request,
                     const std::shared_ptr<StreamSocket>& socket)
 {
-    apiHelper(request, socket, true, "", false, true);
+    apiHelper(request, socket, templLists(request), false, true);
 }
 
 void MergeODF::listAPI(const Poco::Net::HTTPRequest& /*request*/,
@@ -660,19 +1784,36 @@ void MergeODF::uploadAPI(const Poco::Net::HTTPRequest& request,
         uptime : form.get("uptime", "")
     };
 
+    // 非同步工作的路徑不可作爲範本代碼
+    if (repo.endpt == JOBS_PATH)
+    {
+        partHandler.removeFiles();
+        OxOOL::HttpHelper::sendErrorAndShutdown(Poco::Net::HTTPResponse::HTTP_BAD_REQUEST,
+                                                socket, "Endpt \"" + JOBS_PATH + "\" is reserved.");
+        return;
+    }
+
     // 有收到檔案
     if (!partHandler.empty())
     {
-        const Poco::File recivedFile(partHandler.getFilename());
         const std::string newName
             = getRepositoryPath() + "/" + form.get("endpt") + "." + form.get("extname");
         // 收到的檔案複製一份並改名，存到 RepositoryPath 路徑下
-        recivedFile.copyTo(newName);
+        installTemplate(partHandler.getFilename(), newName);
         // 移除收到的檔案
         partHandler.removeFiles();
 
         // 更新資料庫(新增)
         updateRepositoryData(ActionType::ADD, repo);
+        // 發佈新範本的編譯結果
+        try
+        {
+            compileTemplate(repo.endpt, newName);
+        }
+        catch (const Poco::Exception&)
+        {
+            // 錯誤已記錄，使用時會再編譯一次
+        }
 
         OxOOL::HttpHelper::sendResponseAndShutdown(socket, "Upload Success.");
     }
@@ -691,24 +1832,25 @@ void MergeODF::updateAPI(const Poco::Net::HTTPRequest& request,
     Poco::MemoryInputStream message(&socket->getInBuffer()[0], socket->getInBuffer().size());
     const Poco::Net::HTMLForm form(request, message, partHandler);
 
+    // 非同步工作的路徑不可作爲範本代碼
+    if (form.get("endpt", "") == JOBS_PATH)
+    {
+        partHandler.removeFiles();
+        OxOOL::HttpHelper::sendErrorAndShutdown(Poco::Net::HTTPResponse::HTTP_BAD_REQUEST,
+                                                socket, "Endpt \"" + JOBS_PATH + "\" is reserved.");
+        return;
+    }
+
     // 有收到檔案
     if (!partHandler.empty())
     {
-        // 收到的檔案
-        const Poco::File recivedFile(partHandler.getFilename());
         // 讀取該筆原始記錄
         std::string endpt = form.get("endpt", "");
         RepositoryStruct repo = getRepository(endpt);
-        // 確實有資料
+        // 確實有資料，記下舊檔名
+        std::string oldName;
         if (repo.id != 0)
-        {
-            Poco::File oldFile(getRepositoryPath() + "/" + repo.endpt + "." + repo.extname);
-            // 舊檔案存在就刪除它
-            if (oldFile.exists())
-            {
-                oldFile.remove();
-            }
-        }
+            oldName = getRepositoryPath() + "/" + repo.endpt + "." + repo.extname;
 
         // 紀錄新資料
         repo.endpt = endpt;
@@ -716,11 +1858,23 @@ void MergeODF::updateAPI(const Poco::Net::HTTPRequest& request,
         repo.uptime = form.get("uptime", "");
         // 新的檔名應該要一樣
         const std::string newName = getRepositoryPath() + "/" + repo.endpt + "." + repo.extname;
-        // 收到的檔案複製一份並改名，存到 RepositoryPath 路徑下
-        recivedFile.copyTo(newName);
+        // 收到的檔案複製一份並改名，存到 RepositoryPath 路徑下(同名時直接取代舊檔)
+        installTemplate(partHandler.getFilename(), newName);
+        // 副檔名不同時，舊檔案存在就刪除它
+        if (!oldName.empty() && oldName != newName && Poco::File(oldName).exists())
+            Poco::File(oldName).remove();
 
         // 更新資料庫(新增)
         updateRepositoryData(ActionType::UPDATE, repo);
+        // 發佈新範本的編譯結果，處理中的請求仍使用舊版
+        try
+        {
+            compileTemplate(repo.endpt, newName);
+        }
+        catch (const Poco::Exception&)
+        {
+            // 錯誤已記錄，使用時會再編譯一次
+        }
 
         // 移除收到的檔案
         partHandler.removeFiles();
@@ -757,6 +1911,7 @@ void MergeODF::deleteAPI(const Poco::Net::HTTPRequest& request,
         if (targetFile.exists())
         {
             targetFile.remove(); // 刪除指定檔案
+            publishTemplateState(repo.endpt, nullptr);
             // 更新資料庫(刪除)
             updateRepositoryData(ActionType::DELETE, repo);
             OxOOL::HttpHelper::sendResponseAndShutdown(socket, "Delete success.");
@@ -809,82 +1964,78 @@ void MergeODF::downloadAPI(const Poco::Net::HTTPRequest& request,
 }
 
 void MergeODF::apiHelper(const Poco::Net::HTTPRequest& request,
-                const std::shared_ptr<StreamSocket>& socket, const bool showMerge,
-                const std::string& mergeEndPoint, const bool anotherJson,
+                const std::shared_ptr<StreamSocket>& socket,
+                const std::vector<RepositoryStruct>& repos, const bool anotherJson,
                 const bool yaml)
 {
-    std::string paths = "";
-    bool showHead = !(false && showMerge);
-    if (showMerge)
+    // 取得各範本的衍生資料，範本沒變動就不需再解析
+    const auto states = getTemplateStates(repos);
+
+    // 文件內容只隨範本版本改變，以所有範本的版本組成 ETag
+    std::string etag;
+    Poco::Timestamp lastModified(0);
+    if (states.size() == 1)
+    {
+        etag = states.front()->etag;
+        lastModified = states.front()->lastModified;
+    }
+    else
     {
-        auto merge = makeApiJson(request.getHost(), mergeEndPoint, anotherJson, yaml, showHead);
-        if (!paths.empty() && !merge.empty() && !yaml)
-            paths += ",";
-        paths += merge;
+        Poco::SHA1Engine sha1;
+        for (const auto& state : states)
+        {
+            sha1.update(state->plan->templateFile);
+            sha1.update(state->etag);
+            if (lastModified < state->lastModified)
+                lastModified = state->lastModified;
+        }
+        etag = '"' + Poco::DigestEngine::digestToHex(sha1.digest()) + '"';
     }
 
-    const std::string read = paths;
+    OxOOL::HttpHelper::KeyValueMap extraHeader;
+    extraHeader["ETag"] = etag;
+    extraHeader["Last-Modified"]
+        = Poco::DateTimeFormatter::format(lastModified, Poco::DateTimeFormat::HTTP_FORMAT);
+    extraHeader["Cache-Control"] = "no-cache";
 
     auto mediaType = !anotherJson && !yaml ? "application/json"
                    : !yaml ? "text/html; charset=utf-8"
                    : "text/plain; charset=utf-8";
 
+    if (isNotModified(request, etag, lastModified))
+    {
+        OxOOL::HttpHelper::sendResponseAndShutdown(
+            socket, "", Poco::Net::HTTPResponse::HTTP_NOT_MODIFIED, mediaType, extraHeader);
+        return;
+    }
+
+    const std::string read = makeApiJson(request.getHost(), states, anotherJson, yaml);
+
     OxOOL::HttpHelper::sendResponseAndShutdown(socket, read, Poco::Net::HTTPResponse::HTTP_OK,
-                                                mediaType);
+                                                mediaType, extraHeader);
 }
 
 std::string MergeODF::makeApiJson(const std::string& host,
-                                  const std::string& which,
+                                  const std::vector<std::shared_ptr<const TemplateState>>& states,
                                   const bool anotherJson, const bool yaml,
                                   const bool showHead)
 {
     std::string jsonstr;
 
-    auto templsts = templLists(false);
-    auto it = templsts.begin();
-    for (size_t pos = 0; it != templsts.end(); ++it, pos++)
+    for (const auto& state : states)
     {
-        try
+        if (anotherJson)
         {
-            const auto templateFile = *it;
-            std::shared_ptr<Parser> parser = std::make_shared<Parser>();
-            parser->extract(templateFile);
-            parser->setOutputFlags(anotherJson, yaml);
-
-            auto endpoint = Poco::Path(templateFile).getBaseName();
-
-            if (!which.empty() && endpoint != which)
-                continue;
-
-            std::string buf;
-            std::string parserResult;
-            if (anotherJson)
-            {
-                buf = "* json 傳遞的 json 資料需以 urlencode(encodeURIComponent) 編碼<br />"
-                        "* 圖檔需以 base64 編碼<br />"
-                        "* 若以 json 傳參數，則 header 需指定 content-type='application/json'<br "
-                        "/><br />json 範例:<br /><br />";
-                buf += Poco::format("{<br />%s}", parser->jjsonVars());
-            }
-            else if (yaml)
-                Poco::format(buf, YAMLTEMPL, endpoint, endpoint, parser->yamlVars());
-            else
-                Poco::format(buf, APITEMPL, endpoint, endpoint, parser->jsonVars());
-
-            jsonstr += buf;
-
-            if (!which.empty() && endpoint == which)
-                break;
-
-            if (pos != templsts.size() - 1 && !yaml)
-                jsonstr += ",";
+            jsonstr += state->jsonSample;
         }
-        catch (const std::exception& e)
+        else
         {
+            if (!jsonstr.empty() && !yaml)
+                jsonstr += ",";
+            jsonstr += yaml ? state->yamlPaths : state->apiPaths;
         }
     }
 
-    //cout << jsonstr << endl;
     // add header
     if (showHead && !anotherJson)
     {
@@ -896,20 +2047,44 @@ std::string MergeODF::makeApiJson(const std::string& host,
     return jsonstr;
 }
 
-std::list<std::string> MergeODF::templLists(const bool isBasename)
+std::vector<RepositoryStruct> MergeODF::templLists(const Poco::Net::HTTPRequest& request)
 {
-    std::set<std::string> files;
-    std::list<std::string> rets;
+    Poco::Net::HTMLForm urlParam(request); // 網址列參數
+    const std::string cname = urlParam.get("cname", "");
+    unsigned offset = 0, limit = 0;
+    Poco::NumberParser::tryParseUnsigned(urlParam.get("offset", "0"), offset);
+    Poco::NumberParser::tryParseUnsigned(urlParam.get("limit", "0"), limit);
 
-    Poco::Glob::glob(getRepositoryPath() + "/*.ot[ts]", files);
-    for (auto it : files)
+    std::vector<std::string> endpts;
+    std::vector<std::string> extnames;
+    try
     {
-        if (isBasename)
-            rets.push_back(Poco::Path(it).getBaseName());
-        else
-            rets.push_back(it);
+        auto session = getDataSession();
+        Poco::Data::Statement select(session);
+        select << "SELECT endpt, extname FROM repository";
+        if (!cname.empty())
+            select << " WHERE cname=?", use(cname);
+        select << " ORDER BY endpt";
+        // limit 爲 0 表示不分頁
+        if (limit > 0)
+            select << " LIMIT " << limit << " OFFSET " << offset;
+        select, into(endpts), into(extnames);
+        select.execute();
+    }
+    catch (const Poco::Exception& exc)
+    {
+        LOG_ERR(logTitle() << "Failed to list templates: " << exc.displayText());
+    }
+
+    std::vector<RepositoryStruct> repos;
+    for (std::size_t i = 0; i < endpts.size() && i < extnames.size(); i++)
+    {
+        RepositoryStruct repo;
+        repo.endpt = endpts[i];
+        repo.extname = extnames[i];
+        repos.push_back(repo);
     }
-    return rets;
+    return repos;
 }
 
 // private:
@@ -983,6 +2158,207 @@ const std::string& MergeODF::getRepositoryPath()
     return repositoryPath;
 }
 
+void MergeODF::installTemplate(const std::string& sourceFile, const std::string& targetFile)
+{
+    // 暫存檔要在同一目錄下，rename 才會是原子操作
+    const std::string tempFile = Poco::TemporaryFile::tempName(getRepositoryPath());
+    try
+    {
+        Poco::File(sourceFile).copyTo(tempFile);
+        Poco::File(tempFile).renameTo(targetFile);
+    }
+    catch (const Poco::Exception&)
+    {
+        if (Poco::File(tempFile).exists())
+            Poco::File(tempFile).remove();
+        throw;
+    }
+}
+
+std::shared_ptr<const TemplatePlan> MergeODF::getTemplatePlan(const std::string& endpt,
+                                                              const std::string& templateFile)
+{
+    return getTemplateState(endpt, templateFile)->plan;
+}
+
+std::shared_ptr<const TemplateState> MergeODF::getTemplateState(const std::string& endpt,
+                                                                const std::string& templateFile)
+{
+    if (auto state = findCurrentTemplateState(endpt, templateFile))
+        return state;
+
+    return compileTemplateOnce(endpt, templateFile);
+}
+
+std::vector<std::shared_ptr<const TemplateState>>
+MergeODF::getTemplateStates(const std::vector<RepositoryStruct>& repos)
+{
+    std::vector<std::shared_ptr<const TemplateState>> states(repos.size());
+    std::vector<std::size_t> missing; // 需要編譯的範本
+    for (std::size_t i = 0; i < repos.size(); i++)
+    {
+        const std::string templateFile = getRepositoryPath() + "/" + repos[i].endpt + "." + repos[i].extname;
+        states[i] = findCurrentTemplateState(repos[i].endpt, templateFile);
+        if (!states[i] && Poco::File(templateFile).exists())
+            missing.push_back(i);
+    }
+
+    // 編譯交給執行緒池，先被執行緒池或目前的執行緒領取的一方負責編譯；
+    // 執行緒池忙碌或工作排不進時，由目前的執行緒依序編譯，不必等待
+    struct Compile
+    {
+        std::atomic<bool> claimed{ false };
+        std::packaged_task<std::shared_ptr<const TemplateState>()> task;
+    };
+    std::vector<std::shared_ptr<Compile>> compiles;
+    std::vector<std::future<std::shared_ptr<const TemplateState>>> results;
+    for (const std::size_t i : missing)
+    {
+        const RepositoryStruct& repo = repos[i];
+        const std::string templateFile = getRepositoryPath() + "/" + repo.endpt + "." + repo.extname;
+        auto compile = std::make_shared<Compile>();
+        compile->task = std::packaged_task<std::shared_ptr<const TemplateState>()>(
+            [this, repo, templateFile]() { return compileTemplateOnce(repo.endpt, templateFile); });
+        results.push_back(compile->task.get_future());
+        compiles.push_back(compile);
+
+        RenderPool::Ticket ticket;
+        ticket.endpt = repo.endpt;
+        mRenderPool.post(ticket,
+                         [compile]()
+                         {
+                             if (!compile->claimed.exchange(true))
+                                 compile->task();
+                         });
+    }
+
+    for (auto& compile : compiles)
+    {
+        if (!compile->claimed.exchange(true))
+            compile->task();
+    }
+
+    for (std::size_t n = 0; n < missing.size(); n++)
+    {
+        try
+        {
+            states[missing[n]] = results[n].get();
+        }
+        catch (const std::exception&)
+        {
+            // 錯誤已記錄，不列出這個範本
+        }
+    }
+
+    states.erase(std::remove(states.begin(), states.end(), nullptr), states.end());
+    return states;
+}
+
+std::shared_ptr<const TemplateState> MergeODF::compileTemplate(const std::string& endpt,
+                                                               const std::string& templateFile)
+{
+    LOG_INF(logTitle() << "Compile template " << templateFile);
+    auto state = std::make_shared<TemplateState>();
+    try
+    {
+        state->plan = Parser::compile(templateFile);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        LOG_ERR(logTitle() << "Failed to compile template " << templateFile << ": "
+                           << exc.displayText());
+        publishTemplateState(endpt, nullptr);
+        throw;
+    }
+
+    // API 文件片段只依變數清單產生，與 host 無關
+    const Parser parser;
+    const TemplateSchema& schema = state->plan->schema;
+    Poco::format(state->apiPaths, APITEMPL, endpt, endpt, parser.jsonVars(schema));
+    Poco::format(state->yamlPaths, YAMLTEMPL, endpt, endpt, parser.yamlVars(schema));
+    state->jsonSample = "* json 傳遞的 json 資料需以 urlencode(encodeURIComponent) 編碼<br />"
+                        "* 圖檔需以 base64 編碼<br />"
+                        "* 若以 json 傳參數，則 header 需指定 content-type='application/json'<br "
+                        "/><br />json 範例:<br /><br />";
+    state->jsonSample += Poco::format("{<br />%s}", parser.jjsonVars(schema));
+    state->lastModified = state->plan->lastModified;
+    state->etag = '"' + Poco::NumberFormatter::formatHex(state->plan->lastModified.epochMicroseconds())
+                  + '-' + Poco::NumberFormatter::formatHex(state->plan->size) + '"';
+
+    publishTemplateState(endpt, state);
+    return state;
+}
+
+std::shared_ptr<const TemplateState> MergeODF::compileTemplateOnce(const std::string& endpt,
+                                                                   const std::string& templateFile)
+{
+    std::promise<std::shared_ptr<const TemplateState>> promise;
+    std::shared_future<std::shared_ptr<const TemplateState>> compiling;
+    {
+        std::lock_guard<std::mutex> lock(mCompilingMutex);
+        const auto found = mCompiling.find(endpt);
+        if (found != mCompiling.end())
+            compiling = found->second;
+        else
+            mCompiling[endpt] = promise.get_future().share();
+    }
+
+    // 其他請求正在編譯，等待其結果(失敗時丟出同一個例外)
+    if (compiling.valid())
+        return compiling.get();
+
+    std::shared_ptr<const TemplateState> state;
+    try
+    {
+        state = compileTemplate(endpt, templateFile);
+        promise.set_value(state);
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(mCompilingMutex);
+        mCompiling.erase(endpt);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(mCompilingMutex);
+    mCompiling.erase(endpt);
+    return state;
+}
+
+std::shared_ptr<const TemplateState> MergeODF::findTemplateState(const std::string& endpt) const
+{
+    const auto registry = std::atomic_load(&mRegistry);
+    if (auto it = registry->find(endpt); it != registry->end())
+        return it->second;
+
+    return nullptr;
+}
+
+std::shared_ptr<const TemplateState>
+MergeODF::findCurrentTemplateState(const std::string& endpt, const std::string& templateFile) const
+{
+    auto state = findTemplateState(endpt);
+    // 範本檔沒變動才沿用
+    if (state && state->plan->templateFile == templateFile && state->plan->isCurrent())
+        return state;
+
+    return nullptr;
+}
+
+void MergeODF::publishTemplateState(const std::string& endpt,
+                                    const std::shared_ptr<const TemplateState>& state)
+{
+    std::lock_guard<std::mutex> lock(mRegistryWriteMutex);
+
+    auto registry = std::make_shared<TemplateRegistry>(*std::atomic_load(&mRegistry));
+    if (state)
+        (*registry)[endpt] = state;
+    else
+        registry->erase(endpt);
+
+    std::atomic_store(&mRegistry, std::shared_ptr<const TemplateRegistry>(registry));
+}
 
 OXOOL_MODULE_EXPORT(MergeODF);
 
@@ -7,8 +7,13 @@
 
 #pragma once
 
+#include <future>
+#include <mutex>
+
 #include <OxOOL/Module/Base.h>
 
+#include <Poco/StringTokenizer.h>
+#include <Poco/Timestamp.h>
 #include <Poco/Data/SQLite/Connector.h>
 #include <Poco/Data/SessionPool.h>
 #include <Poco/Data/Session.h>
@@ -16,6 +21,10 @@
 #include <Poco/JSON/Object.h>
 #include <Poco/Net/HTMLForm.h>
 
+#include "MergeODFConvert.h"
+#include "MergeODFJob.h"
+#include "MergeODFPool.h"
+
 struct RepositoryStruct
 {
     unsigned long id = 0; // AUTOINCREMENT ID
@@ -36,6 +45,18 @@ struct API
                        const std::shared_ptr<StreamSocket>& socket)> function;
 };
 
+/// 產生報表的 API，在執行緒池執行，請求內容另外複製一份
+struct RENDERAPI
+{
+    // request method
+    std::string method;
+    // callback method
+    std::function<void(const Poco::Net::HTTPRequest& request,
+                        const std::shared_ptr<StreamSocket>& socket,
+                        const RepositoryStruct& repo,
+                        const std::shared_ptr<const std::string>& body)> function;
+};
+
 struct DOCAPI
 {
     // request method
@@ -46,6 +67,26 @@ struct DOCAPI
                         const RepositoryStruct& repo)> function;
 };
 
+class JsonBinder;
+class Parser;
+struct TemplatePlan;
+struct JsonBinding;
+class PicturePartHandler;
+
+/// 範本的衍生資料，發佈後即不再變動。
+/// 範本更新時發佈新的一份，處理中的請求繼續使用原本取得的版本
+struct TemplateState
+{
+    std::shared_ptr<const TemplatePlan> plan; // 編譯結果
+
+    // API 文件片段，由編譯結果的變數清單產生
+    std::string apiPaths; // swagger paths(api)
+    std::string yamlPaths; // yaml paths(yaml)
+    std::string jsonSample; // json 範例(json)
+    std::string etag; // 範本版本，供 ETag 使用
+    Poco::Timestamp lastModified; // 範本檔修改時間，供 Last-Modified 使用
+};
+
 // 更新資料庫行為
 enum ActionType
 {
@@ -72,47 +113,111 @@ public:
 
 private:
 
+    typedef std::function<void(const Poco::Net::HTTPRequest& request,
+                               const std::shared_ptr<StreamSocket>& socket,
+                               const std::shared_ptr<const std::string>& body)> RenderHandler;
+
+    /// @brief 估計成本後交給執行緒池處理，無法排入時回覆 503 或 429 及 Retry-After
+    void dispatchRender(const Poco::Net::HTTPRequest& request,
+                        const std::shared_ptr<StreamSocket>& socket,
+                        const RepositoryStruct& repo,
+                        const RenderHandler& handler);
+
+    /// @brief 回覆忙碌中(503)或範本請求過多(429)，並依佇列長度建議多久後再試
+    void sendRejected(const std::shared_ptr<StreamSocket>& socket,
+                      RenderPool::Admission admission,
+                      RenderPool::Priority priority);
+
     /// @brief 製作ODF報表檔
     /// @param request
     /// @param socket
     /// @param repo
     /// @param templateFile
+    /// @param body 請求內容(OPTIONS 時為空指標)
     void makeODFReportFile(const Poco::Net::HTTPRequest& request,
                            const std::shared_ptr<StreamSocket>& socket,
                            const RepositoryStruct& repo,
-                           const std::string& templateFile);
+                           const std::string& templateFile,
+                           const std::shared_ptr<const std::string>& body);
+
+    /// @brief 送出產生的報表: ODF 檔邊產生邊送出，PDF 則先寫成暫存檔再轉檔，並寫入轉檔紀錄
+    /// @param extName 副檔名(.odt 或 .ods)
+    void sendReport(const std::shared_ptr<StreamSocket>& socket,
+                    const RepositoryStruct& repo,
+                    const std::shared_ptr<Parser>& parser,
+                    const std::string& extName,
+                    const bool toPDF,
+                    const std::map<std::string, std::string>& extraHeader);
+
+    /// @brief 排入轉檔佇列，將 ODF 檔轉成 PDF 送出，結束後刪除 file
+    /// @param file ODF 暫存檔完整路徑
+    /// @param owner 排隊的單位(範本代碼)
+    /// @param done 轉檔結束或失敗後呼叫，可為空
+    void convertToPDF(const std::shared_ptr<StreamSocket>& socket,
+                      const std::string& file,
+                      const std::string& owner,
+                      const ConvertScheduler::Callback& done);
+
+    /// @brief 在背景產生報表，立即傳回工作代碼(202 Accepted)
+    /// @param body 請求內容，JSON 中的圖片在背景解碼時仍會讀取
+    void submitReportJob(const std::shared_ptr<StreamSocket>& socket,
+                         const RepositoryStruct& repo,
+                         const std::shared_ptr<const TemplatePlan>& plan,
+                         const std::shared_ptr<JsonBinder>& binder,
+                         const std::shared_ptr<const std::string>& body,
+                         const Poco::JSON::Object::Ptr& object,
+                         const bool toPDF);
+
+    /// @brief 非同步工作: jobs/<id> 查詢狀態，jobs/<id>/result 取回結果
+    void jobAPI(const Poco::Net::HTTPRequest& request,
+                const std::shared_ptr<StreamSocket>& socket,
+                const Poco::StringTokenizer& tokens);
 
     /// @brief 寫入轉檔紀錄
-    /// @param socket
-    /// @param state true:成功, false: 失敗
-    /// @param endpt endpoint
-    /// @param message 訊息
+    /// @param socket 用戶端，記錄其 IP
+    /// @param success true: 成功, false: 失敗
+    /// @param repo 範本資料，記錄其代碼
     /// @param toPDF 是否輸出成 PDF
     void log(const std::shared_ptr<StreamSocket>& socket,
              const bool success,
              const RepositoryStruct& repo,
              const bool toPDF);
+    /// @brief 同上，用於回應後才記錄(用戶端已斷線)的情形
+    /// @param sourceIP 用戶端 IP
+    /// @param queueMs PDF 轉檔排隊時間(毫秒)
+    /// @param convertMs PDF 轉檔時間(毫秒)
+    void log(const std::string& sourceIP,
+             const bool success,
+             const RepositoryStruct& repo,
+             const bool toPDF,
+             const Poco::Int64 queueMs = 0,
+             const Poco::Int64 convertMs = 0);
 
-    /// @brief 保留字轉小寫
-    std::string keyword2Lower(const std::string& in, const std::string& keyword);
-
-    /// @brief 把 FORM 欄位，轉成 JSON 物件
-    Poco::JSON::Object::Ptr parseArray2Form(const Poco::Net::HTMLForm& form);
+    /// @brief 把 FORM 欄位及上傳的圖片，轉成 JSON 物件(只保留範本用到的欄位)
+    /// @exception Poco::DataFormatException 群組序號不正確
+    Poco::JSON::Object::Ptr parseArray2Form(const Poco::Net::HTMLForm& form,
+                                            const PicturePartHandler& parts,
+                                            const JsonBinding& binding);
 
     /// @brief 更新範本呼叫次數(+1)
     void updateAccessTimes(const std::string& endpt);
 
+    /// @brief 輸出 API 文件
+    /// @param repos 要列出的範本
     void apiHelper(const Poco::Net::HTTPRequest& request,
-                   const std::shared_ptr<StreamSocket>& socket, const bool showMerge = true,
-                   const std::string& mergeEndPoint = std::string(), const bool anotherJson = false,
+                   const std::shared_ptr<StreamSocket>& socket,
+                   const std::vector<RepositoryStruct>& repos, const bool anotherJson = false,
                    const bool yaml = false);
 
+    /// @brief 組出 API 文件
+    /// @param states 要列出的範本
     std::string makeApiJson(const std::string& host,
-                            const std::string& which = std::string(),
+                            const std::vector<std::shared_ptr<const TemplateState>>& states,
                             const bool anotherJson = false, const bool yaml = false,
                             const bool showHead = true);
 
-    std::list<std::string> templLists(const bool isBasename);
+    /// @brief 依網址參數列出範本(cname: 範本類別，offset、limit: 分頁)
+    std::vector<RepositoryStruct> templLists(const Poco::Net::HTTPRequest& request);
 
 private:
 
@@ -134,6 +239,71 @@ private:
     /// @return
     const std::string& getRepositoryPath();
 
+    /// @brief 將收到的範本檔以原子操作放到範本倉庫(先寫暫存檔再改名)，
+    ///        同時進行中的請求不會讀到寫一半的檔案
+    /// @param sourceFile 收到的檔案
+    /// @param targetFile 範本檔完整路徑
+    void installTemplate(const std::string& sourceFile, const std::string& targetFile);
+
+    /// @brief 取得範本的編譯結果，範本未變動就沿用登錄表中的版本
+    /// @param endpt
+    /// @param templateFile 範本檔完整路徑
+    /// @return
+    std::shared_ptr<const TemplatePlan> getTemplatePlan(const std::string& endpt,
+                                                        const std::string& templateFile);
+
+    /// @brief 取得範本的衍生資料，範本未變動就沿用登錄表中的版本
+    std::shared_ptr<const TemplateState> getTemplateState(const std::string& endpt,
+                                                          const std::string& templateFile);
+
+    /// @brief 取得多個範本的衍生資料，需要編譯的範本交給執行緒池平行處理
+    /// @return 依 repos 順序，不含無法編譯的範本
+    std::vector<std::shared_ptr<const TemplateState>>
+    getTemplateStates(const std::vector<RepositoryStruct>& repos);
+
+    /// @brief 編譯範本、產生 API 文件片段並發佈到登錄表
+    std::shared_ptr<const TemplateState> compileTemplate(const std::string& endpt,
+                                                         const std::string& templateFile);
+
+    /// @brief 同一個範本同時只編譯一次，其他請求等待同一個結果
+    std::shared_ptr<const TemplateState> compileTemplateOnce(const std::string& endpt,
+                                                             const std::string& templateFile);
+
+    /// @brief 取得範本目前的衍生資料，不加鎖
+    /// @return 沒有資料時爲 nullptr
+    std::shared_ptr<const TemplateState> findTemplateState(const std::string& endpt) const;
+
+    /// @brief 取得範本目前的衍生資料，範本檔已變動時視爲沒有資料
+    std::shared_ptr<const TemplateState> findCurrentTemplateState(const std::string& endpt,
+                                                                  const std::string& templateFile) const;
+
+    /// @brief 發佈範本的新版衍生資料
+    /// @param state nullptr 表示移除
+    void publishTemplateState(const std::string& endpt,
+                              const std::shared_ptr<const TemplateState>& state);
+
+private:
+
+    /// @brief 範本登錄表(key: endpt)
+    /// 讀取時以 std::atomic_load 取得目前版本後只讀不改，不需加鎖；
+    /// 更新時複製一份修改後以 std::atomic_store 發佈(RCU)，舊版本在最後一個讀取者結束後釋放
+    typedef std::map<std::string, std::shared_ptr<const TemplateState>> TemplateRegistry;
+    std::shared_ptr<const TemplateRegistry> mRegistry;
+    std::mutex mRegistryWriteMutex; // 只在更新登錄表時使用
+
+    /// @brief 編譯中的範本(key: endpt)，編譯結束後移除
+    std::map<std::string, std::shared_future<std::shared_ptr<const TemplateState>>> mCompiling;
+    std::mutex mCompilingMutex;
+
+    /// @brief 產生報表的執行緒池
+    RenderPool mRenderPool;
+
+    /// @brief 非同步產生報表的工作及結果
+    JobStore mJobStore;
+
+    /// @brief PDF 轉檔排程
+    ConvertScheduler mConvertScheduler;
+
 private:
 
     std::map<std::string, API> mApiMap;
@@ -166,6 +336,7 @@ private:
 
 
     std::map<std::string, DOCAPI> mDocApiMap;
+    std::map<std::string, RENDERAPI> mRenderApiMap; // 產生報表的 doc api
     void initDocApiMap();
 
     void docApi(const Poco::Net::HTTPRequest& request,
@@ -184,6 +355,20 @@ private:
                         const std::shared_ptr<StreamSocket>& socket,
                         const RepositoryStruct& repo);
 
+    /// @brief 合併列印: 資料爲 JSON 陣列或 NDJSON，每筆資料以範本產生一次，合併成一份文件
+    ///        (Writer 以分頁隔開，Calc 每筆資料一組工作表)，可加 ?outputPDF 轉成一份 PDF
+    void docMailMerge(const Poco::Net::HTTPRequest& request,
+                      const std::shared_ptr<StreamSocket>& socket,
+                      const RepositoryStruct& repo,
+                      const std::shared_ptr<const std::string>& body);
+
+    /// @brief 以同一範本產生多份文件: 資料爲 JSON 陣列或 NDJSON，
+    ///        結果以 zip 檔(預設)或 multipart/mixed(?format=multipart)依序輸出
+    void docBatch(const Poco::Net::HTTPRequest& request,
+                  const std::shared_ptr<StreamSocket>& socket,
+                  const RepositoryStruct& repo,
+                  const std::shared_ptr<const std::string>& body);
+
 private:
 
     static std::string TEMPLH;
@@ -0,0 +1,244 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFBase64.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MERGEODF_BASE64_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+/// base64 字元對應的值，0xFF 表示不是 base64 字元
+struct Base64Table
+{
+    unsigned char values[256];
+
+    Base64Table()
+    {
+        std::memset(values, 0xFF, sizeof(values));
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (unsigned char i = 0; i < 64; i++)
+            values[static_cast<unsigned char>(alphabet[i])] = i;
+    }
+};
+
+/// 整段解碼: 自 src 起每次處理一個區塊，遇到含有非 base64 字元(空白、'=' ...)的區塊就停下，
+/// 交由逐字元解碼處理。每個區塊會寫出比解碼結果多 4 或 8 個位元組，輸出空間需預留。
+typedef void (*BlockDecoder)(const char*& src, const char* end, char*& dst);
+
+#ifdef MERGEODF_BASE64_X86
+// 以查表同時檢查字元並換算成 6 bits 的值，再把每 4 個值合併成 3 個位元組
+// (Wojciech Muła 的 base64 SIMD 解碼方法)
+
+__attribute__((target("sse4.1")))
+void decodeBlocksSse41(const char*& src, const char* end, char*& dst)
+{
+    const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask2F = _mm_set1_epi8(0x2F);
+
+    while (end - src >= 16)
+    {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+        const __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask2F);
+        const __m128i loNibbles = _mm_and_si128(str, mask2F);
+        const __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+        const __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+        if (!_mm_testz_si128(lo, hi))
+            break;
+
+        const __m128i eq2F = _mm_cmpeq_epi8(str, mask2F);
+        const __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles));
+        str = _mm_add_epi8(str, roll);
+
+        const __m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                                        8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), packed);
+
+        src += 16;
+        dst += 12;
+    }
+}
+
+__attribute__((target("avx2")))
+void decodeBlocksAvx2(const char*& src, const char* end, char*& dst)
+{
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                           0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+
+    while (end - src >= 32)
+    {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+
+        const __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask2F);
+        const __m256i loNibbles = _mm256_and_si256(str, mask2F);
+        const __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        const __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+
+        const __m256i eq2F = _mm256_cmpeq_epi8(str, mask2F);
+        const __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        const __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                                              8, 14, 13, 12, -1, -1, -1, -1,
+                                                              2, 1, 0, 6, 5, 4, 10, 9,
+                                                              8, 14, 13, 12, -1, -1, -1, -1));
+        // 兩個 128 bits 各有 12 個位元組，移到一起
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), packed);
+
+        src += 32;
+        dst += 24;
+    }
+}
+#endif
+
+/// 依 CPU 選擇整段解碼的方式，都不支援時爲空指標
+BlockDecoder selectBlockDecoder()
+{
+#ifdef MERGEODF_BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return decodeBlocksAvx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return decodeBlocksSse41;
+#endif
+    return nullptr;
+}
+
+/// 自動選擇的整段解碼方式，只判斷一次
+BlockDecoder autoBlockDecoder()
+{
+    static const BlockDecoder decodeBlocks = selectBlockDecoder();
+    return decodeBlocks;
+}
+
+void decode(BlockDecoder decodeBlocks, const char* data, std::size_t size, std::string& out)
+{
+    static const Base64Table table;
+
+    // 預先配置最大可能的長度，另外預留整段解碼多寫出的部份
+    const std::size_t offset = out.size();
+    out.resize(offset + size / 4 * 3 + 32);
+    char* const begin = &out[0];
+    char* dst = begin + offset;
+
+    const char* src = data;
+    const char* const end = data + size;
+    unsigned int bits = 0;
+    int count = 0;
+    while (src != end)
+    {
+        // 每組 4 個字元的開頭先嘗試整段解碼
+        if (count == 0 && decodeBlocks)
+        {
+            decodeBlocks(src, end, dst);
+            if (src == end)
+                break;
+        }
+
+        const char ch = *src++;
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+            continue;
+
+        const unsigned char value = table.values[static_cast<unsigned char>(ch)];
+        if (value == 0xFF)
+            break;
+
+        bits = (bits << 6) | value;
+        if (++count == 4)
+        {
+            *dst++ = static_cast<char>(bits >> 16);
+            *dst++ = static_cast<char>(bits >> 8);
+            *dst++ = static_cast<char>(bits);
+            bits = 0;
+            count = 0;
+        }
+    }
+
+    // 結尾不足四個字元的部份
+    if (count == 2)
+        *dst++ = static_cast<char>(bits >> 4);
+    else if (count == 3)
+    {
+        *dst++ = static_cast<char>(bits >> 10);
+        *dst++ = static_cast<char>(bits >> 2);
+    }
+    out.resize(dst - begin);
+}
+}
+
+void decodeBase64(const char* data, std::size_t size, std::string& out)
+{
+    decode(autoBlockDecoder(), data, size, out);
+}
+
+bool decodeBase64(Base64Engine engine, const char* data, std::size_t size, std::string& out)
+{
+    BlockDecoder decodeBlocks = nullptr;
+    switch (engine)
+    {
+        case Base64Engine::AUTO:
+            decodeBlocks = autoBlockDecoder();
+            break;
+        case Base64Engine::SCALAR:
+            break;
+        case Base64Engine::SSE41:
+#ifdef MERGEODF_BASE64_X86
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("sse4.1"))
+                return false;
+            decodeBlocks = decodeBlocksSse41;
+            break;
+#else
+            return false;
+#endif
+        case Base64Engine::AVX2:
+#ifdef MERGEODF_BASE64_X86
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("avx2"))
+                return false;
+            decodeBlocks = decodeBlocksAvx2;
+            break;
+#else
+            return false;
+#endif
+    }
+
+    decode(decodeBlocks, data, size, out);
+    return true;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,30 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <string>
+
+/// @brief 解碼 base64 並附加到 out 之後
+/// 略過空白，遇到 '=' 或不合法的字元就停止(與 Poco::Base64Decoder 出錯時保留已解出的資料相同)。
+/// CPU 支援時以 AVX2 或 SSE4.1 一次處理 32 或 16 個字元。
+void decodeBase64(const char* data, std::size_t size, std::string& out);
+
+/// 整段解碼的方式，AUTO 依 CPU 選擇(測試時指定其他方式以檢查各實作)
+enum class Base64Engine
+{
+    AUTO,
+    SCALAR,
+    SSE41,
+    AVX2
+};
+
+/// @brief 同 decodeBase64()，但以指定的方式解碼
+/// @return false: CPU 不支援該方式，out 不變
+bool decodeBase64(Base64Engine engine, const char* data, std::size_t size, std::string& out);
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
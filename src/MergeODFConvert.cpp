@@ -0,0 +1,349 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFConvert.h"
+
+#include <OxOOL/ConvertBroker.h>
+
+#include <Poco/File.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+/// 有轉檔進行中時，檢查是否結束的間隔
+constexpr std::chrono::milliseconds POLL_INTERVAL(100);
+/// 停止時等待中止的 ConvertBroker 結束的時間上限，超過時保留暫存檔
+constexpr std::chrono::seconds STOP_WAIT(5);
+/// 平均等待及轉檔時間的權重: 新的一筆佔 1/10
+constexpr double AVERAGE_WEIGHT = 0.1;
+/// Retry-After 的範圍(秒)
+constexpr unsigned MIN_RETRY_AFTER = 1;
+constexpr unsigned MAX_RETRY_AFTER = 60;
+
+double movingAverage(double average, double value, Poco::UInt64 count)
+{
+    return count == 1 ? value : average + (value - average) * AVERAGE_WEIGHT;
+}
+
+std::chrono::milliseconds elapsedSince(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()
+                                                                 - since);
+}
+
+/// 刪除暫存檔
+void removeFile(const std::string& file)
+{
+    try
+    {
+        Poco::File(file).remove();
+    }
+    catch (const Poco::Exception&)
+    {
+        // 檔案已不存在
+    }
+}
+}
+
+ConvertScheduler::ConvertScheduler()
+    : mQueued(0)
+    , mCompleted(0)
+    , mFailed(0)
+    , mTimedOut(0)
+    , mRejected(0)
+    , mStarted(0)
+    , mAverageWaitSeconds(0)
+    , mAverageConvertSeconds(0)
+    , mStopping(false)
+{
+}
+
+ConvertScheduler::~ConvertScheduler() { stop(); }
+
+void ConvertScheduler::start(const Settings& settings)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSettings = settings;
+    mSettings.maxConversions = std::max(1U, settings.maxConversions);
+    mStopping = false;
+    if (!mThread.joinable())
+        mThread = std::thread(&ConvertScheduler::poll, this);
+}
+
+void ConvertScheduler::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_all();
+    if (mThread.joinable())
+        mThread.join();
+}
+
+bool ConvertScheduler::submit(const std::string& file, const std::shared_ptr<StreamSocket>& socket,
+                              const std::string& owner, const Callback& done)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        // 還有空的轉檔名額時，等待中的轉檔不佔佇列名額
+        const std::size_t idle = mSettings.maxConversions - std::min<std::size_t>(
+                                     mActive.size(), mSettings.maxConversions);
+        if (mStopping || !mThread.joinable() || mQueued >= mSettings.maxQueued + idle)
+        {
+            mRejected++;
+            return false;
+        }
+
+        Conversion conversion;
+        conversion.file = file;
+        conversion.socket = socket;
+        conversion.owner = owner;
+        conversion.done = done;
+        conversion.queued = std::chrono::steady_clock::now();
+        mQueues[owner].push_back(std::move(conversion));
+        mQueued++;
+    }
+    mCondition.notify_all();
+    return true;
+}
+
+unsigned ConvertScheduler::retryAfter()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const double rounds = static_cast<double>(mQueued + 1) / mSettings.maxConversions;
+    const double seconds = std::ceil(rounds * mAverageConvertSeconds);
+    return std::clamp(static_cast<unsigned>(seconds), MIN_RETRY_AFTER, MAX_RETRY_AFTER);
+}
+
+ConvertScheduler::Statistics ConvertScheduler::statistics()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Statistics stats;
+    stats.settings = mSettings;
+    stats.active = mActive.size();
+    stats.queued = mQueued;
+    stats.completed = mCompleted;
+    stats.failed = mFailed;
+    stats.timedOut = mTimedOut;
+    stats.rejected = mRejected;
+    stats.averageWaitSeconds = mAverageWaitSeconds;
+    stats.averageConvertSeconds = mAverageConvertSeconds;
+    return stats;
+}
+
+/// 從下一個範本的佇列取出最早的轉檔，各範本輪流(呼叫前須已鎖定)
+bool ConvertScheduler::takeNext(Conversion& conversion)
+{
+    if (mQueues.empty())
+        return false;
+
+    auto next = mQueues.upper_bound(mLastOwner);
+    if (next == mQueues.end())
+        next = mQueues.begin();
+
+    conversion = std::move(next->second.front());
+    next->second.pop_front();
+    mLastOwner = next->first;
+    if (next->second.empty())
+        mQueues.erase(next);
+    mQueued--;
+
+    conversion.started = std::chrono::steady_clock::now();
+    conversion.result.queued = elapsedSince(conversion.queued);
+    mStarted++;
+    mAverageWaitSeconds = movingAverage(mAverageWaitSeconds,
+                                        conversion.result.queued.count() / 1000.0, mStarted);
+    return true;
+}
+
+/// 開始轉檔，失敗時 broker 為空
+void ConvertScheduler::launch(Conversion& conversion)
+{
+    try
+    {
+        conversion.broker = OxOOL::ConvertBroker::create(conversion.file, "pdf");
+        // 以唯讀開啟，完成後由 ConvertBroker 回應用戶端
+        if (!conversion.broker->loadDocumentReadonly(conversion.socket))
+            conversion.broker.reset();
+    }
+    catch (const std::exception&)
+    {
+        conversion.broker.reset();
+    }
+}
+
+/// 轉檔結束: 刪除暫存檔並通知呼叫者(不可鎖定)
+void ConvertScheduler::finish(Conversion& conversion)
+{
+    removeFile(conversion.file);
+    notify(conversion);
+}
+
+/// 更新統計並通知呼叫者，不刪除暫存檔(不可鎖定)
+void ConvertScheduler::notify(Conversion& conversion)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (conversion.result.finished && conversion.result.loaded)
+        {
+            mCompleted++;
+            mAverageConvertSeconds
+                = movingAverage(mAverageConvertSeconds,
+                                conversion.result.converting.count() / 1000.0, mCompleted);
+        }
+        else if (conversion.result.timedOut)
+            mTimedOut++;
+        else
+            mFailed++;
+    }
+
+    if (conversion.done)
+    {
+        try
+        {
+            conversion.done(conversion.result);
+        }
+        catch (const std::exception&)
+        {
+            // 通知失敗不影響其他轉檔
+        }
+    }
+}
+
+/// 刪除已結束的中止轉檔的暫存檔，ConvertBroker 仍在執行時保留
+void ConvertScheduler::drain()
+{
+    for (auto it = mDraining.begin(); it != mDraining.end();)
+    {
+        if (it->broker->isAlive())
+            ++it;
+        else
+        {
+            removeFile(it->file);
+            it = mDraining.erase(it);
+        }
+    }
+}
+
+void ConvertScheduler::poll()
+{
+    while (true)
+    {
+        std::vector<Conversion> starting;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            auto ready = [this]()
+            { return mStopping || (mQueued > 0 && mActive.size() < mSettings.maxConversions); };
+            if (mActive.empty() && mDraining.empty())
+                mCondition.wait(lock, ready);
+            else
+                mCondition.wait_for(lock, POLL_INTERVAL, ready);
+            if (mStopping)
+                break;
+
+            Conversion conversion;
+            while (mActive.size() + starting.size() < mSettings.maxConversions
+                   && takeNext(conversion))
+                starting.push_back(std::move(conversion));
+        }
+
+        std::vector<Conversion> launched;
+        for (auto& conversion : starting)
+        {
+            launch(conversion);
+            if (conversion.broker)
+                launched.push_back(std::move(conversion));
+            else
+                finish(conversion);
+        }
+
+        // 檢查進行中的轉檔是否已結束或逾時
+        std::vector<Conversion> finished;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (auto& conversion : launched)
+                mActive.push_back(std::move(conversion));
+
+            for (auto it = mActive.begin(); it != mActive.end();)
+            {
+                if (!it->broker->isAlive())
+                {
+                    it->result.finished = true;
+                    it->result.loaded = it->broker->isLoaded();
+                }
+                else if (std::chrono::steady_clock::now() - it->started >= mSettings.timeout)
+                    it->result.timedOut = true;
+                else
+                {
+                    ++it;
+                    continue;
+                }
+
+                it->result.converting = elapsedSince(it->started);
+                finished.push_back(std::move(*it));
+                it = mActive.erase(it);
+            }
+        }
+
+        for (auto& conversion : finished)
+        {
+            if (!conversion.result.timedOut)
+            {
+                finish(conversion);
+                continue;
+            }
+
+            // 中止後 ConvertBroker 可能還在讀取暫存檔，先通知，結束後才刪除
+            conversion.broker->stop("PDF conversion timed out");
+            notify(conversion);
+            conversion.done = nullptr;
+            mDraining.push_back(std::move(conversion));
+        }
+        drain();
+    }
+
+    // 尚未開始的轉檔以失敗通知
+    std::vector<Conversion> pending;
+    std::vector<Conversion> active;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto& queue : mQueues)
+            for (auto& conversion : queue.second)
+                pending.push_back(std::move(conversion));
+        mQueues.clear();
+        mQueued = 0;
+        active.swap(mActive);
+    }
+    for (auto& conversion : pending)
+        finish(conversion);
+
+    // 進行中的轉檔先中止，ConvertBroker 可能還在讀取暫存檔，與逾時中止的一樣結束後才刪除
+    for (auto& conversion : active)
+    {
+        conversion.done = nullptr;
+        conversion.broker->stop("Server is shutting down");
+        notify(conversion);
+        mDraining.push_back(std::move(conversion));
+    }
+    const auto deadline = std::chrono::steady_clock::now() + STOP_WAIT;
+    while (true)
+    {
+        drain();
+        if (mDraining.empty() || std::chrono::steady_clock::now() >= deadline)
+            break;
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+    // 仍未結束的 ConvertBroker 繼續使用暫存檔，不刪除
+    mDraining.clear();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
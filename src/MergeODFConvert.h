@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/Types.h>
+
+class StreamSocket;
+
+namespace OxOOL
+{
+class ConvertBroker;
+}
+
+/// PDF 轉檔排程: 同時進行的轉檔(ConvertBroker)數量有上限，其餘依範本輪流排隊。
+/// 轉檔由 ConvertBroker 在背景進行並直接回應用戶端，這裡由一個執行緒定期檢查
+/// 轉檔是否結束或逾時，結束後刪除暫存檔並通知呼叫者。
+class ConvertScheduler
+{
+public:
+    struct Settings
+    {
+        unsigned maxConversions = 1; // 同時轉檔的上限
+        std::size_t maxQueued = 0; // 等待佇列上限
+        std::chrono::seconds timeout = std::chrono::seconds(120); // 每個轉檔的時間上限
+    };
+
+    struct Result
+    {
+        bool finished = false; // ConvertBroker 已結束，回應由 ConvertBroker 處理
+        bool loaded = false; // 結束前文件已載入；沒有載入表示載入失敗，沒有產生 PDF
+        bool timedOut = false; // 逾時中止，回應由 ConvertBroker 處理
+        std::chrono::milliseconds queued = std::chrono::milliseconds(0); // 等待時間
+        std::chrono::milliseconds converting = std::chrono::milliseconds(0); // 轉檔時間
+    };
+
+    /// 轉檔結束後呼叫，finished 及 timedOut 都是 false 時尚未回應用戶端
+    typedef std::function<void(const Result& result)> Callback;
+
+    struct Statistics
+    {
+        Settings settings;
+        std::size_t active = 0;
+        std::size_t queued = 0;
+        Poco::UInt64 completed = 0; // 文件已載入並結束
+        Poco::UInt64 failed = 0; // 無法開始轉檔或文件載入失敗
+        Poco::UInt64 timedOut = 0;
+        Poco::UInt64 rejected = 0; // 佇列已滿
+        double averageWaitSeconds = 0;
+        double averageConvertSeconds = 0;
+    };
+
+    ConvertScheduler();
+    ConvertScheduler(const ConvertScheduler&) = delete;
+    ConvertScheduler& operator=(const ConvertScheduler&) = delete;
+    ~ConvertScheduler();
+
+    void start(const Settings& settings);
+
+    /// @brief 停止排程，尚未開始的轉檔以失敗通知；
+    ///        進行中的轉檔先中止，ConvertBroker 結束後才刪除暫存檔
+    void stop();
+
+    /// @brief 排入轉檔，結束後刪除 file
+    /// @param owner 排隊的單位(範本代碼)，不同單位輪流轉檔
+    /// @return false: 佇列已滿，file 及回應由呼叫者處理
+    bool submit(const std::string& file, const std::shared_ptr<StreamSocket>& socket,
+                const std::string& owner, const Callback& done);
+
+    /// @brief 依佇列長度及平均轉檔時間，估計多久後再試(秒，供 Retry-After 使用)
+    unsigned retryAfter();
+
+    Statistics statistics();
+
+private:
+    struct Conversion
+    {
+        std::string file;
+        std::shared_ptr<StreamSocket> socket;
+        std::string owner;
+        Callback done;
+        std::chrono::steady_clock::time_point queued;
+        std::chrono::steady_clock::time_point started;
+        std::shared_ptr<OxOOL::ConvertBroker> broker;
+        Result result;
+    };
+
+    void poll();
+    bool takeNext(Conversion& conversion);
+    void launch(Conversion& conversion);
+    void finish(Conversion& conversion);
+    void notify(Conversion& conversion);
+    void drain();
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::map<std::string, std::deque<Conversion>> mQueues; // 各範本的等待佇列
+    std::string mLastOwner; // 上一個開始轉檔的範本，下一次從其後的範本開始
+    std::size_t mQueued;
+    std::vector<Conversion> mActive;
+    std::vector<Conversion> mDraining; // 已中止、等待 ConvertBroker 結束後刪除暫存檔(只有 poll 使用)
+    std::thread mThread;
+    Settings mSettings;
+    Poco::UInt64 mCompleted;
+    Poco::UInt64 mFailed;
+    Poco::UInt64 mTimedOut;
+    Poco::UInt64 mRejected;
+    Poco::UInt64 mStarted;
+    double mAverageWaitSeconds;
+    double mAverageConvertSeconds;
+    bool mStopping;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
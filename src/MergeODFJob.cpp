@@ -0,0 +1,184 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFJob.h"
+
+#include <Poco/Exception.h>
+#include <Poco/UUIDGenerator.h>
+
+const char* RenderJob::statusName(Status status)
+{
+    switch (status)
+    {
+        case Status::QUEUED:
+            return "queued";
+        case Status::RUNNING:
+            return "running";
+        case Status::DONE:
+            return "done";
+        case Status::FAILED:
+        default:
+            return "failed";
+    }
+}
+
+JobStore::JobStore()
+    : mBytes(0)
+    , mCapacity(0)
+    , mTtl(0)
+{
+}
+
+void JobStore::configure(std::size_t capacity, std::chrono::seconds ttl)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCapacity = capacity;
+    mTtl = ttl;
+}
+
+std::string JobStore::create(const std::string& endpt, const std::string& fileName, bool toPDF)
+{
+    RenderJob job;
+    job.id = Poco::UUIDGenerator::defaultGenerator().createRandom().toString();
+    job.endpt = endpt;
+    job.fileName = fileName;
+    job.toPDF = toPDF;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    evict(std::chrono::steady_clock::now());
+    mJobs.emplace(job.id, job);
+    return job.id;
+}
+
+void JobStore::run(const std::string& id, const Work& work)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const auto found = mJobs.find(id);
+        if (found == mJobs.end())
+            return;
+        found->second.status = RenderJob::Status::RUNNING;
+    }
+
+    try
+    {
+        Output output = work();
+        finish(id, &output, "");
+    }
+    catch (const Poco::Exception& e)
+    {
+        finish(id, nullptr, e.displayText());
+    }
+    catch (const std::exception& e)
+    {
+        finish(id, nullptr, e.what());
+    }
+}
+
+void JobStore::remove(const std::string& id)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mJobs.erase(id);
+}
+
+void JobStore::cancel(const std::string& id, const std::string& reason)
+{
+    finish(id, nullptr, reason);
+}
+
+bool JobStore::find(const std::string& id, RenderJob& job)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    evict(std::chrono::steady_clock::now());
+    const auto found = mJobs.find(id);
+    if (found == mJobs.end())
+        return false;
+
+    job = found->second;
+    return true;
+}
+
+JobStore::Statistics JobStore::statistics()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    evict(std::chrono::steady_clock::now());
+
+    Statistics stats;
+    for (const auto& it : mJobs)
+    {
+        switch (it.second.status)
+        {
+            case RenderJob::Status::QUEUED:
+                stats.queued++;
+                break;
+            case RenderJob::Status::RUNNING:
+                stats.running++;
+                break;
+            case RenderJob::Status::DONE:
+                stats.done++;
+                break;
+            case RenderJob::Status::FAILED:
+                stats.failed++;
+                break;
+        }
+    }
+    stats.bytes = mBytes;
+    stats.capacity = mCapacity;
+    return stats;
+}
+
+void JobStore::finish(const std::string& id, Output* output, const std::string& error)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto now = std::chrono::steady_clock::now();
+    RenderJob& job = mJobs[id];
+    job.expires = now + mTtl;
+
+    if (output && output->data.size() > mCapacity)
+    {
+        job.status = RenderJob::Status::FAILED;
+        job.error = "Result exceeds the job store capacity";
+    }
+    else if (output)
+    {
+        job.status = RenderJob::Status::DONE;
+        job.mimeType = output->mimeType;
+        job.result = std::make_shared<const std::string>(std::move(output->data));
+        mBytes += job.result->size();
+    }
+    else
+    {
+        job.status = RenderJob::Status::FAILED;
+        job.error = error;
+    }
+
+    mFinished.push_back(id);
+    evict(now);
+}
+
+/// 移除過期的結果，超過容量時再移除最早完成的(呼叫前須已鎖定)
+void JobStore::evict(std::chrono::steady_clock::time_point now)
+{
+    while (!mFinished.empty())
+    {
+        const auto found = mJobs.find(mFinished.front());
+        if (found != mJobs.end())
+        {
+            if (found->second.expires > now && mBytes <= mCapacity)
+                break;
+
+            if (found->second.result)
+                mBytes -= found->second.result->size();
+            mJobs.erase(found);
+        }
+        mFinished.pop_front();
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <Poco/Timestamp.h>
+
+/// 非同步產生報表的工作
+struct RenderJob
+{
+    enum class Status
+    {
+        QUEUED, // 等待中
+        RUNNING, // 產生中
+        DONE, // 完成，可取回結果
+        FAILED // 失敗
+    };
+
+    std::string id;
+    std::string endpt;
+    std::string fileName; // 下載時的檔名(含 .odt 或 .ods 副檔名，轉 PDF 時據以命名暫存檔)
+    bool toPDF = false; // 取回結果時轉成 PDF
+    Poco::Timestamp created;
+
+    Status status = Status::QUEUED;
+    std::string mimeType;
+    std::shared_ptr<const std::string> result; // 產生的文件
+    std::string error; // 失敗原因
+    std::chrono::steady_clock::time_point expires; // 完成後保留到此時
+
+    static const char* statusName(Status status);
+};
+
+/// 非同步工作的狀態及結果暫存區。
+/// 工作由 RenderPool 的執行緒呼叫 run() 執行；完成的結果保留 ttl 後移除，
+/// 全部結果超過容量時，先移除最早完成的。
+class JobStore
+{
+public:
+    /// 產生文件，失敗時丟出例外
+    struct Output
+    {
+        std::string mimeType;
+        std::string data;
+    };
+    typedef std::function<Output()> Work;
+
+    struct Statistics
+    {
+        std::size_t queued = 0;
+        std::size_t running = 0;
+        std::size_t done = 0;
+        std::size_t failed = 0;
+        std::size_t bytes = 0;
+        std::size_t capacity = 0;
+    };
+
+    JobStore();
+    JobStore(const JobStore&) = delete;
+    JobStore& operator=(const JobStore&) = delete;
+
+    /// @brief 設定結果暫存區容量(位元組)及保留時間
+    void configure(std::size_t capacity, std::chrono::seconds ttl);
+
+    /// @brief 建立等待中的工作
+    /// @return 工作代碼
+    std::string create(const std::string& endpt, const std::string& fileName, bool toPDF);
+
+    /// @brief 在目前的執行緒執行工作並保存結果
+    void run(const std::string& id, const Work& work);
+
+    /// @brief 移除無法執行的工作
+    void remove(const std::string& id);
+
+    /// @brief 已排入但不會再執行的工作(例如服務停止)，以失敗結束
+    void cancel(const std::string& id, const std::string& reason);
+
+    /// @brief 取得工作目前的狀態
+    /// @return false: 沒有這個工作或已過期
+    bool find(const std::string& id, RenderJob& job);
+
+    Statistics statistics();
+
+private:
+    void finish(const std::string& id, Output* output, const std::string& error);
+    void evict(std::chrono::steady_clock::time_point now);
+
+    std::mutex mMutex;
+    std::map<std::string, RenderJob> mJobs;
+    std::list<std::string> mFinished; // 已完成的工作，依完成順序
+    std::size_t mBytes;
+    std::size_t mCapacity;
+    std::chrono::seconds mTtl;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,562 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFJson.h"
+
+#include <cstring>
+#include <limits>
+
+#include <Poco/Exception.h>
+#include <Poco/NumberParser.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/Net/NameValueCollection.h>
+#include <Poco/JSON/Array.h>
+
+namespace
+{
+/// 巢狀層數上限，避免惡意資料耗盡堆疊
+constexpr int MAX_DEPTH = 512;
+
+/// 以 UTF-8 輸出 unicode 字元
+void appendUtf8(std::string& out, unsigned int cp)
+{
+    if (cp < 0x80)
+        out.push_back(static_cast<char>(cp));
+    else if (cp < 0x800)
+    {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+    else if (cp < 0x10000)
+    {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+    else
+    {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+}
+
+JsonBinder::JsonBinder(const JsonBinding& binding)
+    : mBinding(binding)
+    , mBegin(nullptr)
+    , mPos(nullptr)
+    , mEnd(nullptr)
+    , mDepth(0)
+{
+}
+
+Poco::JSON::Object::Ptr JsonBinder::bind(const char* data, std::size_t size)
+{
+    mBegin = mPos = data;
+    mEnd = data + size;
+    mDepth = 0;
+
+    if (peek() != '{')
+        error("JSON object expected");
+
+    Poco::JSON::Object::Ptr object = parseObject(&mBinding.keys, true);
+    if (peek() != '\0' || mPos != mEnd)
+        error("Unexpected data after JSON object");
+
+    // 較大的圖片在背景解碼，與填值同時進行
+    mPictures.start();
+    return object;
+}
+
+std::vector<Poco::JSON::Object::Ptr> JsonBinder::bindBatch(const char* data, std::size_t size)
+{
+    mBegin = mPos = data;
+    mEnd = data + size;
+    mDepth = 0;
+
+    std::vector<Poco::JSON::Object::Ptr> records;
+    if (peek() == '[')
+    {
+        // JSON 陣列: 每個元素是一筆資料
+        ++mPos;
+        if (peek() == ']')
+            ++mPos;
+        else
+        {
+            while (true)
+            {
+                if (peek() != '{')
+                    error("JSON object expected");
+                records.push_back(parseObject(&mBinding.keys, true));
+
+                const char ch = peek();
+                ++mPos;
+                if (ch == ']')
+                    break;
+                if (ch != ',')
+                    error("',' or ']' expected");
+            }
+        }
+    }
+    else
+    {
+        // NDJSON: 一行一筆資料(物件之間只要有空白即可)
+        while (peek() == '{')
+            records.push_back(parseObject(&mBinding.keys, true));
+    }
+
+    if (peek() != '\0' || mPos != mEnd)
+        error("Unexpected data after JSON records");
+
+    mPictures.start();
+    return records;
+}
+
+void JsonBinder::waitPictures()
+{
+    mPictures.wait();
+}
+
+Poco::JSON::Object::Ptr JsonBinder::parseObject(const std::set<std::string>* keys, bool topLevel)
+{
+    if (++mDepth > MAX_DEPTH)
+        error("JSON nested too deeply");
+
+    Poco::JSON::Object::Ptr object = new Poco::JSON::Object;
+    expect('{');
+    if (peek() == '}')
+    {
+        ++mPos;
+        --mDepth;
+        return object;
+    }
+
+    while (true)
+    {
+        if (peek() != '"')
+            error("Object key expected");
+        const std::string key = parseString();
+        expect(':');
+
+        if (keys && !keys->count(key))
+        {
+            // 範本沒有用到的鍵值不建立物件
+            skipValue();
+        }
+        else if (mBinding.pictureKeys.count(key) && peek() == '"')
+        {
+            object->set(key, parsePicture());
+        }
+        else if (topLevel && peek() == '[')
+        {
+            auto group = mBinding.groupKeys.find(key);
+            object->set(key, parseArray(group != mBinding.groupKeys.end() ? &group->second : nullptr));
+        }
+        else
+        {
+            object->set(key, parseValue());
+        }
+
+        const char ch = peek();
+        ++mPos;
+        if (ch == '}')
+            break;
+        if (ch != ',')
+            error("',' or '}' expected");
+    }
+
+    --mDepth;
+    return object;
+}
+
+Poco::Dynamic::Var JsonBinder::parseArray(const std::set<std::string>* itemKeys)
+{
+    if (++mDepth > MAX_DEPTH)
+        error("JSON nested too deeply");
+
+    Poco::JSON::Array::Ptr array = new Poco::JSON::Array;
+    expect('[');
+    if (peek() == ']')
+    {
+        ++mPos;
+        --mDepth;
+        return array;
+    }
+
+    while (true)
+    {
+        // 群組的每筆資料只保留群組用到的鍵值
+        if (itemKeys && peek() == '{')
+            array->add(parseObject(itemKeys, false));
+        else
+            array->add(parseValue());
+
+        const char ch = peek();
+        ++mPos;
+        if (ch == ']')
+            break;
+        if (ch != ',')
+            error("',' or ']' expected");
+    }
+
+    --mDepth;
+    return array;
+}
+
+Poco::Dynamic::Var JsonBinder::parseValue()
+{
+    switch (peek())
+    {
+        case '{':
+            return parseObject(nullptr, false);
+        case '[':
+            return parseArray(nullptr);
+        case '"':
+            return parseString();
+        case 't':
+        case 'T':
+            if (matchKeyword("true"))
+                return true;
+            break;
+        case 'f':
+        case 'F':
+            if (matchKeyword("false"))
+                return false;
+            break;
+        case 'n':
+        case 'N':
+            if (matchKeyword("null"))
+                return Poco::Dynamic::Var();
+            break;
+        default:
+            return parseNumber();
+    }
+    error("Invalid value");
+}
+
+Poco::Dynamic::Var JsonBinder::parseNumber()
+{
+    const char* start = mPos;
+    bool isFloat = false;
+    while (mPos != mEnd)
+    {
+        const char ch = *mPos;
+        if (ch == '.' || ch == 'e' || ch == 'E')
+            isFloat = true;
+        else if (!(ch >= '0' && ch <= '9') && ch != '-' && ch != '+')
+            break;
+        ++mPos;
+    }
+
+    const std::string text(start, mPos);
+    if (!isFloat)
+    {
+        Poco::Int64 value;
+        if (Poco::NumberParser::tryParse64(text, value))
+            return value;
+        Poco::UInt64 uvalue;
+        if (Poco::NumberParser::tryParseUnsigned64(text, uvalue))
+            return uvalue;
+    }
+
+    double value;
+    if (text.empty() || !Poco::NumberParser::tryParseFloat(text, value))
+        error("Invalid number");
+    return value;
+}
+
+Poco::Dynamic::Var JsonBinder::parsePicture()
+{
+    // 沒有跳脫字元時直接由請求內容解碼，不另外複製字串
+    const char* start = mPos + 1;
+    const char* end = start;
+    while (end != mEnd && *end != '"' && *end != '\\')
+        ++end;
+
+    PicturePtr picture;
+    if (end != mEnd && *end == '"')
+    {
+        picture = mPictures.add(start, end - start);
+        mPos = end + 1;
+    }
+    else
+        picture = mPictures.add(parseString());
+    return picture;
+}
+
+std::string JsonBinder::parseString()
+{
+    expect('"');
+    std::string result;
+    while (true)
+    {
+        // 一次複製到下一個特殊字元為止
+        const char* start = mPos;
+        while (mPos != mEnd && *mPos != '"' && *mPos != '\\' && *mPos != '\n')
+            ++mPos;
+        result.append(start, mPos);
+
+        if (mPos == mEnd)
+            error("Unterminated string");
+
+        const char ch = *mPos++;
+        if (ch == '"')
+            break;
+        // 原本逐行讀取時會去掉換行字元
+        if (ch == '\n')
+            continue;
+
+        if (mPos == mEnd)
+            error("Unterminated string");
+        switch (*mPos++)
+        {
+            case '"': result.push_back('"'); break;
+            case '\\': result.push_back('\\'); break;
+            case '/': result.push_back('/'); break;
+            case 'b': result.push_back('\b'); break;
+            case 'f': result.push_back('\f'); break;
+            case 'n': result.push_back('\n'); break;
+            case 'r': result.push_back('\r'); break;
+            case 't': result.push_back('\t'); break;
+            case 'u':
+            {
+                auto hex4 = [this]()
+                {
+                    if (mEnd - mPos < 4)
+                        error("Invalid unicode escape");
+                    unsigned int value = 0;
+                    for (int i = 0; i < 4; i++)
+                    {
+                        const char c = *mPos++;
+                        value <<= 4;
+                        if (c >= '0' && c <= '9')
+                            value |= c - '0';
+                        else if (c >= 'a' && c <= 'f')
+                            value |= c - 'a' + 10;
+                        else if (c >= 'A' && c <= 'F')
+                            value |= c - 'A' + 10;
+                        else
+                            error("Invalid unicode escape");
+                    }
+                    return value;
+                };
+
+                unsigned int cp = hex4();
+                // UTF-16 surrogate pair
+                if (cp >= 0xD800 && cp <= 0xDBFF && mEnd - mPos >= 6 && mPos[0] == '\\'
+                    && mPos[1] == 'u')
+                {
+                    mPos += 2;
+                    const unsigned int low = hex4();
+                    if (low >= 0xDC00 && low <= 0xDFFF)
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    else
+                    {
+                        appendUtf8(result, cp);
+                        cp = low;
+                    }
+                }
+                appendUtf8(result, cp);
+                break;
+            }
+            default:
+                error("Invalid escape");
+        }
+    }
+    return result;
+}
+
+void JsonBinder::skipValue()
+{
+    switch (peek())
+    {
+        case '{':
+        case '[':
+        {
+            if (++mDepth > MAX_DEPTH)
+                error("JSON nested too deeply");
+
+            const char close = *mPos == '{' ? '}' : ']';
+            const bool isObject = close == '}';
+            ++mPos;
+            if (peek() == close)
+            {
+                ++mPos;
+                --mDepth;
+                return;
+            }
+            while (true)
+            {
+                if (isObject)
+                {
+                    if (peek() != '"')
+                        error("Object key expected");
+                    skipString();
+                    expect(':');
+                }
+                skipValue();
+
+                const char ch = peek();
+                ++mPos;
+                if (ch == close)
+                    break;
+                if (ch != ',')
+                    error("Invalid JSON");
+            }
+            --mDepth;
+            return;
+        }
+        case '"':
+            skipString();
+            return;
+        case 't':
+        case 'T':
+            if (matchKeyword("true"))
+                return;
+            break;
+        case 'f':
+        case 'F':
+            if (matchKeyword("false"))
+                return;
+            break;
+        case 'n':
+        case 'N':
+            if (matchKeyword("null"))
+                return;
+            break;
+        default:
+            parseNumber();
+            return;
+    }
+    error("Invalid value");
+}
+
+void JsonBinder::skipString()
+{
+    ++mPos; // '"'
+    while (mPos != mEnd)
+    {
+        const char ch = *mPos++;
+        if (ch == '"')
+            return;
+        if (ch == '\\')
+        {
+            if (mPos == mEnd)
+                break;
+            ++mPos;
+        }
+    }
+    error("Unterminated string");
+}
+
+void JsonBinder::skipSpace()
+{
+    while (mPos != mEnd)
+    {
+        const char ch = *mPos;
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+        {
+            ++mPos;
+        }
+        else if (ch == '/' && mEnd - mPos >= 2 && mPos[1] == '/')
+        {
+            // 註解: 到行尾
+            while (mPos != mEnd && *mPos != '\n')
+                ++mPos;
+        }
+        else if (ch == '/' && mEnd - mPos >= 2 && mPos[1] == '*')
+        {
+            // 註解: 到 */
+            const char* end = mPos + 2;
+            while (end + 1 < mEnd && !(end[0] == '*' && end[1] == '/'))
+                ++end;
+            if (end + 1 >= mEnd)
+                error("Unterminated comment");
+            mPos = end + 2;
+        }
+        else
+            break;
+    }
+}
+
+bool JsonBinder::matchKeyword(const char* keyword)
+{
+    const std::size_t length = std::strlen(keyword);
+    if (static_cast<std::size_t>(mEnd - mPos) < length)
+        return false;
+
+    for (std::size_t i = 0; i < length; i++)
+    {
+        if ((mPos[i] | 0x20) != keyword[i])
+            return false;
+    }
+    mPos += length;
+    return true;
+}
+
+void JsonBinder::expect(char ch)
+{
+    if (peek() != ch)
+        error(std::string("'") + ch + "' expected");
+    ++mPos;
+}
+
+char JsonBinder::peek()
+{
+    skipSpace();
+    return mPos != mEnd ? *mPos : '\0';
+}
+
+void JsonBinder::error(const std::string& message) const
+{
+    throw Poco::SyntaxException(message + " at offset " + std::to_string(mPos - mBegin));
+}
+
+PicturePartHandler::PicturePartHandler(const JsonBinding& binding)
+    : mBinding(binding)
+{
+}
+
+void PicturePartHandler::handlePart(const Poco::Net::MessageHeader& header, std::istream& stream)
+{
+    std::string name;
+    if (header.has("Content-Disposition"))
+    {
+        std::string disposition;
+        Poco::Net::NameValueCollection params;
+        Poco::Net::MessageHeader::splitParameters(header.get("Content-Disposition"), disposition,
+                                                  params);
+        name = params.get("name", "");
+    }
+
+    // 群組欄位以最後一個中括號內的名稱判斷，格式在轉成 JSON 時才檢查
+    std::string key = name;
+    const std::size_t bracket = name.rfind('[');
+    if (bracket != std::string::npos && name.back() == ']')
+        key = name.substr(bracket + 1, name.size() - bracket - 2);
+
+    if (name.empty() || !mBinding.pictureKeys.count(key))
+    {
+        stream.ignore(std::numeric_limits<std::streamsize>::max());
+        return;
+    }
+
+    auto picture = std::make_shared<Picture>();
+    Poco::StreamCopier::copyToString(stream, picture->data);
+
+    // 相同內容的檔案共用同一份，輸出時只寫入一個圖片項目
+    auto& same = mContents[std::string_view(picture->data)];
+    if (!same)
+        same = picture;
+    mPictures.emplace_back(name, same);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <istream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Poco/Dynamic/Var.h>
+#include <Poco/JSON/Object.h>
+#include <Poco/Net/MessageHeader.h>
+#include <Poco/Net/PartHandler.h>
+
+#include "MergeODFPicture.h"
+
+/// 範本用到的 JSON 鍵值，編譯範本時產生
+struct JsonBinding
+{
+    std::set<std::string> keys; // 最上層
+    std::map<std::string, std::set<std::string>> groupKeys; // 群組陣列中每筆資料
+    std::set<std::string> pictureKeys; // 圖片(base64)，讀取時直接解碼
+};
+
+/// 單次走訪的 JSON 讀取器。
+/// 直接讀取請求內容，只保留範本用到的鍵值，其餘略過不建立物件；
+/// 圖片的 base64 字串不另外複製，直接解碼成 PicturePtr；較大的圖片在背景解碼，
+/// 寫出文件前須呼叫 waitPictures()，且請求內容在此之前須保持有效。
+/// 與原本的前處理相同，true、false、null 不分大小寫，並允許註解。
+class JsonBinder
+{
+public:
+    explicit JsonBinder(const JsonBinding& binding);
+
+    /// @brief 讀取 JSON 物件
+    /// @exception Poco::SyntaxException 格式錯誤或最上層不是物件
+    Poco::JSON::Object::Ptr bind(const char* data, std::size_t size);
+
+    /// @brief 讀取多筆資料: JSON 物件陣列，或每行一個物件(NDJSON)
+    /// 相同的圖片在所有資料中只解碼一次
+    /// @exception Poco::SyntaxException 格式錯誤或資料不是物件
+    std::vector<Poco::JSON::Object::Ptr> bindBatch(const char* data, std::size_t size);
+
+    /// @brief 等待背景解碼的圖片完成
+    void waitPictures();
+
+private:
+    /// @brief 讀取物件，keys 爲空指標時保留所有鍵值
+    Poco::JSON::Object::Ptr parseObject(const std::set<std::string>* keys, bool topLevel);
+    Poco::Dynamic::Var parseArray(const std::set<std::string>* itemKeys);
+    Poco::Dynamic::Var parseValue();
+    Poco::Dynamic::Var parseNumber();
+    Poco::Dynamic::Var parsePicture();
+    std::string parseString();
+
+    void skipValue();
+    void skipString();
+    void skipSpace();
+    bool matchKeyword(const char* keyword);
+    void expect(char ch);
+    char peek();
+
+    [[noreturn]] void error(const std::string& message) const;
+
+    const JsonBinding& mBinding;
+    const char* mBegin;
+    const char* mPos;
+    const char* mEnd;
+    int mDepth; // 目前的巢狀層數
+    PictureDecoder mPictures;
+};
+
+/// multipart 表單中的圖片檔案。
+/// 欄位名稱(或群組欄位 "群組[序號][欄位]" 的欄位)是範本的圖片變數時，直接讀成 PicturePtr，
+/// 不經 base64 也不寫暫存檔；其他檔案讀取後丟棄。
+class PicturePartHandler : public Poco::Net::PartHandler
+{
+public:
+    explicit PicturePartHandler(const JsonBinding& binding);
+
+    void handlePart(const Poco::Net::MessageHeader& header, std::istream& stream) override;
+
+    /// @brief 收到的圖片(欄位名稱, 內容)，依收到的順序
+    const std::vector<std::pair<std::string, PicturePtr>>& pictures() const { return mPictures; }
+
+private:
+    const JsonBinding& mBinding;
+    std::vector<std::pair<std::string, PicturePtr>> mPictures;
+    std::unordered_map<std::string_view, PicturePtr> mContents; // key: 圖片內容
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,324 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFMailMerge.h"
+
+#include <cstring>
+#include <set>
+
+#include <Poco/Exception.h>
+
+namespace
+{
+/// 換頁用的自動樣式: 由每筆資料第一個段落或表格的樣式衍生，只多了 fo:break-before
+const std::string PAGE_BREAK_STYLE_NAME = "MergeODF_PageBreak";
+/// 第二筆起的第一個元素與第一筆不同時(範本相同，不應發生)，退回插入空白的換頁段落
+const std::string FALLBACK_BREAK_STYLE_NAME = "MergeODF_PageBreakParagraph";
+const std::string FALLBACK_BREAK_STYLE
+    = "<style:style style:name=\"" + FALLBACK_BREAK_STYLE_NAME + "\" style:family=\"paragraph\">"
+      "<style:paragraph-properties fo:break-before=\"page\" fo:margin-top=\"0cm\""
+      " fo:margin-bottom=\"0cm\"/>"
+      "<style:text-properties fo:font-size=\"1pt\"/>"
+      "</style:style>";
+const std::string FALLBACK_BREAK = "<text:p text:style-name=\"" + FALLBACK_BREAK_STYLE_NAME + "\"/>";
+
+/// 找出名稱爲 name 的開始標籤(不含名稱以 name 開頭的其他元素)
+std::size_t findStartTag(const std::string& content, const std::string& name, std::size_t pos,
+                         std::size_t end = std::string::npos)
+{
+    const std::string open = "<" + name;
+    for (pos = content.find(open, pos); pos < end; pos = content.find(open, pos + 1))
+    {
+        const std::size_t next = pos + open.size();
+        if (next < content.size() && std::strchr(" \t\r\n/>", content[next]))
+            return pos;
+    }
+    return std::string::npos;
+}
+
+/// 開始標籤之後的位置
+std::size_t tagEnd(const std::string& content, std::size_t tag)
+{
+    const std::size_t close = content.find('>', tag);
+    if (close == std::string::npos)
+        throw Poco::DataFormatException("Unterminated tag in content.xml");
+    return close + 1;
+}
+
+/// 略過 Writer 內文開頭的宣告，這些元素每份文件只能有一個
+std::size_t skipDeclarations(const std::string& content, std::size_t pos, std::size_t end)
+{
+    static const std::set<std::string> declarations
+        = { "office:forms",          "text:variable-decls",       "text:sequence-decls",
+            "text:user-field-decls", "text:dde-connection-decls", "table:calculation-settings",
+            "table:content-validations", "table:label-ranges" };
+
+    while (true)
+    {
+        const std::size_t tag = content.find_first_not_of(" \t\r\n", pos);
+        if (tag >= end || content[tag] != '<')
+            return pos;
+
+        const std::size_t nameEnd = content.find_first_of(" \t\r\n/>", tag + 1);
+        const std::string name = content.substr(tag + 1, nameEnd - tag - 1);
+        if (!declarations.count(name))
+            return pos;
+
+        const std::size_t startEnd = tagEnd(content, tag);
+        if (content[startEnd - 2] == '/')
+            pos = startEnd;
+        else
+        {
+            const std::size_t close = content.find("</" + name + ">", startEnd);
+            if (close >= end)
+                return pos;
+            pos = close + name.size() + 3;
+        }
+    }
+}
+
+/// 內文中第一個段落、標題或表格的開始標籤及其樣式屬性
+struct BreakTarget
+{
+    std::size_t tag = std::string::npos;
+    std::string element;
+    std::size_t value = std::string::npos; // 樣式名稱的位置，沒有樣式屬性時爲 npos
+    std::string style;
+};
+
+BreakTarget findBreakTarget(const std::string& content, std::size_t pos, std::size_t end)
+{
+    BreakTarget target;
+    for (const char* element : { "text:p", "text:h", "table:table" })
+    {
+        const std::size_t tag = findStartTag(content, element, pos, end);
+        if (tag < target.tag)
+        {
+            target.tag = tag;
+            target.element = element;
+        }
+    }
+    if (target.tag == std::string::npos)
+        return target;
+
+    const std::string attr = (target.element == "table:table" ? "table" : "text")
+                             + std::string(":style-name=\"");
+    const std::size_t close = tagEnd(content, target.tag);
+    const std::size_t found = content.find(attr, target.tag);
+    if (found < close)
+    {
+        target.value = found + attr.size();
+        target.style = content.substr(target.value, content.find('"', target.value) - target.value);
+    }
+    return target;
+}
+
+/// 在屬性清單中設定 fo:break-before="page"
+/// @param properties 樣式中的 *-properties 元素名稱
+std::string setBreakBefore(std::string style, const std::string& properties)
+{
+    const std::size_t tag = findStartTag(style, properties, 0);
+    if (tag == std::string::npos)
+    {
+        // 沒有這個屬性元素，加在樣式的開始標籤之後
+        const std::size_t start = tagEnd(style, 0);
+        const std::string element = "<" + properties + " fo:break-before=\"page\"/>";
+        if (style[start - 2] == '/')
+            return style.substr(0, start - 2) + ">" + element + "</style:style>";
+        return style.insert(start, element);
+    }
+
+    const std::string attr = "fo:break-before=\"";
+    const std::size_t close = tagEnd(style, tag);
+    const std::size_t found = style.find(attr, tag);
+    if (found < close)
+    {
+        const std::size_t value = found + attr.size();
+        return style.replace(value, style.find('"', value) - value, "page");
+    }
+    return style.insert(tag + properties.size() + 1, " fo:break-before=\"page\"");
+}
+
+/// 產生換頁樣式: 原樣式是文件中的自動樣式時複製一份，否則以原樣式爲父樣式
+std::string makePageBreakStyle(const std::string& head, const BreakTarget& target)
+{
+    const bool table = target.element == "table:table";
+    const std::string family = table ? "table" : "paragraph";
+    const std::string properties = table ? "style:table-properties" : "style:paragraph-properties";
+
+    const std::size_t styles = findStartTag(head, "office:automatic-styles", 0);
+    const std::size_t stylesEnd = head.find("</office:automatic-styles>");
+    if (!target.style.empty() && styles != std::string::npos && stylesEnd != std::string::npos)
+    {
+        const std::string nameAttr = "style:name=\"" + target.style + "\"";
+        for (std::size_t tag = findStartTag(head, "style:style", styles, stylesEnd);
+             tag != std::string::npos; tag = findStartTag(head, "style:style", tag + 1, stylesEnd))
+        {
+            const std::size_t close = tagEnd(head, tag);
+            const std::size_t name = head.find(nameAttr, tag);
+            if (name > close || head.find("style:family=\"" + family + "\"", tag) > close)
+                continue;
+
+            const std::size_t end = head[close - 2] == '/'
+                                        ? close
+                                        : head.find("</style:style>", close) + 14;
+            std::string style = head.substr(tag, end - tag);
+            style.replace(name - tag, nameAttr.size(),
+                          "style:name=\"" + PAGE_BREAK_STYLE_NAME + "\"");
+            return setBreakBefore(style, properties);
+        }
+    }
+
+    std::string style = "<style:style style:name=\"" + PAGE_BREAK_STYLE_NAME
+                        + "\" style:family=\"" + family + "\"";
+    if (!target.style.empty())
+        style += " style:parent-style-name=\"" + target.style + "\"";
+    return style + "><" + properties + " fo:break-before=\"page\"/></style:style>";
+}
+
+/// 在文件開頭的自動樣式中加入換頁樣式
+std::string addPageBreakStyles(std::string head, const std::string& styles)
+{
+    std::size_t pos = head.find("</office:automatic-styles>");
+    if (pos != std::string::npos)
+        return head.insert(pos, styles);
+
+    const std::string empty = "<office:automatic-styles/>";
+    pos = head.find(empty);
+    if (pos != std::string::npos)
+        return head.replace(pos, empty.size(),
+                            "<office:automatic-styles>" + styles + "</office:automatic-styles>");
+
+    pos = findStartTag(head, "office:body", 0);
+    if (pos == std::string::npos)
+        throw Poco::DataFormatException("office:body not found in content.xml");
+    return head.insert(pos, "<office:automatic-styles>" + styles + "</office:automatic-styles>");
+}
+}
+
+MailMergeWriter::MailMergeWriter(std::ostream& out, DocType doctype)
+    : mOut(out)
+    , mDocType(doctype)
+    , mCount(0)
+{
+}
+
+void MailMergeWriter::add(const std::string& content)
+{
+    if (mDocType == DocType::SPREADSHEET)
+        addSpreadsheet(content);
+    else
+        addText(content);
+    mCount++;
+}
+
+void MailMergeWriter::close()
+{
+    mOut << mTail;
+    mTail.clear();
+}
+
+void MailMergeWriter::addText(const std::string& content)
+{
+    const std::size_t body = findStartTag(content, "office:text", 0);
+    if (body == std::string::npos)
+        throw Poco::DataFormatException("office:text not found in content.xml");
+    std::size_t begin = tagEnd(content, body);
+    const std::size_t end = content.rfind("</office:text>");
+    if (content[begin - 2] == '/' || end == std::string::npos || end < begin)
+        throw Poco::DataFormatException("Empty office:text in content.xml");
+
+    if (mCount == 0)
+    {
+        const std::string head = content.substr(0, begin);
+        std::string styles = FALLBACK_BREAK_STYLE;
+        const BreakTarget target = findBreakTarget(content, begin, end);
+        if (target.tag != std::string::npos)
+        {
+            styles += makePageBreakStyle(head, target);
+            mBreakElement = target.element;
+            mBreakSource = target.style;
+        }
+        mOut << addPageBreakStyles(head, styles);
+    }
+    else
+    {
+        begin = skipDeclarations(content, begin, end);
+        const BreakTarget target = findBreakTarget(content, begin, end);
+        if (target.tag == std::string::npos || target.element != mBreakElement
+            || target.style != mBreakSource)
+            mOut << FALLBACK_BREAK;
+        else if (target.value != std::string::npos)
+        {
+            // 第一個元素改用換頁樣式
+            mOut.write(content.data() + begin, target.value - begin);
+            mOut << PAGE_BREAK_STYLE_NAME;
+            begin = target.value + target.style.size();
+        }
+        else
+        {
+            // 原本沒有樣式，加上樣式屬性
+            const std::size_t nameEnd = target.tag + target.element.size() + 1;
+            mOut.write(content.data() + begin, nameEnd - begin);
+            mOut << (target.element == "table:table" ? " table" : " text")
+                 << ":style-name=\"" << PAGE_BREAK_STYLE_NAME << '"';
+            begin = nameEnd;
+        }
+    }
+
+    mOut.write(content.data() + begin, end - begin);
+    mTail.assign(content, end, std::string::npos);
+}
+
+void MailMergeWriter::addSpreadsheet(const std::string& content)
+{
+    const std::size_t first = findStartTag(content, "table:table", 0);
+    const std::string closeTag = "</table:table>";
+    std::size_t last = content.rfind(closeTag);
+    if (first == std::string::npos || last == std::string::npos || last < first)
+        throw Poco::DataFormatException("table:table not found in content.xml");
+    last += closeTag.size();
+    // 最後的工作表可能沒有內容(<table:table .../>)
+    for (std::size_t tag = findStartTag(content, "table:table", last); tag != std::string::npos;
+         tag = findStartTag(content, "table:table", tag + 1))
+    {
+        const std::size_t end = tagEnd(content, tag);
+        if (content[end - 2] == '/')
+            last = end;
+    }
+
+    if (mCount == 0)
+    {
+        mOut.write(content.data(), last);
+        mTail.assign(content, last, std::string::npos);
+        return;
+    }
+
+    // 工作表名稱不可重複，加上資料序號
+    const std::string suffix = "_" + std::to_string(mCount + 1);
+    const std::string nameAttr = "table:name=\"";
+    std::size_t pos = first;
+    for (std::size_t tag = first; tag != std::string::npos;
+         tag = findStartTag(content, "table:table", tag + 1, last))
+    {
+        const std::size_t end = tagEnd(content, tag);
+        const std::size_t name = content.find(nameAttr, tag);
+        if (name == std::string::npos || name > end)
+            continue;
+
+        const std::size_t quote = content.find('"', name + nameAttr.size());
+        mOut.write(content.data() + pos, quote - pos);
+        mOut << suffix;
+        pos = quote;
+    }
+    mOut.write(content.data() + pos, last - pos);
+    mTail.assign(content, last, std::string::npos);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
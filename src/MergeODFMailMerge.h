@@ -0,0 +1,44 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <ostream>
+#include <string>
+
+#include "MergeODFParser.h"
+
+/// 合併多份由同一範本產生的 content.xml: 第一份的文件開頭、每一份的內文、最後一份的結尾。
+/// Writer 第二筆起的第一個段落或表格改用加上 fo:break-before="page" 的自動樣式換頁，
+/// 並略過內文開頭的宣告(變數、序列、表單 ...)；
+/// Calc 每筆資料一組工作表，第二筆起的工作表名稱加上 "_序號"(跨工作表的公式仍指向第一組)。
+class MailMergeWriter
+{
+public:
+    MailMergeWriter(std::ostream& out, DocType doctype);
+
+    /// @brief 加入一筆資料產生的 content.xml
+    /// @exception Poco::DataFormatException 找不到文件內文或工作表
+    void add(const std::string& content);
+
+    /// @brief 寫出文件結尾，之後不可再加入
+    void close();
+
+private:
+    void addText(const std::string& content);
+    void addSpreadsheet(const std::string& content);
+
+    std::ostream& mOut;
+    DocType mDocType;
+    unsigned mCount; // 已加入的筆數
+    std::string mTail; // 最後一份的結尾
+    // 換頁樣式取代的原樣式(第一筆資料的第一個段落或表格)
+    std::string mBreakElement; // 元素名稱，空字串表示第一筆沒有段落或表格
+    std::string mBreakSource; // 原樣式名稱，可能爲空
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -8,14 +8,19 @@
  */
 
 #include "MergeODFParser.h"
+#include "MergeODFMailMerge.h"
+#include "MergeODFSegment.h"
+#include "MergeODFStream.h"
 
-#include <cassert>
+#include <algorithm>
 #include <iostream>
-#include <fstream>
+#include <set>
+#include <sstream>
 #include <string>
+#include <tuple>
 
+#include <Poco/Exception.h>
 #include <Poco/FileStream.h>
-#include <Poco/Tuple.h>
 #include <Poco/DOM/DOMParser.h>
 #include <Poco/DOM/Document.h>
 #include <Poco/DOM/NodeList.h>
@@ -23,30 +28,27 @@
 #include <Poco/DOM/Text.h>
 #include <Poco/Path.h>
 #include <Poco/File.h>
-#include <Poco/TemporaryFile.h>
-#include <Poco/Base64Decoder.h>
 #include <Poco/Dynamic/Var.h>
-#include <Poco/Zip/Decompress.h>
-#include <Poco/Zip/Compress.h>
-#include <Poco/SAX/InputSource.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/String.h>
 
-typedef Poco::Tuple<std::string, std::string> VarData;
 
-/// 將 xml 內容存回 .xml 檔
-void saveXmlBack(Poco::AutoPtr<Poco::XML::Document> docXML,
-        std::string xmlfile)
+/// 將 xml 內容輸出爲字串
+std::string xmlToString(Poco::AutoPtr<Poco::XML::Document> docXML)
 {
     std::ostringstream ostrXML;
     Poco::XML::DOMWriter writer;
     writer.writeNode(ostrXML, docXML);
-    const auto xml = ostrXML.str();
-
-    Poco::File f(xmlfile);
-    f.setSize(0);  // truncate
+    return ostrXML.str();
+}
 
-    Poco::FileOutputStream fos(xmlfile, std::ios::binary);
-    fos << xml;
-    fos.close();
+/// 讀取整個檔案
+std::string readFile(const std::string& fileName)
+{
+    std::string data;
+    Poco::FileInputStream fis(fileName, std::ios::binary);
+    Poco::StreamCopier::copyToString(fis, data);
+    return data;
 }
 
 /// check if number
@@ -76,30 +78,182 @@ bool isNumber(std::string s)
     return char_pos == s.size(); // must reach the ending 0 of the string
 }
 
-/// 以檔名開啟
-Parser::Parser()
-    : picserial(0)
-    , outAnotherJson(false)
-    , outYaml(false)
+/// 取得節點在文件中(或相對於 root)的位置
+NodePath nodePath(const Poco::XML::Node* node, const Poco::XML::Node* root = nullptr)
 {
+    NodePath path;
+    while (node != root && node->parentNode()
+           && node->parentNode()->nodeType() != Poco::XML::Node::DOCUMENT_NODE)
+    {
+        unsigned idx = 0;
+        for (auto sibling = node->previousSibling(); sibling; sibling = sibling->previousSibling())
+            idx++;
+        path.push_back(idx);
+        node = node->parentNode();
+    }
+    std::reverse(path.begin(), path.end());
+    return path;
 }
 
-Parser::~Parser()
+/// 依文件順序(preorder)為每個元素編號，與 SAX 讀到元素的順序相同
+void elementOrdinals(const Poco::XML::Node* root, std::map<const Poco::XML::Node*, unsigned>& ordinals)
 {
-    // 移除解壓縮的暫存目錄
-    if (!extra2.empty())
+    unsigned ordinal = 0;
+    const Poco::XML::Node* node = root;
+    while (node)
     {
-        Poco::File tempDir(extra2);
-        if (tempDir.exists())
-            tempDir.remove(true); // 完整移除該目錄及其下所有檔案
+        ordinals[node] = ordinal++;
+
+        // 下一個元素: 先往下，再往右，都沒有就往上找
+        const Poco::XML::Node* next = node->firstChild();
+        while (next && next->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+            next = next->nextSibling();
+        while (!next && node != root)
+        {
+            next = node->nextSibling();
+            while (next && next->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+                next = next->nextSibling();
+            if (!next)
+                node = node->parentNode();
+        }
+        node = next;
     }
 }
 
-/// set flags for /api /yaml or /json
-void Parser::setOutputFlags(bool anotherJson, bool yaml)
+/// 依文件順序找出 root 之下(不含 root)所有名爲 name 的元素
+void findElements(const Poco::XML::Node* root, const std::string& name,
+                  std::vector<Poco::XML::Element*>& result)
+{
+    for (auto child = root->firstChild(); child; child = child->nextSibling())
+    {
+        if (child->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+            continue;
+        if (child->nodeName() == name)
+            result.push_back(static_cast<Poco::XML::Element*>(child));
+        findElements(child, name, result);
+    }
+}
+
+/// 依文件順序找出 root 之下(不含 root)第一個名爲 name 的元素
+Poco::XML::Element* findElement(const Poco::XML::Node* root, const std::string& name)
+{
+    for (auto child = root->firstChild(); child; child = child->nextSibling())
+    {
+        if (child->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+            continue;
+        if (child->nodeName() == name)
+            return static_cast<Poco::XML::Element*>(child);
+        if (auto found = findElement(child, name))
+            return found;
+    }
+    return nullptr;
+}
+
+/// 走訪 content.xml 一次所得的索引，scanVarPtr() 各步驟都由此取得節點
+struct DocumentIndex
+{
+    struct Var
+    {
+        Poco::XML::Element* elm;
+        // 變數(不含直接的父節點)往上最近的範圍元素:
+        // Writer 爲 office:text 或 table:table-cell；Calc 爲 table:table 或 table:table-row-group
+        Poco::XML::Element* scope;
+    };
+    std::vector<Var> vars; // 文件順序
+    std::vector<Poco::XML::Element*> annotations; // office:annotation 及 office:annotation-end
+    std::unordered_map<const Poco::XML::Node*, Poco::XML::Element*> firstAnnotation; // 元素之下第一個 office:annotation
+};
+
+class DocumentIndexer
+{
+public:
+    DocumentIndexer(const std::string& varTag, const std::set<std::string>& scopeNames)
+        : mVarTag(varTag)
+        , mScopeNames(scopeNames)
+    {
+    }
+
+    DocumentIndex index(Poco::XML::Node* root)
+    {
+        mAncestors.push_back(root);
+        walk(root);
+        mAncestors.pop_back();
+        return std::move(mIndex);
+    }
+
+private:
+    void walk(Poco::XML::Node* node)
+    {
+        for (auto child = node->firstChild(); child; child = child->nextSibling())
+        {
+            if (child->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+                continue;
+
+            auto elm = static_cast<Poco::XML::Element*>(child);
+            const std::string& name = elm->nodeName();
+            if (name == "office:annotation" || name == "office:annotation-end")
+            {
+                mIndex.annotations.push_back(elm);
+                // 祖先已有記錄時，更上層的祖先也一定有
+                for (auto it = mAncestors.rbegin();
+                     name == "office:annotation" && it != mAncestors.rend()
+                     && mIndex.firstAnnotation.emplace(*it, elm).second;
+                     ++it)
+                    ;
+            }
+            else if (name == mVarTag)
+            {
+                Poco::XML::Element* scope = nullptr;
+                for (auto it = mScopes.rbegin(); it != mScopes.rend() && !scope; ++it)
+                {
+                    if (*it != node)
+                        scope = *it;
+                }
+                mIndex.vars.push_back({ elm, scope });
+            }
+
+            const bool isScope = mScopeNames.count(name) > 0;
+            if (isScope)
+                mScopes.push_back(elm);
+            mAncestors.push_back(elm);
+            walk(elm);
+            mAncestors.pop_back();
+            if (isScope)
+                mScopes.pop_back();
+        }
+    }
+
+    const std::string mVarTag;
+    const std::set<std::string>& mScopeNames;
+    std::vector<const Poco::XML::Node*> mAncestors;
+    std::vector<Poco::XML::Element*> mScopes;
+    DocumentIndex mIndex;
+};
+
+/// 依位置找回節點
+Poco::XML::Node* resolvePath(Poco::XML::Node* root, const NodePath& path)
+{
+    Poco::XML::Node* node = root;
+    for (const auto idx : path)
+    {
+        node = node->firstChild();
+        for (unsigned i = 0; i < idx; i++)
+            node = node->nextSibling();
+    }
+    return node;
+}
+
+bool TemplatePlan::isCurrent() const
+{
+    const Poco::File file(templateFile);
+    return file.exists() && file.getLastModified() == lastModified && file.getSize() == size;
+}
+
+/// 以檔名開啟
+Parser::Parser()
+    : doctype(DocType::OTHER)
+    , mRenderMode(RenderMode::DOM)
 {
-    outAnotherJson = anotherJson;
-    outYaml = yaml;
 }
 
 /// is text?
@@ -130,104 +284,261 @@ std::string Parser::getMimeType()
 /// 將樣板檔解開
 void Parser::extract(const std::string& templateFile)
 {
-    /* while (true)
+    const std::string archive = readFile(templateFile);
+    extract(archive, ZipReader::entries(archive));
+}
+
+/// 只解開需要處理的項目，全部留在記憶體中
+void Parser::extract(const std::string& archive, const std::vector<ZipEntry>& entries)
+{
+    for (const auto& entry : entries)
     {
-        extra2 = Poco::TemporaryFile::tempName();
-        if(!Poco::File(extra2).exists())
-            break;
-    } */
+        if (entry.name == "content.xml")
+            contentXml = ZipReader::inflate(archive, entry);
+        else if (entry.name == "META-INF/manifest.xml")
+            mManifest = ZipReader::inflate(archive, entry);
+        else if (entry.name == "mimetype")
+            mMimeType = ZipReader::inflate(archive, entry);
+    }
+}
 
-    extra2 = Poco::TemporaryFile::tempName();
+/// 編譯範本: 解析 content.xml 並記下變數位置
+std::shared_ptr<TemplatePlan> Parser::compile(const std::string& templateFile)
+{
+    auto plan = std::make_shared<TemplatePlan>();
+    const Poco::File file(templateFile);
+    plan->templateFile = templateFile;
+    plan->lastModified = file.getLastModified();
+    plan->size = file.getSize();
+    plan->archive = readFile(templateFile);
+    plan->entries = ZipReader::entries(plan->archive);
+
+    Parser parser;
+    parser.extract(plan->archive, plan->entries);
+    const auto allVar = parser.scanVarPtr();
+    for (const auto elm : allVar[0])
+        plan->singleVarPaths.push_back(nodePath(elm));
+    for (const auto elm : allVar[1])
+        plan->groupVarPaths.push_back(nodePath(elm));
+
+    // 串流輸出用: 記下各變數、群組樣板列在文件中的元素序號
+    std::map<const Poco::XML::Node*, unsigned> ordinals;
+    elementOrdinals(parser.docXML->documentElement(), ordinals);
+    for (const auto elm : allVar[0])
+    {
+        plan->singleVarOrdinals.insert(ordinals[elm]);
 
-    std::ifstream inp(templateFile, std::ios::binary);
+        // 填值時會改到的範圍: Writer 是變數所在段落；Calc 及統計變數會改到儲存格，以整列為範圍
+        const bool statistic = parser.varDescriptor(elm)->type == VarType::STATISTIC;
+        Poco::XML::Node* root = elm->parentNode();
+        for (int level = (parser.isSpreadSheet() || statistic) ? 2 : 0; level > 0; level--)
+        {
+            if (root->parentNode() && root->parentNode()->nodeType() == Poco::XML::Node::ELEMENT_NODE)
+                root = root->parentNode();
+        }
+        plan->bufferRootOrdinals.insert(ordinals[root]);
+    }
+    for (const auto row : allVar[1])
+    {
+        const std::string grpname = row->getAttribute("grpname");
+        plan->groupRowOrdinals[ordinals[row]] = grpname;
+        plan->bufferRootOrdinals.insert(ordinals[row]);
+        for (auto node = parser.rowsSpannedStart(row); node; node = node->nextSibling())
+        {
+            if (node->nodeType() == Poco::XML::Node::ELEMENT_NODE
+                && static_cast<Poco::XML::Element*>(node)->hasAttribute("table:number-rows-spanned"))
+                plan->rowsSpannedOrdinals[ordinals[node]].push_back(grpname);
+        }
+    }
+    plan->contentSource = parser.contentXml;
 
-    assert (inp.good());
-    Poco::Zip::Decompress dec(inp, extra2);
-    dec.decompressAllFiles();
-    assert (!dec.mapping().empty());
+    // 每種變數描述只解析一次(scanVarPtr() 時已全部解析)，輸出時直接查表
+    plan->descriptors = parser.mDescriptors;
+    plan->schema = parser.schema(allVar[0], allVar[1]);
+    plan->binding = parser.binding(allVar[0], allVar[1]);
+    plan->manifest = parser.mManifest;
+    plan->mimetype = parser.mMimeType;
 
-    zipfilepaths = dec.mapping();
-    for (auto it = zipfilepaths.begin(); it != zipfilepaths.end(); ++it)
-    {
-        const auto fileName = it->second.toString();
-        if (fileName == "content.xml")
-            contentXmlFileName = extra2 + "/" + fileName;
+    if (SegmentedTemplate::supports(parser, allVar[0], allVar[1]))
+        plan->segments = std::make_shared<SegmentedTemplate>(parser, allVar[1]);
 
-        if (fileName == "META-INF/manifest.xml")
-            metaFileName = extra2 + "/" + fileName;
-    }
+    plan->doctype = parser.doctype;
+    plan->contentXml = parser.docXML;
+    return plan;
+}
+
+/// 以編譯結果準備本次輸出
+void Parser::attach(const std::shared_ptr<const TemplatePlan>& plan)
+{
+    mPlan = plan;
+    doctype = plan->doctype;
+    mManifest = plan->manifest;
+    mMimeType = plan->mimetype;
 }
 
-/// 傳回樣板變數的值
-std::string Parser::varKeyValue(const std::string line,
-        const std::string key)
+/// 複製編譯結果給本次輸出使用，不再解壓縮及解析範本
+std::vector<std::list<Poco::XML::Element*>> Parser::load(const std::shared_ptr<const TemplatePlan>& plan)
 {
-    Poco::StringTokenizer tokens(line, ";", TOKENOPTS);
-    for(size_t idx = 0; idx < tokens.count(); idx ++)
+    attach(plan);
+
+    // plan 的 DOM 只讀取不修改，複製一份來填值
+    docXML = new Poco::XML::Document;
+    Poco::AutoPtr<Poco::XML::Node> root = docXML->importNode(plan->contentXml->documentElement(), true);
+    docXML->appendChild(root);
+
+    std::list<Poco::XML::Element*> singleVar;
+    std::list<Poco::XML::Element*> groupVar;
+    for (const auto& path : plan->singleVarPaths)
+        singleVar.push_back(static_cast<Poco::XML::Element*>(resolvePath(root, path)));
+    for (const auto& path : plan->groupVarPaths)
+        groupVar.push_back(static_cast<Poco::XML::Element*>(resolvePath(root, path)));
+
+    return { singleVar, groupVar };
+}
+
+VarDescriptor VarDescriptor::parse(const std::string& description)
+{
+    // 描述以 ; 分隔成 key:value，key 不分大小寫，重複時以第一個爲準
+    std::map<std::string, std::string> keyValues;
+    Poco::StringTokenizer tokens(description, ";", TOKENOPTS);
+    for (const auto& token : tokens)
     {
-        Poco::StringTokenizer keyval(tokens[idx], ":", TOKENOPTS);
-        if (0 == Poco::icompare(keyval[0], key))
+        Poco::StringTokenizer keyval(token, ":", TOKENOPTS);
+        if (keyval.count() == 0)
+            continue;
+        keyValues.emplace(Poco::toLower(keyval[0]), keyval.count() == 2 ? keyval[1] : "");
+    }
+
+    VarDescriptor desc;
+    if (auto it = keyValues.find("type"); it != keyValues.end())
+    {
+        static const std::vector<std::tuple<const char*, VarType, const char*>> types = {
+            { "image", VarType::FILE, "file" },
+            { "enum", VarType::ENUM, "enum" },
+            { "auto", VarType::AUTO, "auto" },
+            { "boolean", VarType::BOOLEAN, "boolean" },
+            { "float", VarType::FLOAT, "float" },
+            { "percentage", VarType::PERCENTAGE, "percentage" },
+            { "currency", VarType::CURRENCY, "currency" },
+            { "date", VarType::DATE, "date" },
+            { "time", VarType::TIME, "time" },
+            { "statistic", VarType::STATISTIC, "statistic" }
+        };
+        desc.typeName = "string";
+        for (const auto& type : types)
         {
-            if (Poco::toLower(key) == "type")
+            if (0 == Poco::icompare(it->second, std::get<0>(type)))
             {
-                if (0 == Poco::icompare(keyval[1], "image"))
-                    return "file";
-                if (0 == Poco::icompare(keyval[1], "enum"))
-                    return "enum";
-                if (0 == Poco::icompare(keyval[1], "auto"))
-                    return "auto";
-                if (0 == Poco::icompare(keyval[1], "boolean"))
-                    return "boolean";
-                if (0 == Poco::icompare(keyval[1], "float"))
-                    return "float";
-                if (0 == Poco::icompare(keyval[1], "percentage"))
-                    return "percentage";
-                if (0 == Poco::icompare(keyval[1], "currency"))
-                    return "currency";
-                if (0 == Poco::icompare(keyval[1], "date"))
-                    return "date";
-                if (0 == Poco::icompare(keyval[1], "time"))
-                    return "time";
-                if (0 == Poco::icompare(keyval[1], "Statistic"))
-                    return "statistic";
-                return "string";
+                desc.type = std::get<1>(type);
+                desc.typeName = std::get<2>(type);
+                break;
             }
-            if (keyval.count() == 2)
-                return keyval[1];
-            return "";  // split: 切完後若 aa: 後面沒字了
         }
     }
-    return "";
+
+    // enum、boolean 的選項
+    std::string items = keyValues["items"];
+    Poco::replaceInPlace(items, "\"", "");
+    Poco::StringTokenizer itemTokens(items, ",", TOKENOPTS);
+    desc.items.assign(itemTokens.begin(), itemTokens.end());
+
+    desc.format = keyValues["format"];
+    desc.description = keyValues["description"];
+    desc.apiHelp = keyValues["apihelp"];
+
+    // image size: 寬x高(cm)
+    Poco::StringTokenizer size(keyValues["size"], "x", TOKENOPTS);
+    if (size.count() >= 2)
+    {
+        desc.imageWidth = size[0] + "cm";
+        desc.imageHeight = size[1] + "cm";
+    }
+
+    // 統計變數: column 格式爲 工作表.$欄$列
+    desc.groupname = keyValues["groupname"];
+    static const std::map<std::string, std::string> methods = {
+        { "總和", "SUM" }, { "最大值", "MAX" }, { "最小值", "MIN" },
+        { "中位數", "MEDIAN" }, { "計數", "COUNT" }, { "平均", "AVERAGE" }
+    };
+    desc.method = keyValues["method"];
+    if (auto it = methods.find(desc.method); it != methods.end())
+        desc.method = it->second;
+
+    Poco::StringTokenizer column(keyValues["column"], ".", TOKENOPTS);
+    if (column.count() >= 2)
+    {
+        Poco::StringTokenizer addr(column[1], "$", TOKENOPTS);
+        if (addr.count() >= 2 && isNumber(addr[1]))
+        {
+            desc.column = addr[0];
+            desc.row = std::stoi(addr[1]);
+        }
+    }
+    return desc;
+}
+
+/// translate enum and boolean value
+std::string VarDescriptor::translate(const std::string& value) const
+{
+    if (type == VarType::ENUM && isNumber(value))
+    {
+        int enumIdx = std::stoi(value)-1;
+        if (enumIdx >= 0 && (unsigned)enumIdx < items.size())
+            return items[enumIdx];
+    }
+    if (type == VarType::BOOLEAN)  // True、Yes、1
+    {
+        unsigned enumIdx = ("1" == value ||
+                0 == Poco::icompare(value, "true") ||
+                0 == Poco::icompare(value, "yes")) ? 0 : 1;
+        if (enumIdx >= items.size())
+            throw Poco::RangeException("Boolean items out of range");
+        return items[enumIdx];
+    }
+    return value;
+}
+
+const std::shared_ptr<const VarDescriptor>& Parser::varDescriptor(const Poco::XML::Element* elm)
+{
+    const std::string& vardata
+        = elm->getAttribute(isText() ? "text:description" : "office:target-frame-name");
+    if (mPlan)
+    {
+        if (auto it = mPlan->descriptors.find(vardata); it != mPlan->descriptors.end())
+            return it->second;
+    }
+
+    auto it = mDescriptors.find(vardata);
+    if (it == mDescriptors.end())
+        it = mDescriptors.emplace(vardata, std::make_shared<const VarDescriptor>(VarDescriptor::parse(vardata))).first;
+    return it->second;
 }
 
 // Type:Enum;Items:"男,女";Descript:"""
 // Type:String;Description:""
 // Type:String;Format:民國年/月/日
-std::string Parser::parseJsonVar(std::string var,
-        std::string vardata,
-        bool anotherJson=false,
-        bool yaml=false)
+std::string Parser::parseJsonVar(const std::string& var,
+        const VarDescriptor& desc,
+        bool anotherJson,
+        bool yaml) const
 {
-    std::string typevar = varKeyValue(vardata, "Type");
-    std::string enumvar = varKeyValue(vardata, "Items");
-    std::string descvar = varKeyValue(vardata, "Description");
-    std::string formatvar = varKeyValue(vardata, "Format");
-    std::string apihelpvar = varKeyValue(vardata, "ApiHelp");
+    const std::vector<std::string>& tokens = desc.items;
+    std::string descvar = desc.description;
+    std::string formatvar = desc.format;
+    const std::string& apihelpvar = desc.apiHelp;
     std::string databuf;
 
     bool first = true;
-    if (typevar == "enum" && !enumvar.empty())
+    if (desc.type == VarType::ENUM && !tokens.empty())
     {
         if (yaml)
         {
-            Poco::replaceInPlace(enumvar, "\"", "");
-            Poco::StringTokenizer tokens(enumvar, ",", TOKENOPTS);
             std::string enumvardata = "\"enum\": [";
-            for(size_t idx = 0; idx < tokens.count(); idx ++)
+            for(size_t idx = 0; idx < tokens.size(); idx ++)
             {
                 const auto tok = tokens[idx];
                 enumvardata += "\"" + tok + "\"";
-                if (idx != tokens.count() - 1)
+                if (idx != tokens.size() - 1)
                     enumvardata += ",";
             }
             enumvardata += "]\n";
@@ -236,14 +547,12 @@ std::string Parser::parseJsonVar(std::string var,
         }
         else
         {
-            Poco::replaceInPlace(enumvar, "\"", "");
-            Poco::StringTokenizer tokens(enumvar, ",", TOKENOPTS);
             std::string enumvardata = ",\n                        \"enum\":[";
-            for(size_t idx = 0; idx < tokens.count(); idx ++)
+            for(size_t idx = 0; idx < tokens.size(); idx ++)
             {
                 const auto tok = tokens[idx];
                 enumvardata += "\"" + tok + "\"";
-                if (idx != tokens.count() - 1)
+                if (idx != tokens.size() - 1)
                     enumvardata += ",";
             }
             enumvardata += "]";
@@ -301,7 +610,7 @@ std::string Parser::parseJsonVar(std::string var,
         }
     }
 
-    std::string realtype = varKeyValue(vardata, "Type");
+    const std::string& realtype = desc.typeName;
 
     //auto jvalue = !formatvar.empty() ? formatvar : !descvar.empty() ? descvar : "";
     auto jjvalue = realtype;
@@ -403,7 +712,7 @@ std::string Parser::parseJsonVar(std::string var,
     if (anotherJson)
         return "\"" + var + "\": " + "\"" + jjvalue + "\"";
 
-    if (outYaml)
+    if (yaml)
         return Poco::format(YAMLPARAMTEMPL, var, jvalue, databuf);
     else
         return Poco::format(PARAMTEMPL, var, jvalue, databuf);
@@ -426,33 +735,6 @@ void Parser::detectDocType()
     }
 }
 
-/// translate enum and boolean value
-std::string Parser::parseEnumValue(std::string type,
-        std::string enumvar,
-        std::string value)
-{
-    if (type == "enum" && isNumber(value))
-    {
-        Poco::replaceInPlace(enumvar, "\"", "");
-        Poco::StringTokenizer tokens(enumvar, ",", TOKENOPTS);
-        int enumIdx = std::stoi(value)-1;
-        if (enumIdx >= 0 && (unsigned)enumIdx < tokens.count())
-        {
-            value = tokens[enumIdx];
-        }
-    }
-    if (type == "boolean")  // True、Yes、1
-    {
-        Poco::replaceInPlace(enumvar, "\"", "");
-        Poco::StringTokenizer tokens(enumvar, ",", TOKENOPTS);
-        int enumIdx = ("1" == value ||
-                0 == Poco::icompare(value, "true") ||
-                0 == Poco::icompare(value, "yes")) ? 0 : 1;
-        value = tokens[enumIdx];
-    }
-    return value;
-}
-
 /// meta-inf: xxx-template -> xxx
 /// for bug: excel/word 不能開啟 xxx-template 的文件
 std::string Parser::replaceMetaMimeType(std::string attr)
@@ -466,93 +748,180 @@ std::string Parser::replaceMetaMimeType(std::string attr)
     return attr;
 }
 
-/// for bug: excel/word 不能開啟 xxx-template 的文件
+/// for bug: excel/word 不能開啟 xxx-template 的文件，並登錄本次加入的圖片(mimetype 在 zipback() 處理)
 void Parser::updateMetaInfo()
 {
     /// meta-inf file
-    Poco::XML::InputSource inputSrc(metaFileName);
     Poco::XML::DOMParser parser;
-    auto docXmlMeta = parser.parse(&inputSrc);
-    auto listNodesMeta =
+    Poco::AutoPtr<Poco::XML::Document> docXmlMeta = parser.parseMemory(mManifest.data(), mManifest.size());
+    Poco::AutoPtr<Poco::XML::NodeList> listNodesMeta =
         docXmlMeta->getElementsByTagName("manifest:file-entry");
 
+    std::set<std::string> fullPaths;
     for (unsigned long it = 0; it < listNodesMeta->length(); ++it)
     {
         auto elm = static_cast<Poco::XML::Element*>(listNodesMeta->item(it));
-        if (elm->getAttribute("manifest:full-path") == "/")
+        const std::string fullPath = elm->getAttribute("manifest:full-path");
+        fullPaths.insert(fullPath);
+        if (fullPath == "/")
         {
             auto attr = elm->getAttribute("manifest:media-type");
             elm->setAttribute("manifest:media-type",
                     replaceMetaMimeType(attr));
         }
     }
-    saveXmlBack(docXmlMeta, metaFileName);
 
-    /// mimetype file
-    auto mimeFile = extra2 + "/mimetype";
-    Poco::FileInputStream istr(mimeFile);
-    std::string mime;
-    istr >> mime;
-    istr.close();
+    /// 本次加入的圖片一次登錄
+    for (unsigned serial = 0; serial < mPictures.size(); serial++)
+    {
+        const std::string fullPath = "Pictures/" + std::to_string(serial);
+        if (fullPaths.count(fullPath))
+            continue;
 
-    mime = replaceMetaMimeType(mime);
-    Poco::File f(mimeFile);
-    f.setSize(0);  // truncate
+        Poco::AutoPtr<Poco::XML::Element> pElm = docXmlMeta->createElement("manifest:file-entry");
+        pElm->setAttribute("manifest:full-path", fullPath);
+        pElm->setAttribute("manifest:media-type", "");
+        docXmlMeta->documentElement()->appendChild(pElm);
+    }
+    mManifest = xmlToString(docXmlMeta);
+}
 
-    Poco::FileOutputStream fos(mimeFile, std::ios::binary);
-    fos << mime;
-    fos.close();
+/// 串流輸出 content.xml，只有含變數的片段會暫時組成 DOM
+/// 實際輸出在 zipback() 寫入 content.xml 時進行
+void Parser::renderStreaming(Poco::JSON::Object::Ptr jsonData)
+{
+    mRenderMode = RenderMode::STREAMING;
+    mJsonData = jsonData;
 }
 
-/// write picture info to meta file
-void Parser::updatePic2MetaXml()
+/// 以預先切段的範本輸出 content.xml，不需解析 XML
+/// 實際輸出在 zipback() 寫入 content.xml 時進行
+void Parser::renderSegmented(Poco::JSON::Object::Ptr jsonData)
 {
-    Poco::XML::InputSource inputSrc(metaFileName);
-    Poco::XML::DOMParser parser;
-    //parser.setFeature(XMLReader::FEATURE_NAMESPACE_PREFIXES, false);
-    auto docXmlMeta = parser.parse(&inputSrc);
-    auto listNodesMeta =
-        docXmlMeta->getElementsByTagName("manifest:manifest");
-    auto pElm = docXmlMeta->createElement("manifest:file-entry");
-    pElm->setAttribute("manifest:full-path",
-            "Pictures/" + std::to_string(picserial));
-    pElm->setAttribute("manifest:media-type", "");
-    static_cast<Poco::XML::Element*>(listNodesMeta->item(0))->appendChild(pElm);
-
-    saveXmlBack(docXmlMeta, metaFileName);
+    mRenderMode = RenderMode::SEGMENTED;
+    mJsonData = jsonData;
+}
+
+/// 合併多筆資料產生的 content.xml
+/// 實際輸出在 zipback() 寫入 content.xml 時進行
+void Parser::renderMerged(const std::vector<Poco::JSON::Object::Ptr>& records)
+{
+    mRenderMode = RenderMode::MERGED;
+    mRecords = records;
+}
+
+/// 每筆資料以切段或串流方式產生一份 content.xml(不建立整份 DOM)，只保留目前這一份，
+/// 圖片登錄在同一個 Parser，相同的圖片在合併後的文件中只有一份
+void Parser::writeMerged(std::ostream& out)
+{
+    MailMergeWriter writer(out, doctype);
+    for (auto& record : mRecords)
+    {
+        std::ostringstream content;
+        if (mPlan->segments)
+            mPlan->segments->render(*this, record, content);
+        else
+        {
+            docXML = new Poco::XML::Document; // 只放目前處理中的片段
+            StreamRenderer renderer(*this, *mPlan, record, content);
+            renderer.render();
+        }
+        record = nullptr; // 資料用完就釋放
+        writer.add(content.str());
+    }
+    writer.close();
+}
+
+/// 產生 content.xml
+void Parser::writeContent(std::ostream& out)
+{
+    switch (mRenderMode)
+    {
+        case RenderMode::DOM:
+        {
+            Poco::XML::DOMWriter writer;
+            writer.writeNode(out, docXML);
+            break;
+        }
+        case RenderMode::STREAMING:
+        {
+            docXML = new Poco::XML::Document; // 只放目前處理中的片段
+            StreamRenderer renderer(*this, *mPlan, mJsonData, out);
+            renderer.render();
+            break;
+        }
+        case RenderMode::SEGMENTED:
+            mPlan->segments->render(*this, mJsonData, out);
+            break;
+        case RenderMode::MERGED:
+            writeMerged(out);
+            break;
+    }
 }
 
 /// zip it
-std::string Parser::zipback()
+/// 邊產生邊寫出: 範本中未變動的項目直接複製已壓縮的資料並先送出，
+/// 接著是邊產生邊壓縮的 content.xml，manifest 及新加入的圖片在 content.xml 產生後才確定，放在最後
+void Parser::zipback(std::ostream& out)
 {
+    ZipWriter zip(out);
+
+    // ODF 規定 mimetype 必須是第一個項目且不壓縮
+    mMimeType = replaceMetaMimeType(Poco::trim(mMimeType));
+    zip.add("mimetype", mMimeType, false);
+
+    for (const auto& entry : mPlan->entries)
+    {
+        if (entry.name == "mimetype" || entry.name == "content.xml"
+            || entry.name == "META-INF/manifest.xml")
+            continue;
+
+        // 與新加入的圖片同名的項目會被取代(圖片數在 content.xml 產生後才確定)
+        if (entry.name.compare(0, 9, "Pictures/") == 0)
+            continue;
+
+        zip.addRaw(mPlan->archive, entry);
+    }
+
+    // 大小未知，以 data descriptor 記錄
+    writeContent(zip.openEntry("content.xml"));
+    zip.closeEntry();
+    // 串流及合併輸出時，圖片在產生 content.xml 的過程中才加入
     updateMetaInfo();
-    saveXmlBack(docXML, contentXmlFileName);
 
-    // zip
-    const std::string zip2 = extra2 + (isText() ? ".odt" : ".ods");
+    std::set<std::string> pictures;
+    for (unsigned serial = 0; serial < mPictures.size(); serial++)
+        pictures.insert("Pictures/" + std::to_string(serial));
 
-    std::ofstream out(zip2, std::ios::binary);
-    Poco::Zip::Compress c(out, true);
+    // 範本原有的圖片
+    for (const auto& entry : mPlan->entries)
+    {
+        if (entry.name.compare(0, 9, "Pictures/") == 0 && !pictures.count(entry.name))
+            zip.addRaw(mPlan->archive, entry);
+    }
 
-    c.addRecursive(extra2);
-    c.close();
-    return zip2;
-}
+    zip.add("META-INF/manifest.xml", mManifest);
 
-/// get json
-std::string Parser::jsonVars()
-{
-    jsonvars = "";
+    mDecoder.wait();
+    for (unsigned serial = 0; serial < mPictures.size(); serial++)
+    {
+        const Picture& picture = *mPictures[serial];
+        const std::string name = "Pictures/" + std::to_string(serial);
+        // 快取中的圖片已壓縮好
+        if (!picture.compressed.empty())
+            zip.addPrepared(name, picture.entry, picture.compressed);
+        else
+            zip.add(name, picture.data);
+    }
 
-    auto allVar = scanVarPtr();
-    std::list<Poco::XML::Element*> singleVar = allVar[0];
-    std::list<Poco::XML::Element*> groupVar = allVar[1];
+    zip.close();
+}
 
-    std::string Var_Tag_Property;
-    if(isText())
-        Var_Tag_Property = "text:description";
-    else if(isSpreadSheet())
-        Var_Tag_Property = "office:target-frame-name";
+/// 整理範本中的變數(同名只取第一個)，產生 API 文件用
+TemplateSchema Parser::schema(const std::list<Poco::XML::Element*>& singleVar,
+                              const std::list<Poco::XML::Element*>& groupVar)
+{
+    TemplateSchema result;
 
     std::string VAR_TAG;
     if(isText())
@@ -560,130 +929,141 @@ std::string Parser::jsonVars()
     else if(isSpreadSheet())
         VAR_TAG = "text:a";
 
-    std::list<std::string> singleList;
-    for (auto it = singleVar.begin(); it!=singleVar.end(); it++)
+    // Writer 變數名稱要去掉前後的 <>
+    auto varName = [this](Poco::XML::Element* elm)
     {
-        auto elm = *it;
-        auto varName = elm->innerText();
-        if(isText())
-            varName = varName.substr(1, varName.size()-2);
-        auto checkExist = std::find(singleList.begin(), singleList.end(), varName);
-        if(checkExist != singleList.end())
-            continue;
-        jsonvars += parseJsonVar(varName, elm->getAttribute(Var_Tag_Property)) + ",";
-        singleList.push_back(varName);
+        auto name = elm->innerText();
+        if (isText())
+            name = name.substr(1, name.size()-2);
+        return name;
+    };
+
+    std::set<std::string> singleList;
+    for (auto elm : singleVar)
+    {
+        SchemaField field = { varName(elm), varDescriptor(elm) };
+        if (singleList.insert(field.name).second)
+            result.singles.push_back(field);
     }
-    std::list<std::string> groupList;
-    for (auto it = groupVar.begin(); it!=groupVar.end(); it++)
+
+    std::set<std::string> groupList;
+    for (auto row : groupVar)
     {
-        auto checkGrpExist = std::find(groupList.begin(), groupList.end(), (*it)->getAttribute("grpname"));
-        if(checkGrpExist != groupList.end())
+        SchemaGroup group;
+        group.name = row->getAttribute("grpname");
+        if (!groupList.insert(group.name).second)
             continue;
-        groupList.push_back((*it)->getAttribute("grpname"));
 
-        auto rowVar = (*it)->getElementsByTagName(VAR_TAG);
-        int childLen = rowVar->length();
-        std::string cells = "";
-        std::string grpname = (*it)->getAttribute("grpname");
-        std::list<std::string> childVarList;
-        for (int i=0; i<childLen; i++)
+        std::vector<Poco::XML::Element*> rowVar;
+        findElements(row, VAR_TAG, rowVar);
+        std::set<std::string> childVarList;
+        for (auto elm : rowVar)
         {
-            auto elm = static_cast<Poco::XML::Element*>(rowVar->item(i));
-            auto varName = elm->innerText();
-            if(isText())
-                varName = varName.substr(1, varName.size()-2);
-            auto checkVarExist = std::find(childVarList.begin(), childVarList.end(), varName);
-            if(checkVarExist != childVarList.end())
-                continue;
-            childVarList.push_back(varName);
-            cells += parseJsonVar(varName, elm->getAttribute(Var_Tag_Property));
-            if ((i+1)<childLen)
-                cells += ",";
+            SchemaField field = { varName(elm), varDescriptor(elm) };
+            if (childVarList.insert(field.name).second)
+                group.fields.push_back(field);
         }
-        jsonvars += Poco::format(PARAMGROUPTEMPL, grpname, grpname, cells);
+        result.groups.push_back(group);
     }
-    jsonvars = jsonvars.substr(0, jsonvars.length() - 1);
-    return jsonvars;
+    return result;
 }
 
-// get json for another
-std::string Parser::jjsonVars()
+/// 範本用到的 JSON 鍵值，讀取請求時只保留這些
+JsonBinding Parser::binding(const std::list<Poco::XML::Element*>& singleVar,
+                            const std::list<Poco::XML::Element*>& groupVar)
 {
-    jjsonvars = "";
-
-    auto allVar = scanVarPtr();
-    std::list<Poco::XML::Element*> singleVar = allVar[0];
-    std::list<Poco::XML::Element*> groupVar = allVar[1];
+    JsonBinding result;
+    const std::string VAR_TAG = isText() ? "text:placeholder" : "text:a";
+    // 同一個鍵值全部都是圖片時，讀取時才直接解碼
+    std::map<std::string, bool> pictures;
+    auto addKey = [&](std::set<std::string>& keys, const std::string& key,
+                      const VarDescriptor& desc)
+    {
+        keys.insert(key);
+        auto it = pictures.emplace(key, true).first;
+        it->second = it->second && desc.type == VarType::FILE;
+    };
 
-    std::string Var_Tag_Property;
-    if(isText())
-        Var_Tag_Property = "text:description";
-    else if(isSpreadSheet())
-        Var_Tag_Property = "office:target-frame-name";
+    for (auto elm : singleVar)
+    {
+        const auto& desc = *varDescriptor(elm);
+        addKey(result.keys, varJsonKey(elm), desc);
+        if (desc.type == VarType::STATISTIC)
+            result.keys.insert(desc.groupname);
+    }
 
-    std::string VAR_TAG;
-    if(isText())
-        VAR_TAG = "text:placeholder";
-    else if(isSpreadSheet())
-        VAR_TAG = "text:a";
+    for (auto row : groupVar)
+    {
+        const std::string grpname = row->getAttribute("grpname");
+        result.keys.insert(grpname);
+        pictures[grpname] = false;
+
+        std::set<std::string>& groupKeys = result.groupKeys[grpname];
+        std::vector<Poco::XML::Element*> rowVar;
+        findElements(row, VAR_TAG, rowVar);
+        for (auto elm : rowVar)
+        {
+            const std::string key = varJsonKey(elm);
+            const auto& desc = *varDescriptor(elm);
+            addKey(groupKeys, key, desc);
+            // 第一列會再取一次最上層的同名資料
+            addKey(result.keys, key, desc);
+        }
+    }
 
-    std::list<std::string> singleList;
-    for (auto it = singleVar.begin(); it!=singleVar.end(); it++)
+    for (const auto& picture : pictures)
     {
-        auto elm = *it;
-        auto varName = elm->innerText();
-        if(isText())
-            varName = varName.substr(1, varName.size()-2);
-        auto checkExist = std::find(singleList.begin(), singleList.end(), varName);
-        if (checkExist != singleList.end())
-            continue;
-        singleList.push_back(varName);
-        jjsonvars += parseJsonVar(varName, elm->getAttribute(Var_Tag_Property), true) + ",<br />";
+        if (picture.second)
+            result.pictureKeys.insert(picture.first);
     }
+    return result;
+}
 
-    std::list<std::string> groupList;
-    for (auto it = groupVar.begin(); it!=groupVar.end(); it++)
+/// get json
+std::string Parser::jsonVars(const TemplateSchema& schema) const
+{
+    std::string jsonvars;
+    for (const auto& field : schema.singles)
+        jsonvars += parseJsonVar(field.name, *field.descriptor, false, false) + ",";
+
+    for (const auto& group : schema.groups)
     {
-        auto checkGrpExist = std::find(groupList.begin(), groupList.end(), (*it)->getAttribute("grpname"));
-        if(checkGrpExist != groupList.end())
-            continue;
-        groupList.push_back((*it)->getAttribute("grpname"));
+        std::string cells = "";
+        for (const auto& field : group.fields)
+        {
+            if (!cells.empty())
+                cells += ",";
+            cells += parseJsonVar(field.name, *field.descriptor, false, false);
+        }
+        jsonvars += Poco::format(PARAMGROUPTEMPL, group.name, group.name, cells);
+    }
+    jsonvars = jsonvars.substr(0, jsonvars.length() - 1);
+    return jsonvars;
+}
 
-        auto rowVar = (*it)->getElementsByTagName(VAR_TAG);
-        int childLen = rowVar->length();
-        std::string grpname = (*it)->getAttribute("grpname");
+// get json for another
+std::string Parser::jjsonVars(const TemplateSchema& schema) const
+{
+    std::string jjsonvars;
+    for (const auto& field : schema.singles)
+        jjsonvars += parseJsonVar(field.name, *field.descriptor, true, false) + ",<br />";
 
-        jjsonvars += "&nbsp;&nbsp;&nbsp;&nbsp;\"" + grpname + "\":[<br />";
+    for (const auto& group : schema.groups)
+    {
+        jjsonvars += "&nbsp;&nbsp;&nbsp;&nbsp;\"" + group.name + "\":[<br />";
         jjsonvars += "&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;{";
 
-        std::list<std::string> childVarList;
-        for (int i=0; i<childLen; i++)
+        for (std::size_t i = 0; i < group.fields.size(); i++)
         {
-            auto elm = static_cast<Poco::XML::Element*>(rowVar->item(i));
-            auto varName = elm->innerText();
-            if(isText())
-                varName = varName.substr(1,varName.size()-2);
-            auto checkVarExist = std::find(childVarList.begin(), childVarList.end(), varName);
-            if(checkVarExist != childVarList.end())
-                continue;
-            childVarList.push_back(varName);
-
-            jjsonvars += parseJsonVar(varName, elm->getAttribute(Var_Tag_Property), true);
-            if ((i+1) != childLen)
+            if (i > 0)
                 jjsonvars += ",";
+            jjsonvars += parseJsonVar(group.fields[i].name, *group.fields[i].descriptor, true, false);
         }
         jjsonvars += "}";
         jjsonvars += "<br />&nbsp;&nbsp;&nbsp;&nbsp;]";
-
-
-
-        auto kk = it;
-        if ((kk++) != (groupVar.end()))
-            jjsonvars += ",";
-
-        jjsonvars += "<br />";
+        jjsonvars += ",<br />";
     }
-    if (jjsonvars.substr(jjsonvars.length() - 7, 7) == ",<br />")
+    if (jjsonvars.length() >= 7 && jjsonvars.substr(jjsonvars.length() - 7, 7) == ",<br />")
     {
         jjsonvars = jjsonvars.substr(0, jjsonvars.length() - 7);
         jjsonvars += "<br />";
@@ -692,67 +1072,18 @@ std::string Parser::jjsonVars()
 }
 
 // get yaml
-std::string Parser::yamlVars()
+std::string Parser::yamlVars(const TemplateSchema& schema) const
 {
-    yamlvars = "";
-
-    auto allVar = scanVarPtr();
-    std::list<Poco::XML::Element*> singleVar = allVar[0];
-    std::list<Poco::XML::Element*> groupVar = allVar[1];
+    std::string yamlvars;
+    for (const auto& field : schema.singles)
+        yamlvars += parseJsonVar(field.name, *field.descriptor, false, true);
 
-    std::string Var_Tag_Property;
-    if(isText())
-        Var_Tag_Property = "text:description";
-    else if(isSpreadSheet())
-        Var_Tag_Property = "office:target-frame-name";
-
-    std::string VAR_TAG;
-    if(isText())
-        VAR_TAG = "text:placeholder";
-    else if(isSpreadSheet())
-        VAR_TAG = "text:a";
-
-
-    std::list<std::string> singleList;
-    for (auto it = singleVar.begin(); it!=singleVar.end(); it++)
-    {
-        auto elm = *it;
-        auto varName = elm->innerText();
-        if(isText())
-            varName = varName.substr(1, varName.size()-2);
-        auto checkExist = std::find(singleList.begin(), singleList.end(), varName);
-        if(checkExist != singleList.end())
-            continue;
-
-        singleList.push_back(varName);
-        yamlvars += parseJsonVar(varName, elm->getAttribute(Var_Tag_Property), false, true);
-    }
-
-    std::list<std::string> groupList;
-    for (auto it = groupVar.begin(); it!=groupVar.end(); it++)
+    for (const auto& group : schema.groups)
     {
-        auto checkGrpExist = std::find(groupList.begin(), groupList.end(), (*it)->getAttribute("grpname"));
-        if(checkGrpExist != groupList.end())
-            continue;
-        groupList.push_back((*it)->getAttribute("grpname"));
-        auto rowVar = (*it)->getElementsByTagName(VAR_TAG);
-        int childLen = rowVar->length();
-        std::string grpname = (*it)->getAttribute("grpname");
         std::string cells = "";
-
-        std::list<std::string> childVarList;
-        for (int i=0; i<childLen; i++)
+        for (const auto& field : group.fields)
         {
-            auto elm = static_cast<Poco::XML::Element*>(rowVar->item(i));
-            auto varName = elm->innerText();
-            if(isText())
-                varName = varName.substr(1, varName.size()-2);
-            auto checkVarExist = std::find(childVarList.begin(), childVarList.end(), varName);
-            if(checkVarExist != childVarList.end())
-                continue;
-            childVarList.push_back(varName);
-
-            std::string var = parseJsonVar(varName, elm->getAttribute(Var_Tag_Property), outAnotherJson, outYaml);
+            std::string var = parseJsonVar(field.name, *field.descriptor, false, true);
             std::string newSpaceVar;
 
             /// 補上空白 = ident 符合 array
@@ -763,7 +1094,7 @@ std::string Parser::yamlVars()
             }
             cells += newSpaceVar;
         }
-        yamlvars += Poco::format(YAMLPARAMGROUPTEMPL, grpname, grpname, cells);
+        yamlvars += Poco::format(YAMLPARAMGROUPTEMPL, group.name, group.name, cells);
     }
     return yamlvars;
 }
@@ -772,173 +1103,234 @@ std::string Parser::yamlVars()
 std::vector<std::list<Poco::XML::Element*>> Parser::scanVarPtr()
 {
     // Load XML to program
-    Poco::XML::InputSource inputSrc(contentXmlFileName);
     Poco::XML::DOMParser parser;
     parser.setFeature(Poco::XML::XMLReader::FEATURE_NAMESPACES, false);
     parser.setFeature(Poco::XML::XMLReader::FEATURE_NAMESPACE_PREFIXES, true);
-    docXML = parser.parse(&inputSrc);
+    docXML = parser.parseMemory(contentXml.data(), contentXml.size());
 
-    Poco::AutoPtr<Poco::XML::NodeList> listNodes;
-    std::list <VarData> listvars;
     std::list <Poco::XML::Element*> singleVar;
     std::list <Poco::XML::Element*> groupVar;
     std::vector <std::list<Poco::XML::Element*>> result;
 
     detectDocType();
 
-    if (isText())
+    // 走訪整份文件一次，取得變數、所在範圍及群組註解
+    static const std::set<std::string> textScopes = { "office:text", "table:table-cell" };
+    static const std::set<std::string> sheetScopes = { "table:table", "table:table-row-group" };
+    DocumentIndexer indexer(isText() ? "text:placeholder" : "text:a",
+                            isText() ? textScopes : sheetScopes);
+    const DocumentIndex index = indexer.index(docXML);
+
+    std::set<Poco::XML::Element*> groupRows;
+    auto addGroupRow = [&](Poco::XML::Element* row, Poco::XML::Element* annotation)
     {
+        // If there are different office:annotation name, only take the first grpname as target
+        row->setAttribute("grpname", annotation->lastChild()->innerText());
+        if (groupRows.insert(row).second)
+            groupVar.push_back(row);
+    };
 
-        // Scan All Var Pointer save into list
-        listNodes = docXML->getElementsByTagName("text:placeholder");
-        int totalVar = listNodes->length();
-        for (int idx=0; idx < totalVar; idx++)
+    if (isText())
+    {
+        for (const auto& var : index.vars)
         {
-            Poco::XML::Element* currentNode = static_cast<Poco::XML::Element*>(listNodes->item(idx));
-            auto Parent_1 = static_cast<Poco::XML::Element*>(currentNode->parentNode());
-            auto Parent_2 = Parent_1->parentNode();
-            while(true){
-                std::string nodeName = Parent_2->nodeName();
-                if(nodeName == "office:text" || nodeName == "table:table-cell")
-                {
-                    break;
-                }
-                Parent_2 = Parent_2->parentNode();
-            }
-            auto Parent_3 = static_cast<Poco::XML::Element*>(Parent_2->parentNode());
-            if(Parent_2->nodeName() != "table:table-cell")
+            Poco::XML::Element* currentNode = var.elm;
+            varDescriptor(currentNode);
+
+            if (!var.scope || var.scope->nodeName() != "table:table-cell")
             {
                 singleVar.push_back(currentNode);
+                continue;
             }
-            else
-            {
-                auto grpNodeList = Parent_3->getElementsByTagName("office:annotation");
-                int grpLen = grpNodeList->length();
-                if (grpLen == 0)
-                {
-                    singleVar.push_back(currentNode);
-                }
-                else
-                {
-                    // If there are different office:annotation name, only take the first grpname as target
-                    std::string grpname = grpNodeList->item(0)->lastChild()->innerText();
-                    Parent_3->setAttribute("grpname", grpname);
-                    auto checkDuplicate = std::find(groupVar.begin(), groupVar.end(), Parent_3);
-                    if (checkDuplicate == groupVar.end())
-                        groupVar.push_back(Parent_3);
-                }
-
-            }
-        }
 
-        // 刪掉 grp tag
-        auto grpNodeList = docXML->getElementsByTagName("office:annotation");
-        int grpLen = grpNodeList->length();
-        for(auto tmp_grp_len = 0; tmp_grp_len < grpLen; tmp_grp_len++)
-        {
-            auto grpNode = grpNodeList->item(0);
-            grpNode->parentNode()->removeChild(grpNode);
-        }
-        grpNodeList = docXML->getElementsByTagName("office:annotation-end");
-        grpLen = grpNodeList->length();
-        for(auto tmp_grp_len = 0; tmp_grp_len < grpLen; tmp_grp_len++)
-        {
-            auto grpNode = grpNodeList->item(0);
-            grpNode->parentNode()->removeChild(grpNode);
+            auto row = static_cast<Poco::XML::Element*>(var.scope->parentNode());
+            auto annotation = index.firstAnnotation.find(row);
+            if (annotation == index.firstAnnotation.end())
+                singleVar.push_back(currentNode);
+            else
+                addGroupRow(row, annotation->second);
         }
     }
     if (isSpreadSheet())
     {
-        // Scan All Var Pointer save into list
-        listNodes = docXML->getElementsByTagName("text:a");
-        int totalVar = listNodes->length();
-        for (int idx=0; idx < totalVar; idx++)
+        for (const auto& var : index.vars)
         {
-            Poco::XML::Element* currentNode = static_cast<Poco::XML::Element*>(listNodes->item(idx));
-            std::string vardata  = currentNode->getAttribute("office:target-frame-name");
-            std::string type     = varKeyValue(vardata, "type");
-            auto Parent_1 = static_cast<Poco::XML::Element*>(currentNode->parentNode());
-            auto Parent_2 = static_cast<Poco::XML::Element*>(Parent_1->parentNode());
-            while(true){
-                std::string nodeName = Parent_2->nodeName();
-                if(nodeName == "table:table" || nodeName == "table:table-row-group")
-                {
-                    break;
-                }
-                Parent_2 = static_cast<Poco::XML::Element*>(Parent_2->parentNode());
-            }
-            Parent_2 = static_cast<Poco::XML::Element*> (Parent_2);
+            Poco::XML::Element* currentNode = var.elm;
+            const bool statistic = varDescriptor(currentNode)->type == VarType::STATISTIC;
+
             // 如果是 SC 的範本精靈把群組去掉後會保留 table-row-group 所以要雙重檢測
-            if(Parent_2->nodeName() == "table:table")
+            if (!var.scope || var.scope->nodeName() == "table:table")
             {
                 singleVar.push_back(currentNode);
+                continue;
             }
             // 儘管是群組中的統計變數也要拉出來個別處理，不然在 setGroupVar 無法進行全域的 jsonData 掃描
-            else if (type == "statistic")
+            if (statistic)
             {
                 singleVar.push_back(currentNode);
+                continue;
             }
-            else
+
+            auto annotation = index.firstAnnotation.find(var.scope);
+            if (annotation == index.firstAnnotation.end())
             {
-                auto grpNodeList = Parent_2->getElementsByTagName("office:annotation");
-                int grpLen = grpNodeList->length();
-                if (grpLen == 0)
-                {
-                    singleVar.push_back(currentNode);
-                }
-                else
+                singleVar.push_back(currentNode);
+                continue;
+            }
+
+            //Ensure put attr grpname in the table:table-row not in table:table-row-group!
+            auto row = static_cast<Poco::XML::Element*>(var.scope->firstChild());
+            while (row->nodeName() != "table:table-row")
+                row = static_cast<Poco::XML::Element*>(row->firstChild());
+            addGroupRow(row, annotation->second);
+        }
+    }
+
+    // 刪掉 grp tag
+    if (isText() || isSpreadSheet())
+    {
+        for (auto annotation : index.annotations)
+            annotation->parentNode()->removeChild(annotation);
+    }
+
+    result.push_back(singleVar);
+    result.push_back(groupVar);
+    return result;
+}
+
+/// 依群組列數更新 table:number-rows-spanned 的起點儲存格
+Poco::XML::Node* Parser::rowsSpannedStart(Poco::XML::Node* row)
+{
+    if (isSpreadSheet())
+    {
+        Poco::XML::Node* targetNode = row;
+        while (targetNode && targetNode->nodeName() != "table:table-row-group")
+            targetNode = targetNode->parentNode();
+        if (!targetNode)
+            return nullptr;
+
+        return targetNode->previousSibling() ? targetNode->previousSibling()->firstChild() : targetNode;
+    }
+
+    return row->previousSibling() ? row->previousSibling()->firstChild() : nullptr;
+}
+
+/// 擴增跨列的行數
+void Parser::updateRowsSpanned(Poco::XML::Node* row, int lines)
+{
+    for (auto node = rowsSpannedStart(row); node; node = node->nextSibling())
+    {
+        if (node->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+            continue;
+
+        auto cell = static_cast<Poco::XML::Element*>(node);
+        if (cell->hasAttribute("table:number-rows-spanned"))
+            cell->setAttribute("table:number-rows-spanned", std::to_string(lines + 1));
+    }
+}
+
+/// 產生第二列以後使用的樣板列
+Poco::AutoPtr<Poco::XML::Node> Parser::initGroupRow(Poco::XML::Node* row)
+{
+    // Text & SC 的變數 xml tag 有所不同
+    const std::string VAR_TAG = isText() ? "text:placeholder" : "text:a";
+
+    /* 初始化「樣板列」的過程 Text & SC 的 xml 結構有所差異
+    */
+
+    Poco::AutoPtr<Poco::XML::Node> initRow;
+    if(isSpreadSheet())
+    {
+        // 初始化樣板列:
+        // 1.移除非變數的欄位之內含儲存格內容以及儲存格之特性
+        // 2.移除統計變數 (只去除第一行以後的)
+        initRow = row->cloneNode(true);
+        auto child = static_cast<Poco::XML::Element*>(initRow->firstChild());//table:table-cell
+        while(child)
+        {
+            if(!findElement(child, "text:a"))
+            {
+                if (findElement(child, "text:p"))
                 {
-                    // If there are different office:annotation name, only take the first grpname as target
-                    std::string grpname = grpNodeList->item(0)->lastChild()->innerText();
-                    //Ensure put attr grpname in the table:table-row not in table:table-row-group!
-                    Parent_2 = static_cast<Poco::XML::Element*> (Parent_2->firstChild());
-                    while(true)
+                    auto target = static_cast<Poco::XML::Element*>(child->firstChild());
+                    while(target)
                     {
-                        if (Parent_2->nodeName()=="table:table-row")
-                            break;
-                        Parent_2 = static_cast<Poco::XML::Element*> (Parent_2->firstChild());
+                        if(target->nodeName()=="text:p")
+                        {
+                            child->removeChild(target);
+                        }
+
+                        target = static_cast<Poco::XML::Element*>(target->nextSibling());
                     }
-                    Parent_2->setAttribute("grpname", grpname);
-                    auto checkDuplicate = std::find(groupVar.begin(), groupVar.end(), Parent_2);
-                    if (checkDuplicate == groupVar.end())
-                        groupVar.push_back(Parent_2);
-                }
 
+                }
+                // 清除 table:table-cell 的 attribute
+                child->removeAttribute("office:value");
+                child->removeAttribute("office:value-type");
+                child->removeAttribute("calcext:value-type");
+                child->removeAttribute("table:formula");
             }
+            else
+            {
+                // 移除統計變數
+                // 前端設計工具限定一個儲存格只有一個變數
+                Poco::XML::Element* target = findElement(child, "text:a");
+                if (varDescriptor(target)->type == VarType::STATISTIC)
+                {
+                    child->removeChild(target->parentNode());
+                    child->removeAttribute("office:value");
+                    child->removeAttribute("office:value-type");
+                    child->removeAttribute("calcext:value-type");
+                }
+            }
+            child = static_cast<Poco::XML::Element*>(child->nextSibling());
         }
-
-        // 刪掉 grp tag
-        auto grpNodeList = docXML->getElementsByTagName("office:annotation");
-        int grpLen = grpNodeList->length();
-        for(auto tmp_grp_len = 0; tmp_grp_len < grpLen; tmp_grp_len++)
-        {
-            auto grpNode = grpNodeList->item(0);
-            grpNode->parentNode()->removeChild(grpNode);
-        }
-        grpNodeList = docXML->getElementsByTagName("office:annotation-end");
-        grpLen = grpNodeList->length();
-        for(auto tmp_grp_len = 0; tmp_grp_len < grpLen; tmp_grp_len++)
+    }
+    else if (isText())
+    {
+        // 初始化整列: 主要是去除非編號(1.\n 2. ...etc)的欄位之數值
+        initRow = row->cloneNode(true);
+        auto child = static_cast<Poco::XML::Element*>(initRow->firstChild());
+        while(child)
         {
-            auto grpNode = grpNodeList->item(0);
-            grpNode->parentNode()->removeChild(grpNode);
+            if(!findElement(child, VAR_TAG))
+            {
+                if (!findElement(child, "text:list"))
+                    if(child->hasChildNodes())
+                        child->removeChild(findElement(child, "text:p"));
+            }
+
+            child = static_cast<Poco::XML::Element*>(child->nextSibling());
         }
     }
+    return initRow;
+}
 
-    result.push_back(singleVar);
-    result.push_back(groupVar);
-    return result;
+/// 建立群組列原型: 記下列中每個變數的位置、JSON 名稱及描述
+Parser::RowPrototype Parser::makeRowPrototype(Poco::XML::Node* row)
+{
+    // Text & SC 的變數 xml tag 有所不同
+    const std::string VAR_TAG = isText() ? "text:placeholder" : "text:a";
+
+    RowPrototype prototype;
+    prototype.skeleton = Poco::AutoPtr<Poco::XML::Node>(row, true);
+    std::vector<Poco::XML::Element*> vars;
+    findElements(row, VAR_TAG, vars);
+    for (auto elm : vars)
+    {
+        RowSlot slot;
+        slot.path = nodePath(elm, row);
+        slot.name = elm->innerText();
+        slot.key = varJsonKey(elm);
+        slot.descriptor = varDescriptor(elm);
+        prototype.slots.push_back(slot);
+    }
+    return prototype;
 }
 
 // Insert value into group Variable
 void Parser::setGroupVar(Poco::JSON::Object::Ptr jsonData, std::list<Poco::XML::Element*> &groupVar)
 {
-    // Text & SC 的變數 xml tag 有所不同
-    std::string VAR_TAG;
-    if(isText())
-        VAR_TAG = "text:placeholder";
-    else if(isSpreadSheet())
-        VAR_TAG = "text:a";
-
     for (auto it = groupVar.begin(); it!=groupVar.end(); it++)
     {
         Poco::XML::Element* row = *it;
@@ -946,7 +1338,7 @@ void Parser::setGroupVar(Poco::JSON::Object::Ptr jsonData, std::list<Poco::XML::
         Poco::XML::Node* realBaseRow = currentRow;
         Poco::XML::Node *nextRow;
         Poco::XML::Node *rootTable;
-        Poco::XML::Node* pTbRow ;
+        Poco::AutoPtr<Poco::XML::Node> pTbRow;
 
         // 針對 Array 的存取目前我們只能作到透過 Var 先判定一次資料是否存在，然後在轉成 Array，如果直接針對 Array 取值會導致無法判斷是否為空的 Array
         Poco::JSON::Array::Ptr arr;
@@ -972,147 +1364,46 @@ void Parser::setGroupVar(Poco::JSON::Object::Ptr jsonData, std::list<Poco::XML::
             continue;
         }
 
-        /* 初始化「樣板列」的過程 Text & SC 的 xml 結構有所差異
-        */
-
-        Poco::XML::Node* initRow = nullptr;
-        if(isSpreadSheet())
-        {
-            // 初始化樣板列:
-            // 1.移除非變數的欄位之內含儲存格內容以及儲存格之特性
-            // 2.移除統計變數 (只去除第一行以後的)
-            initRow = realBaseRow->cloneNode(true);
-            auto child = static_cast<Poco::XML::Element*>(initRow->firstChild());//table:table-cell
-            while(child)
-            {
-                if(child->getElementsByTagName("text:a")->length()==0)
-                {
-                    if (child->getElementsByTagName("text:p")->length()!=0)
-                    {
-                        auto target = static_cast<Poco::XML::Element*>(child->firstChild());
-                        while(target)
-                        {
-                            if(target->nodeName()=="text:p")
-                            {
-                                child->removeChild(target);
-                            }
-
-                            target = static_cast<Poco::XML::Element*>(target->nextSibling());
-                        }
-
-                    }
-                    // 清除 table:table-cell 的 attribute
-                    child->removeAttribute("office:value");
-                    child->removeAttribute("office:value-type");
-                    child->removeAttribute("calcext:value-type");
-                    child->removeAttribute("table:formula");
-                }
-                else
-                {
-                    // 移除統計變數
-                    // 前端設計工具限定一個儲存格只有一個變數
-                    auto variableList = child->getElementsByTagName("text:a");
-                    Poco::XML::Element* target = static_cast<Poco::XML::Element*> (variableList->item(0));
-                    auto vardata =  target->getAttribute("office:target-frame-name");
-                    auto type = varKeyValue(vardata, "type");
-                    if(type == "statistic")
-                    {
-                        child->removeChild(target->parentNode());
-                        child->removeAttribute("office:value");
-                        child->removeAttribute("office:value-type");
-                        child->removeAttribute("calcext:value-type");
-                    }
-                }
-                child = static_cast<Poco::XML::Element*>(child->nextSibling());
-            }
-            // 擴增跨列的行數
-            Poco::XML::Node* targetNode = realBaseRow;
-            while(targetNode->nodeName() != "table:table-row-group")
-                targetNode = targetNode->parentNode();
-
-            Poco::XML::Element* spanRow;
-            if(targetNode->previousSibling()!=NULL)
-                spanRow = static_cast<Poco::XML::Element*> (targetNode->previousSibling()->firstChild());
-            else
-                spanRow = static_cast<Poco::XML::Element*> (targetNode);
-
-            while(spanRow)
-            {
-                if (spanRow->hasAttribute("table:number-rows-spanned"))
-                    spanRow->setAttribute("table:number-rows-spanned", std::to_string(lines+1));
-                spanRow = static_cast<Poco::XML::Element*> (spanRow->nextSibling());
-            }
-        }
-        else if (isText())
-        {
-            // 初始化整列: 主要是去除非編號(1.\n 2. ...etc)的欄位之數值
-            initRow = realBaseRow->cloneNode(true);
-            auto child = static_cast<Poco::XML::Element*>(initRow->firstChild());
-            while(child)
-            {
-                if(child->getElementsByTagName(VAR_TAG)->length()==0)
-                {
-                    if (child->getElementsByTagName("text:list")->length()==0)
-                        if(child->childNodes()->length()!=0)
-                            child->removeChild(child->getElementsByTagName("text:p")->item(0));
-                }
+        // 第一列保留原格式，第二列以後用初始化過的樣板列；變數位置只找一次
+        const RowPrototype firstRow = makeRowPrototype(realBaseRow);
+        const RowPrototype otherRows = makeRowPrototype(initGroupRow(realBaseRow));
+        std::vector<Poco::XML::Element*> slots(otherRows.slots.size());
 
-                child = static_cast<Poco::XML::Element*>(child->nextSibling());
-            }
-            // 擴增跨列的行數
-            auto spanRow = static_cast<Poco::XML::Element*> (realBaseRow->previousSibling()->firstChild());
-            while(spanRow)
-            {
-                if (spanRow->hasAttribute("table:number-rows-spanned"))
-                    spanRow->setAttribute("table:number-rows-spanned", std::to_string(lines+1));
-                spanRow = static_cast<Poco::XML::Element*> (spanRow->nextSibling());
-            }
-        }
+        // 擴增跨列的行數(串流輸出時，樣板列之前的列已輸出，改在輸出前就更新)
+        if (mRenderMode == RenderMode::DOM)
+            updateRowsSpanned(realBaseRow, lines);
 
         /// 列群組：add rows, then set form var data
         for (int times = 0; times < lines; times ++)
         {
-            if (times==0)
-                //保留第一行的格式不變
-                pTbRow = realBaseRow->cloneNode(true);
-            else
-                pTbRow = initRow->cloneNode(true);
+            const RowPrototype& prototype = times == 0 ? firstRow : otherRows;
+            pTbRow = prototype.skeleton->cloneNode(true);
             // insert new row to the table
             nextRow = currentRow->nextSibling();
             rootTable = currentRow->parentNode();
             rootTable->insertBefore(pTbRow, nextRow);
-            currentRow = pTbRow;
+            currentRow = pTbRow.get();
 
-            /// put var values into group
-            auto rowChildVar = (static_cast<Poco::XML::Element*>(pTbRow))->getElementsByTagName(VAR_TAG);
-            int childLen = rowChildVar->length();
-            std::list<Poco::XML::Element*> varList;
-            for (int i=0; i<childLen; i++)
-            {
-                varList.push_back(static_cast<Poco::XML::Element*> (rowChildVar->item(i)));
-            }
+            // 先依位置找出所有變數再填值，填值時移除節點才不會影響其他變數的位置
+            slots.resize(prototype.slots.size());
+            for (std::size_t i = 0; i < prototype.slots.size(); i++)
+                slots[i] = static_cast<Poco::XML::Element*>(resolvePath(pTbRow, prototype.slots[i].path));
 
+            /// put var values into group
             auto arrData = arr->getObject(times);
             if(times==0)
             {
-                for(auto each=varList.begin(); each!=varList.end(); each++)
+                for (const auto& slot : prototype.slots)
                 {
-                    std::string eachName = (*each)->innerText();
-
-                    Poco::Dynamic::Var value;
-                    if (isText())
-                        value = jsonData->get(eachName.substr(1, eachName.size()-2));
-                    else if(isSpreadSheet())
-                        value = jsonData->get(eachName);
-
+                    Poco::Dynamic::Var value = jsonData->get(slot.key);
                     if (!value.isEmpty())
                     {
-                        arrData->set(eachName, value);
+                        arrData->set(slot.name, value);
                     }
                 }
             }
-            setSingleVar(arr->getObject(times), varList);
-
+            for (std::size_t i = 0; i < slots.size(); i++)
+                setVar(arrData, slots[i], prototype.slots[i].key, *prototype.slots[i].descriptor);
         }
         // Remove template Row
         row->parentNode()->removeChild(row);
@@ -1127,263 +1418,198 @@ void Parser::setSingleVar(Poco::JSON::Object::Ptr jsonData, std::list<Poco::XML:
      *  singleVar 跟 jsonData 來源類似
      */
 
-    //初始化 Text & SC 的 Tag 區別
-    //  1. 只有 tag 內含的 property 需要區分
-    std::string Var_Tag_Property;
-    if(isText())
-        Var_Tag_Property = "text:description";
-    else if(isSpreadSheet())
-        Var_Tag_Property = "office:target-frame-name";
-
     for (auto it = singleVar.begin(); it!=singleVar.end(); it++)
     {
         Poco::XML::Element* elm = *it;
-        auto vardata = elm->getAttribute(Var_Tag_Property);
-        std::string type = varKeyValue(vardata, "type");
+        // 變數描述在編譯範本時已解析
+        setVar(jsonData, elm, varJsonKey(elm), *varDescriptor(elm));
+    }
+}
 
-        // 模板變數的類型需要針對 file 特別處理，因為 file 需要把檔案寫在 extract 的資料夾內部
-        if (type != "file" and type != "statistic")
-        {
-            std::string key = elm->innerText();
-            Poco::Dynamic::Var value;
-            if (isText())
-                value = jsonData->get(key.substr(1,key.size()-2));
-            else if(isSpreadSheet())
-                value = jsonData->get(key);
-
-            if (value.isEmpty())
-            {
-                elm->parentNode()->removeChild(elm);
-                continue;
-            }
+/// 變數在 JSON 中的名稱: Writer 要去掉前後的 <>
+std::string Parser::varJsonKey(const Poco::XML::Element* elm)
+{
+    std::string key = elm->innerText();
+    if (isText())
+        key = key.substr(1, key.size()-2);
+    return key;
+}
 
-            // 根據 json 拿到的 value 作數值轉換 (boolean, list)
-            auto enumvar = varKeyValue(vardata, "Items");
-            auto format = varKeyValue(vardata, "Format");
-            value = parseEnumValue(type, enumvar, value.toString());
+/// 登錄一張輸出的圖片，同一份內容只登錄一次，傳回 Pictures/ 之下的序號
+unsigned Parser::addPicture(const PicturePtr& picture)
+{
+    const auto found = mPictureSerials.find(picture.get());
+    if (found != mPictureSerials.end())
+        return found->second;
+
+    const unsigned serial = mPictures.size();
+    mPictures.push_back(picture);
+    mPictureSerials.emplace(picture.get(), serial);
+    return serial;
+}
 
+/// 填入一個變數的值
+void Parser::setVar(const Poco::JSON::Object::Ptr& jsonData, Poco::XML::Element* elm,
+                    const std::string& key, const VarDescriptor& desc)
+{
+    std::string type = desc.typeName;
 
-            // 依照不同型別進行個別處理
-            if (type == "auto" && isNumber(value) && isSpreadSheet())
-            {
-                auto meta = static_cast<Poco::XML::Element*>(elm->parentNode()->parentNode());
-                auto pVal = docXML->createTextNode(value);
-                elm->parentNode()->replaceChild(pVal, elm);
-                type = "float";
-                meta->setAttribute("office:value", value);
-                meta->setAttribute("office:value-type", type);
-                meta->setAttribute("calcext:value-type", type);
-            }
-            else if ( (type == "float" || type == "percentage" ||
-                    type == "currency" || type == "date" ||
-                    type == "time" )
-                    && isSpreadSheet())
-            {
+    // 模板變數的類型需要針對 file 特別處理，因為 file 需要把檔案寫在 extract 的資料夾內部
+    if (desc.type != VarType::FILE && desc.type != VarType::STATISTIC)
+    {
+        Poco::Dynamic::Var value = jsonData->get(key);
 
-                auto meta = static_cast<Poco::XML::Element*>(elm->parentNode()->parentNode());
-                auto pVal = docXML->createTextNode(value);
-                elm->parentNode()->replaceChild(pVal, elm);
-                meta->setAttribute("office:value-type", type);
-                meta->setAttribute("calcext:value-type", type);
-                auto officeValue = "office:" + format;
-                meta->setAttribute(officeValue, value);
-            }
-            else {
-                // Writer 一定跑到這裡來
-                auto pVal = docXML->createTextNode(value);
-                elm->parentNode()->replaceChild(pVal, elm);
-            }
-        }
-        else if (type == "statistic")
+        if (value.isEmpty())
         {
-            std::string grpname = varKeyValue(vardata, "groupname");
-            std::string column = varKeyValue(vardata, "column");
-            std::string method = varKeyValue(vardata, "method");
-            std::string targetVariable = varKeyValue(vardata, "Items");
-
-            Poco::StringTokenizer tokens(column, ".", TOKENOPTS);
-            std::string cell = tokens[1];
-            Poco::StringTokenizer addr(cell, "$", TOKENOPTS);
-            // addr[0] 是 欄位代號 :ex A
-            // addr[1] 是 列位編號 :ex 1
-            std::string cellAddr = addr[0] + addr[1];
-            column = addr[0];
-
-            Poco::JSON::Array::Ptr arr;
-            int lines;
-            if (jsonData->has(grpname))
-            {
-                Poco::Dynamic::Var tmpData = jsonData->get(grpname);
-                if(tmpData.isArray())
-                {
-                    arr = tmpData.extract<Poco::JSON::Array::Ptr>();
-                    lines = arr->size();
-                }
-                else
-                {
-                    elm->parentNode()->removeChild(elm);
-                    continue;
-                }
-            }
-            else
-            {
-                elm->parentNode()->removeChild(elm);
-                continue;
-            }
-            auto newElm = docXML->createElement("table:table-cell");
-            if (method == "總和")
-                method = "SUM";
-            if (method == "最大值")
-                method = "MAX";
-            if (method == "最小值")
-                method = "MIN";
-            if (method == "中位數")
-                method = "MEDIAN";
-            if (method == "計數")
-                method = "COUNT";
-            if (method == "平均")
-                method = "AVERAGE";
-            std::string formula = "of:="+ method +"([."+cellAddr+":."+column+std::to_string(std::stoi(addr[1])+lines-1)+"])";
-            newElm->setAttribute("table:formula", formula);
-            newElm->setAttribute("office:value-type", "float");
-            newElm->setAttribute("calcext:value-type", "float");
-            auto pCell = elm->parentNode()->parentNode();
-            pCell->parentNode()->replaceChild(newElm, pCell);
+            elm->parentNode()->removeChild(elm);
+            return;
         }
-        else if (type == "file")
-        {
-            //Write file into extract directory
-            std::string varname = elm->innerText();
-            Poco::Dynamic::Var value;
-            if (isText())
-            {
-                varname = varname.substr(1, varname.size()-2);
-                value = jsonData->get(varname);
-            }
-            else if(isSpreadSheet())
-                value = jsonData->get(varname);
 
-            if (value.isEmpty())
-            {
-                elm->parentNode()->removeChild(elm);
-                continue;
-            }
+        // 根據 json 拿到的 value 作數值轉換 (boolean, list)
+        value = desc.translate(value.toString());
 
-            auto enumvar = varKeyValue(vardata, "Items");
-            value = parseEnumValue(type, enumvar, value);
 
+        // 依照不同型別進行個別處理
+        if (desc.type == VarType::AUTO && isNumber(value) && isSpreadSheet())
+        {
+            auto meta = static_cast<Poco::XML::Element*>(elm->parentNode()->parentNode());
+            Poco::AutoPtr<Poco::XML::Text> pVal = docXML->createTextNode(value);
+            elm->parentNode()->replaceChild(pVal, elm);
+            type = "float";
+            meta->setAttribute("office:value", value);
+            meta->setAttribute("office:value-type", type);
+            meta->setAttribute("calcext:value-type", type);
+        }
+        else if ( (desc.type == VarType::FLOAT || desc.type == VarType::PERCENTAGE ||
+                desc.type == VarType::CURRENCY || desc.type == VarType::DATE ||
+                desc.type == VarType::TIME )
+                && isSpreadSheet())
+        {
 
-            auto tempPath = Poco::Path::forDirectory(Poco::TemporaryFile::tempName() + "/");
-            Poco::File(tempPath).createDirectories();
-            const Poco::Path filenameParam(varname);
-            tempPath.setFileName(filenameParam.getFileName());
-            auto _filename = tempPath.toString();
+            auto meta = static_cast<Poco::XML::Element*>(elm->parentNode()->parentNode());
+            Poco::AutoPtr<Poco::XML::Text> pVal = docXML->createTextNode(value);
+            elm->parentNode()->replaceChild(pVal, elm);
+            meta->setAttribute("office:value-type", type);
+            meta->setAttribute("calcext:value-type", type);
+            auto officeValue = "office:" + desc.format;
+            meta->setAttribute(officeValue, value);
+        }
+        else {
+            // Writer 一定跑到這裡來
+            Poco::AutoPtr<Poco::XML::Text> pVal = docXML->createTextNode(value);
+            elm->parentNode()->replaceChild(pVal, elm);
+        }
+    }
+    else if (desc.type == VarType::STATISTIC)
+    {
+        const std::string& grpname = desc.groupname;
 
-            try
+        Poco::JSON::Array::Ptr arr;
+        int lines;
+        if (!desc.column.empty() && jsonData->has(grpname))
+        {
+            Poco::Dynamic::Var tmpData = jsonData->get(grpname);
+            if(tmpData.isArray())
             {
-                // Write b64encode data to image
-                std::stringstream ss;
-                ss << value.toString();
-                Poco::Base64Decoder b64in(ss);
-                std::ofstream ofs(_filename);
-                std::copy(std::istreambuf_iterator<char>(b64in),
-                        std::istreambuf_iterator<char>(),
-                        std::ostreambuf_iterator<char>(ofs));
+                arr = tmpData.extract<Poco::JSON::Array::Ptr>();
+                lines = arr->size();
             }
-            catch (Poco::Exception& e)
+            else
             {
-                std::cerr << e.displayText() << std::endl;
+                elm->parentNode()->removeChild(elm);
+                return;
             }
+        }
+        else
+        {
+            elm->parentNode()->removeChild(elm);
+            return;
+        }
+        Poco::AutoPtr<Poco::XML::Element> newElm = docXML->createElement("table:table-cell");
+        // 統計範圍: 起始儲存格到群組最後一列
+        const std::string cellAddr = desc.column + std::to_string(desc.row);
+        std::string formula = "of:="+ desc.method +"([."+cellAddr+":."+desc.column+std::to_string(desc.row+lines-1)+"])";
+        newElm->setAttribute("table:formula", formula);
+        newElm->setAttribute("office:value-type", "float");
+        newElm->setAttribute("calcext:value-type", "float");
+        auto pCell = elm->parentNode()->parentNode();
+        pCell->parentNode()->replaceChild(newElm, pCell);
+    }
+    else if (desc.type == VarType::FILE)
+    {
+        Poco::Dynamic::Var value = jsonData->get(key);
 
+        if (value.isEmpty())
+        {
+            elm->parentNode()->removeChild(elm);
+            return;
+        }
 
-            // Write file info to Xml tag
-            updatePic2MetaXml();
-
-            if (isText())
-            {
-                auto desc = elm->getAttribute(Var_Tag_Property);
-
-                // image size
-                auto imageSize = varKeyValue(desc, "Size");
-                std::string width = "2.5cm", height = "1.5cm";
-                if (!imageSize.empty())
-                {
-                    Poco::StringTokenizer token(imageSize, "x", TOKENOPTS);
-                    width = token[0] + "cm";
-                    height = token[1] + "cm";
-                }
+        // 讀取 JSON 時已解碼的圖片直接使用，否則由 base64 字串解碼(相同內容只解碼一次)
+        PicturePtr picture;
+        if (value.type() == typeid(PicturePtr))
+            picture = value.extract<PicturePtr>();
+        else
+            picture = mDecoder.add(desc.translate(value.toString()));
+        const unsigned picserial = addPicture(picture);
 
-                auto pElm = docXML->createElement("draw:frame");
-                pElm->setAttribute("draw:style-name", "fr1");
-                pElm->setAttribute("draw:name", "Image1");
-                pElm->setAttribute("text:anchor-type", "as-char");
-                pElm->setAttribute("svg:width", width);
-                pElm->setAttribute("svg:height", height);
-                pElm->setAttribute("draw:z-index", "1");
-
-                auto pChildElm = docXML->createElement("draw:image");
-                pChildElm->setAttribute("xlink:href",
-                        "Pictures/" + std::to_string(picserial));
-                pChildElm->setAttribute("xlink:type", "simple");
-                pChildElm->setAttribute("xlink:show", "embed");
-                pChildElm->setAttribute("xlink:actuate", "onLoad");
-                pChildElm->setAttribute("loext:mime-type", "image/png");
-                pElm->appendChild(pChildElm);
-
-                auto node = elm->parentNode();
-                node->replaceChild(pElm, elm);
-
-                const auto picdir = extra2 + "/Pictures";
-                Poco::File(picdir).createDirectory();
-                const auto picfilepath = picdir + "/" +
-                    std::to_string(picserial);
-                Poco::File(_filename).copyTo(picfilepath);
-                picserial ++;
-            }
-            else if (isSpreadSheet())
-            {
-                auto desc = elm->getAttribute(Var_Tag_Property);
+        // 圖片在 zipback() 時才一次登錄到 manifest.xml
+        if (isText())
+        {
+            // image size
+            const std::string& width = desc.imageWidth;
+            const std::string& height = desc.imageHeight;
+
+            Poco::AutoPtr<Poco::XML::Element> pElm = docXML->createElement("draw:frame");
+            pElm->setAttribute("draw:style-name", "fr1");
+            pElm->setAttribute("draw:name", "Image1");
+            pElm->setAttribute("text:anchor-type", "as-char");
+            pElm->setAttribute("svg:width", width);
+            pElm->setAttribute("svg:height", height);
+            pElm->setAttribute("draw:z-index", "1");
+
+            Poco::AutoPtr<Poco::XML::Element> pChildElm = docXML->createElement("draw:image");
+            pChildElm->setAttribute("xlink:href",
+                    "Pictures/" + std::to_string(picserial));
+            pChildElm->setAttribute("xlink:type", "simple");
+            pChildElm->setAttribute("xlink:show", "embed");
+            pChildElm->setAttribute("xlink:actuate", "onLoad");
+            pChildElm->setAttribute("loext:mime-type", "image/png");
+            pElm->appendChild(pChildElm);
+
+            auto node = elm->parentNode();
+            node->replaceChild(pElm, elm);
 
-                // image size
-                auto imageSize = varKeyValue(desc, "Size");
-                std::string width = "2.5cm", height = "1.5cm";
-                if (!imageSize.empty())
-                {
-                    Poco::StringTokenizer token(imageSize, "x", TOKENOPTS);
-                    width = token[0] + "cm";
-                    height = token[1] + "cm";
-                }
+        }
+        else if (isSpreadSheet())
+        {
+            // image size
+            const std::string& width = desc.imageWidth;
+            const std::string& height = desc.imageHeight;
+
+            Poco::AutoPtr<Poco::XML::Element> pElm = docXML->createElement("draw:frame");
+            pElm->setAttribute("draw:style-name", "gr1");
+            pElm->setAttribute("draw:name", "Image1");
+            pElm->setAttribute("svg:width", width);
+            pElm->setAttribute("svg:height", height);
+            pElm->setAttribute("draw:z-index", "1");
+
+            Poco::AutoPtr<Poco::XML::Element> pChildElm = docXML->createElement("draw:image");
+            pChildElm->setAttribute("xlink:href", "Pictures/" + std::to_string(picserial));
+            pChildElm->setAttribute("xlink:type", "simple");
+            pChildElm->setAttribute("xlink:show", "embed");
+            pChildElm->setAttribute("xlink:actuate", "onLoad");
+            pChildElm->setAttribute("loext:mime-type", "image/png");
+            pElm->appendChild(pChildElm);
+
+            // 直接替換掉整個儲存格，避免遺留不必要的特性
+            Poco::AutoPtr<Poco::XML::Element> newCell = docXML->createElement("table:table-cell");
+            auto oldCell = elm->parentNode()->parentNode();
+            auto node = elm->parentNode()->parentNode()->parentNode();
+
+            newCell->appendChild(pElm);
+            node->replaceChild(newCell, oldCell);
 
-                auto pElm = docXML->createElement("draw:frame");
-                pElm->setAttribute("draw:style-name", "gr1");
-                pElm->setAttribute("draw:name", "Image1");
-                pElm->setAttribute("svg:width", width);
-                pElm->setAttribute("svg:height", height);
-                pElm->setAttribute("draw:z-index", "1");
-
-                auto pChildElm = docXML->createElement("draw:image");
-                pChildElm->setAttribute("xlink:href", "Pictures/" + std::to_string(picserial));
-                pChildElm->setAttribute("xlink:type", "simple");
-                pChildElm->setAttribute("xlink:show", "embed");
-                pChildElm->setAttribute("xlink:actuate", "onLoad");
-                pChildElm->setAttribute("loext:mime-type", "image/png");
-                pElm->appendChild(pChildElm);
-
-                // 直接替換掉整個儲存格，避免遺留不必要的特性
-                auto newCell = docXML->createElement("table:table-cell");
-                auto oldCell = elm->parentNode()->parentNode();
-                auto node = elm->parentNode()->parentNode()->parentNode();
-
-                newCell->appendChild(pElm);
-                node->replaceChild(newCell, oldCell);
-
-                const auto picdir = extra2 + "/Pictures";
-                Poco::File(picdir).createDirectory();
-                const auto picfilepath = picdir + "/" +
-                    std::to_string(picserial);
-                Poco::File(_filename).copyTo(picfilepath);
-                picserial ++;
-            }
         }
     }
 }
@@ -7,14 +7,28 @@
 
 #pragma once
 
+#include <list>
+#include <map>
+#include <ostream>
+#include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <Poco/AutoPtr.h>
+#include <Poco/File.h>
+#include <Poco/Timestamp.h>
 #include <Poco/URI.h>
 #include <Poco/JSON/Object.h>
 #include <Poco/StringTokenizer.h>
 #include <Poco/DOM/Element.h>
 
+#include "MergeODFJson.h"
+#include "MergeODFZip.h"
+
+class SegmentedTemplate;
+
 #define TOKENOPTS (Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM)
 
 enum DocType
@@ -24,56 +38,212 @@ enum DocType
     SPREADSHEET
 };
 
+/// 節點位置: 自 document element 起，每一層的子節點序號
+typedef std::vector<unsigned> NodePath;
+
+/// 變數型別
+enum class VarType
+{
+    STRING,
+    FILE, // image
+    ENUM,
+    AUTO,
+    BOOLEAN,
+    FLOAT,
+    PERCENTAGE,
+    CURRENCY,
+    DATE,
+    TIME,
+    STATISTIC
+};
+
+/// 解析後的變數描述(text:description 或 office:target-frame-name)，每種描述只解析一次
+struct VarDescriptor
+{
+    VarType type = VarType::STRING;
+    std::string typeName; // API 文件用的型別名稱(image 爲 file，無法辨識的爲 string)，沒有指定 Type 時爲空字串
+    std::vector<std::string> items; // enum、boolean 的選項(已去掉引號並切開)
+    std::string format; // Format
+    std::string description; // Description
+    std::string apiHelp; // ApiHelp
+    std::string imageWidth = "2.5cm"; // Size
+    std::string imageHeight = "1.5cm";
+
+    // 統計變數
+    std::string groupname;
+    std::string method; // SUM、MAX ... 等試算表函數名稱
+    std::string column; // 統計欄位代號，格式不正確時爲空字串
+    int row = 0; // 統計範圍起始列號
+
+    /// @brief 解析描述字串
+    static VarDescriptor parse(const std::string& description);
+
+    /// @brief 將 enum 序號、boolean 值轉換爲選項文字，其他型別原樣傳回
+    std::string translate(const std::string& value) const;
+};
+
+typedef std::unordered_map<std::string, std::shared_ptr<const VarDescriptor>> VarDescriptorMap;
+
+/// API 文件中的一個變數
+struct SchemaField
+{
+    std::string name;
+    std::shared_ptr<const VarDescriptor> descriptor;
+};
+
+/// API 文件中的一個群組
+struct SchemaGroup
+{
+    std::string name;
+    std::vector<SchemaField> fields;
+};
+
+/// 範本的變數清單(同名只列一次)，API、YAML、JSON 說明都由此產生
+struct TemplateSchema
+{
+    std::vector<SchemaField> singles;
+    std::vector<SchemaGroup> groups;
+};
+
+/// 範本編譯結果：同一版本的範本在多次請求間共用，編譯完成後即不再變動
+struct TemplatePlan
+{
+    std::string templateFile;
+    Poco::Timestamp lastModified; // 編譯時範本檔的修改時間
+    Poco::File::FileSize size = 0; // 編譯時範本檔的大小
+
+    DocType doctype = DocType::OTHER;
+    std::string archive; // 範本檔原始內容
+    std::vector<ZipEntry> entries; // 範本檔內的項目，輸出時未變動的項目直接複製
+    std::string manifest; // 原始 META-INF/manifest.xml
+    std::string mimetype; // 原始 mimetype
+    Poco::AutoPtr<Poco::XML::Document> contentXml; // 已前處理(移除群組註解)的 content.xml
+    std::vector<NodePath> singleVarPaths; // 單一變數位置
+    std::vector<NodePath> groupVarPaths; // 群組樣板列位置
+
+    // 串流輸出用，以元素序號(文件順序，不含群組註解)標示
+    std::string contentSource; // 原始 content.xml
+    std::set<unsigned> singleVarOrdinals; // 單一變數
+    std::map<unsigned, std::string> groupRowOrdinals; // 群組樣板列及其 grpname
+    std::set<unsigned> bufferRootOrdinals; // 需先組成 DOM 片段再填值的範圍
+    std::map<unsigned, std::vector<std::string>> rowsSpannedOrdinals; // 跨列數需依群組更新的儲存格
+
+    VarDescriptorMap descriptors; // 範本中所有變數的描述(key: 描述字串)
+    TemplateSchema schema; // API 文件用的變數清單
+    JsonBinding binding; // 讀取請求 JSON 時用到的鍵值
+
+    // 簡單的 Writer 範本(無圖片、統計變數)預先切段，輸出時只需串接，不可切段時為空
+    std::shared_ptr<const SegmentedTemplate> segments;
+
+    /// @brief 範本檔是否仍是編譯時的版本
+    bool isCurrent() const;
+};
+
 class Parser
 {
+    friend class StreamRenderer;
+    friend class SegmentedTemplate;
+
 public:
     Parser();
-    ~Parser();
 
     std::string getMimeType();
     void extract(const std::string& templateFile);
+    void extract(const std::string& archive, const std::vector<ZipEntry>& entries);
 
-    std::string jsonVars();
-    std::string jjsonVars();
-    std::string yamlVars();
+    /// @brief 掃描範本，產生可重複使用的編譯結果
+    static std::shared_ptr<TemplatePlan> compile(const std::string& templateFile);
+    /// @brief 以編譯結果準備本次輸出，傳回值同 scanVarPtr()
+    std::vector<std::list<Poco::XML::Element*>> load(const std::shared_ptr<const TemplatePlan>& plan);
+    /// @brief 只取用範本的項目，不建立 content.xml 的 DOM(供串流輸出使用)
+    void attach(const std::shared_ptr<const TemplatePlan>& plan);
+    /// @brief 以串流方式產生 content.xml(在 zipback() 時進行)
+    void renderStreaming(Poco::JSON::Object::Ptr jsonData);
+    /// @brief 以預先切段的範本串接出 content.xml(在 zipback() 時進行，plan->segments 不可為空)
+    void renderSegmented(Poco::JSON::Object::Ptr jsonData);
+    /// @brief 每筆資料以範本產生一次，合併成一份文件(在 zipback() 時進行)
+    /// Writer 以分頁隔開，Calc 每筆資料一組工作表
+    void renderMerged(const std::vector<Poco::JSON::Object::Ptr>& records);
 
-    std::vector<std::list<Poco::XML::Element*>> scanVarPtr();
-    std::string zipback();
+    /// @brief 由變數清單產生 API 文件的 properties、JSON 範例及 YAML
+    std::string jsonVars(const TemplateSchema& schema) const;
+    std::string jjsonVars(const TemplateSchema& schema) const;
+    std::string yamlVars(const TemplateSchema& schema) const;
 
-    void updatePic2MetaXml();
+    std::vector<std::list<Poco::XML::Element*>> scanVarPtr();
+    /// @brief 將結果以 ZIP 格式邊產生邊寫出
+    void zipback(std::ostream& out);
 
-    void setOutputFlags(bool, bool);
-    std::string varKeyValue(std::string, std::string);
+    /// @brief 取得變數的描述，先找範本編譯結果，沒有才解析
+    const std::shared_ptr<const VarDescriptor>& varDescriptor(const Poco::XML::Element* elm);
     void setSingleVar(Poco::JSON::Object::Ptr, std::list<Poco::XML::Element*>&);
     void setGroupVar(Poco::JSON::Object::Ptr, std::list<Poco::XML::Element*>&);
-    std::string jsonvars; // json 說明 - openapi
-    std::string jjsonvars; // json 範例
-    std::string yamlvars; // yaml
 private:
     DocType doctype;
-    unsigned picserial;
+    std::shared_ptr<const TemplatePlan> mPlan;
+    enum class RenderMode
+    {
+        DOM, // 整份 content.xml 的 DOM 已填好值
+        STREAMING, // 寫出時以 StreamRenderer 產生
+        SEGMENTED, // 寫出時以預先切段的範本串接
+        MERGED // 寫出時每筆資料產生一次再合併
+    };
+    RenderMode mRenderMode;
+    Poco::JSON::Object::Ptr mJsonData; // 串流或切段輸出用的資料
+    std::vector<Poco::JSON::Object::Ptr> mRecords; // 合併輸出用的資料，輸出後即釋放
 
-    bool outAnotherJson;
-    bool outYaml;
-
-    std::map<std::string, Poco::Path> zipfilepaths;
     Poco::AutoPtr<Poco::XML::Document> docXML;
     std::list<Poco::XML::Element*> groupAnchorsSc;
 
-    std::string extra2;
-    std::string contentXml;
-    std::string contentXmlFileName;
-    std::string metaFileName;
+    // 所有項目都留在記憶體中，不寫入暫存目錄
+    std::string contentXml; // 範本的 content.xml
+    std::string mManifest; // META-INF/manifest.xml
+    std::string mMimeType; // mimetype
+    std::vector<PicturePtr> mPictures; // 新加入的圖片，依序為 Pictures/0、Pictures/1 ...
+    std::unordered_map<const Picture*, unsigned> mPictureSerials; // 圖片內容對應的序號
+    PictureDecoder mDecoder; // 表單欄位中的 base64 圖片
+    VarDescriptorMap mDescriptors; // 不在編譯結果中的變數描述
 
     void detectDocType();
     bool isText();
     bool isSpreadSheet();
 
+    Poco::XML::Node* rowsSpannedStart(Poco::XML::Node* row);
+    void updateRowsSpanned(Poco::XML::Node* row, int lines);
+    Poco::AutoPtr<Poco::XML::Node> initGroupRow(Poco::XML::Node* row);
+
+    /// 群組列中的一個變數
+    struct RowSlot
+    {
+        NodePath path; // 相對於列的位置
+        std::string name; // 變數文字
+        std::string key; // JSON 中的名稱
+        std::shared_ptr<const VarDescriptor> descriptor;
+    };
+    /// 群組列原型: 每列只需複製骨架，再依位置直接填值
+    struct RowPrototype
+    {
+        Poco::AutoPtr<Poco::XML::Node> skeleton;
+        std::vector<RowSlot> slots;
+    };
+    RowPrototype makeRowPrototype(Poco::XML::Node* row);
+
+    std::string varJsonKey(const Poco::XML::Element* elm);
+    unsigned addPicture(const PicturePtr& picture);
+    void setVar(const Poco::JSON::Object::Ptr& jsonData, Poco::XML::Element* elm,
+                const std::string& key, const VarDescriptor& desc);
+
     std::string replaceMetaMimeType(std::string);
     void updateMetaInfo();
+    void writeContent(std::ostream& out);
+    void writeMerged(std::ostream& out);
 
-    std::string parseEnumValue(std::string, std::string, std::string);
-    std::string parseJsonVar(std::string, std::string, bool, bool);
+    TemplateSchema schema(const std::list<Poco::XML::Element*>& singleVar,
+                          const std::list<Poco::XML::Element*>& groupVar);
+    JsonBinding binding(const std::list<Poco::XML::Element*>& singleVar,
+                        const std::list<Poco::XML::Element*>& groupVar);
+    std::string parseJsonVar(const std::string& var, const VarDescriptor& desc, bool anotherJson,
+                             bool yaml) const;
 
     const std::string PARAMTEMPL = R"(
                     "%s": {
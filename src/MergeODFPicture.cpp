@@ -0,0 +1,329 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFPicture.h"
+#include "MergeODFBase64.h"
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace
+{
+/// 每筆快取除了資料以外的估計用量
+constexpr std::size_t CACHE_ENTRY_OVERHEAD = 256;
+/// 共用解碼執行緒的等待佇列上限，排不進的圖片由等待結果的執行緒解碼
+constexpr std::size_t MAX_QUEUED_DECODES = 64;
+
+/// @brief 圖片的比對 key: 去掉解碼時略過的空白，並在第一個 '=' 或不合法的字元處結束，
+///        key 相同的內容解碼結果也相同
+/// @param storage 含有空白時，去掉空白的內容存在這裡；否則 key 直接指向 data
+std::string_view pictureKey(const char* data, std::size_t size, std::string& storage)
+{
+    auto isSpace = [](char ch) { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'; };
+    auto isBase64 = [](char ch)
+    {
+        return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9')
+               || ch == '+' || ch == '/';
+    };
+
+    std::size_t end = 0;
+    while (end < size && isBase64(data[end]))
+        end++;
+    if (end == size || !isSpace(data[end]))
+        return std::string_view(data, end);
+
+    storage.assign(data, end);
+    for (std::size_t i = end; i < size; i++)
+    {
+        if (isBase64(data[i]))
+            storage += data[i];
+        else if (!isSpace(data[i]))
+            break;
+    }
+    return storage;
+}
+
+/// 全模組共用的圖片解碼執行緒，數量固定爲 CPU 核心數的一半，
+/// 同時處理的請求再多也不會增加執行緒
+class DecodePool
+{
+public:
+    static DecodePool& instance()
+    {
+        static DecodePool pool;
+        return pool;
+    }
+
+    ~DecodePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mCondition.notify_all();
+        for (auto& thread : mWorkers)
+            thread.join();
+    }
+
+    std::size_t workers() const { return mWorkers.size(); }
+
+    /// @return false: 佇列已滿
+    bool post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mStopping || mQueue.size() >= MAX_QUEUED_DECODES)
+                return false;
+            mQueue.push_back(std::move(task));
+        }
+        mCondition.notify_one();
+        return true;
+    }
+
+private:
+    DecodePool()
+        : mStopping(false)
+    {
+        const unsigned count = std::max(1U, std::thread::hardware_concurrency() / 2);
+        for (unsigned i = 0; i < count; i++)
+            mWorkers.emplace_back(&DecodePool::work, this);
+    }
+
+    void work()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]() { return mStopping || !mQueue.empty(); });
+                // 捨棄的工作沒有影響: 等待結果的執行緒會自己解碼
+                if (mStopping)
+                    return;
+                task = std::move(mQueue.front());
+                mQueue.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<std::function<void()>> mQueue;
+    std::vector<std::thread> mWorkers;
+    bool mStopping;
+};
+}
+
+PictureCache& PictureCache::instance()
+{
+    static PictureCache cache;
+    return cache;
+}
+
+PictureCache::PictureCache()
+    : mCapacity(0)
+    , mBytes(0)
+    , mHits(0)
+    , mMisses(0)
+{
+}
+
+void PictureCache::setCapacity(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCapacity = bytes;
+    evict(bytes);
+}
+
+PicturePtr PictureCache::find(std::string_view encoded)
+{
+    if (!enabled())
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = mIndex.find(encoded);
+    if (found == mIndex.end())
+    {
+        mMisses++;
+        return nullptr;
+    }
+
+    mHits++;
+    mEntries.splice(mEntries.begin(), mEntries, found->second);
+    return found->second->picture;
+}
+
+void PictureCache::insert(std::string_view encoded, const PicturePtr& picture)
+{
+    const std::size_t cost = encoded.size() + picture->data.size() + picture->compressed.size()
+                             + CACHE_ENTRY_OVERHEAD;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    const std::size_t capacity = mCapacity;
+    // 其他請求已先放入，或單張就超過容量
+    if (cost > capacity || mIndex.count(encoded))
+        return;
+
+    evict(capacity - cost);
+    mEntries.push_front({ std::string(encoded), picture, cost });
+    mIndex.emplace(mEntries.front().encoded, mEntries.begin());
+    mBytes += cost;
+}
+
+PictureCache::Statistics PictureCache::statistics() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Statistics result;
+    result.hits = mHits;
+    result.misses = mMisses;
+    result.entries = mEntries.size();
+    result.bytes = mBytes;
+    result.capacity = mCapacity;
+    return result;
+}
+
+/// 移除最久未用的項目，直到用量不超過 capacity(呼叫前須已鎖定)
+void PictureCache::evict(std::size_t capacity)
+{
+    while (mBytes > capacity && !mEntries.empty())
+    {
+        const Entry& last = mEntries.back();
+        mBytes -= last.cost;
+        mIndex.erase(last.encoded);
+        mEntries.pop_back();
+    }
+}
+
+PictureDecoder::PictureDecoder() = default;
+
+PictureDecoder::~PictureDecoder()
+{
+    // 資料可能指向請求內容，離開前一定要等背景解碼結束
+    finish();
+}
+
+PicturePtr PictureDecoder::add(const char* data, std::size_t size)
+{
+    std::string storage;
+    std::string_view key = pictureKey(data, size, storage);
+    const auto found = mDecoded.find(key);
+    if (found != mDecoded.end())
+        return found->second;
+
+    // 去掉空白的 key 須保存到解碼結束
+    if (!storage.empty())
+    {
+        mTexts.push_back(std::move(storage));
+        key = mTexts.back();
+    }
+
+    auto& decoded = mDecoded[key];
+    decoded = PictureCache::instance().find(key);
+    if (decoded)
+        return decoded;
+
+    Job job = { data, size, key, std::make_shared<Picture>(), nullptr };
+    if (size < BACKGROUND_MIN_SIZE || mBatch)
+        decode(job);
+    else
+        mJobs.push_back(job);
+    decoded = job.picture;
+    return decoded;
+}
+
+PicturePtr PictureDecoder::add(std::string&& text)
+{
+    std::string storage;
+    const auto found = mDecoded.find(pictureKey(text.data(), text.size(), storage));
+    if (found != mDecoded.end())
+        return found->second;
+
+    mTexts.push_back(std::move(text));
+    return add(mTexts.back().data(), mTexts.back().size());
+}
+
+void PictureDecoder::start()
+{
+    if (mBatch || mJobs.empty())
+        return;
+
+    mBatch = std::make_shared<Batch>();
+    mBatch->jobs = std::move(mJobs);
+    mJobs.clear();
+
+    DecodePool& pool = DecodePool::instance();
+    const std::size_t count = std::min(mBatch->jobs.size(), pool.workers());
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (!pool.post([batch = mBatch]() { work(*batch); }))
+            break;
+    }
+}
+
+void PictureDecoder::wait()
+{
+    finish();
+    if (!mBatch)
+        return;
+
+    for (const Job& job : mBatch->jobs)
+    {
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+}
+
+void PictureDecoder::finish()
+{
+    start();
+    if (!mBatch)
+        return;
+
+    work(*mBatch);
+    std::unique_lock<std::mutex> lock(mBatch->mutex);
+    mBatch->cond.wait(lock, [this]() { return mBatch->finished == mBatch->jobs.size(); });
+}
+
+void PictureDecoder::decode(const Job& job)
+{
+    decodeBase64(job.data, job.size, job.picture->data);
+
+    // 放入快取的圖片先壓縮好，之後的請求就不必再壓縮
+    PictureCache& cache = PictureCache::instance();
+    if (cache.enabled())
+    {
+        job.picture->compressed = ZipWriter::prepare(job.picture->data, true, job.picture->entry);
+        cache.insert(job.key, job.picture);
+    }
+}
+
+void PictureDecoder::work(Batch& batch)
+{
+    for (std::size_t index = batch.next++; index < batch.jobs.size(); index = batch.next++)
+    {
+        // 錯誤留給 wait() 丟出，由呼叫者記錄
+        try
+        {
+            decode(batch.jobs[index]);
+        }
+        catch (...)
+        {
+            batch.jobs[index].error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        if (++batch.finished == batch.jobs.size())
+            batch.cond.notify_all();
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,144 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <Poco/Types.h>
+
+#include "MergeODFZip.h"
+
+/// 輸出用的圖片
+struct Picture
+{
+    std::string data; // 圖片內容
+    // 快取中的圖片已壓縮好，寫出時直接使用；compressed 爲空表示寫出時才壓縮
+    ZipEntry entry;
+    std::string compressed;
+};
+
+/// 讀取請求時已取得的圖片，以此型別存在 Poco::Dynamic::Var 中
+typedef std::shared_ptr<const Picture> PicturePtr;
+
+/// 跨請求的圖片快取: 以 base64 內容爲 key，保存解碼及壓縮後的結果，超過容量時移除最久未用的
+class PictureCache
+{
+public:
+    struct Statistics
+    {
+        Poco::UInt64 hits = 0;
+        Poco::UInt64 misses = 0;
+        std::size_t entries = 0;
+        std::size_t bytes = 0;
+        std::size_t capacity = 0;
+    };
+
+    static PictureCache& instance();
+
+    /// @brief 設定容量(位元組)，0 表示不使用快取
+    void setCapacity(std::size_t bytes);
+    bool enabled() const { return mCapacity.load() > 0; }
+
+    /// @brief 找出相同 base64 內容的圖片，沒有時傳回空指標
+    PicturePtr find(std::string_view encoded);
+    /// @brief 加入已解碼及壓縮的圖片
+    void insert(std::string_view encoded, const PicturePtr& picture);
+
+    Statistics statistics() const;
+
+private:
+    PictureCache();
+
+    struct Entry
+    {
+        std::string encoded;
+        PicturePtr picture;
+        std::size_t cost;
+    };
+
+    void evict(std::size_t capacity);
+
+    mutable std::mutex mMutex;
+    std::atomic<std::size_t> mCapacity;
+    std::list<Entry> mEntries; // 最近用過的在前
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> mIndex; // key 指向 Entry::encoded
+    std::size_t mBytes;
+    Poco::UInt64 mHits;
+    Poco::UInt64 mMisses;
+};
+
+/// 圖片解碼工作: 較大的圖片交給全模組共用的解碼執行緒，與填值同時進行；
+/// 共用的執行緒忙碌時，由呼叫 wait() 的執行緒自己解碼。
+/// 解碼結果相同的 base64 內容(只差在換行、空白或結尾的 '=')只解碼一次，並傳回同一份結果，
+/// 輸出時就只寫入一個圖片項目。
+/// 啓用快取時，先找快取，找不到才解碼，並在解碼後先壓縮好再放入快取。
+class PictureDecoder
+{
+public:
+    /// 小於此大小(base64 字元數)的圖片直接解碼
+    static constexpr std::size_t BACKGROUND_MIN_SIZE = 64 * 1024;
+
+    PictureDecoder();
+    PictureDecoder(const PictureDecoder&) = delete;
+    PictureDecoder& operator=(const PictureDecoder&) = delete;
+    ~PictureDecoder();
+
+    /// @brief 加入一張圖片，data 在 wait() 之前須保持有效；直接解碼的圖片失敗時丟出例外
+    /// @return 解碼後的圖片，背景解碼的圖片在 wait() 之後才完整
+    PicturePtr add(const char* data, std::size_t size);
+    /// @brief 同上，但資料由解碼工作保存
+    PicturePtr add(std::string&& text);
+
+    /// @brief 開始在背景解碼，之後加入的圖片直接解碼
+    void start();
+    /// @brief 等待所有圖片解碼完成，還沒有執行緒領取的圖片在目前的執行緒解碼
+    /// 背景解碼失敗時丟出第一個錯誤
+    void wait();
+
+private:
+    struct Job
+    {
+        const char* data;
+        std::size_t size;
+        std::string_view key; // 比對及快取用的 key
+        std::shared_ptr<Picture> picture;
+        std::exception_ptr error; // 背景解碼失敗的原因
+    };
+
+    /// 背景解碼中的圖片，由共用的解碼執行緒與這個物件共同持有
+    struct Batch
+    {
+        std::vector<Job> jobs;
+        std::atomic<std::size_t> next{ 0 }; // 下一張要領取的圖片
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::size_t finished = 0;
+    };
+
+    static void decode(const Job& job);
+    /// 依序領取並解碼圖片，直到全部都已被領取
+    static void work(Batch& batch);
+    /// 等待背景解碼結束，不丟出例外
+    void finish();
+
+    std::unordered_map<std::string_view, PicturePtr> mDecoded; // key: 去掉空白及 '=' 的 base64 內容
+    std::list<std::string> mTexts; // add(std::string&&) 保存的資料，及含有空白的圖片的 key
+    std::vector<Job> mJobs;
+    std::shared_ptr<Batch> mBatch; // start() 之後才有
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,268 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+namespace
+{
+/// 平均執行及等待時間的權重: 新的一筆佔 1/10
+constexpr double AVERAGE_WEIGHT = 0.1;
+/// Retry-After 的範圍(秒)
+constexpr unsigned MIN_RETRY_AFTER = 1;
+constexpr unsigned MAX_RETRY_AFTER = 60;
+/// 沒有批次工作在執行時，等待超過此時間的批次工作優先於互動工作，避免一直排不到
+constexpr std::chrono::seconds MAX_BATCH_WAIT(30);
+
+double movingAverage(double average, double value, Poco::UInt64 count)
+{
+    return count == 1 ? value : average + (value - average) * AVERAGE_WEIGHT;
+}
+}
+
+RenderPool::RenderPool()
+    : mRunning(0)
+    , mCompleted(0)
+    , mRejected(0)
+    , mLimited(0)
+    , mDemoted(0)
+    , mAverageSeconds(0)
+    , mStopping(false)
+{
+}
+
+RenderPool::~RenderPool() { stop(); }
+
+void RenderPool::start(const Settings& settings)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSettings = settings;
+    mSettings.workers = std::max(1U, settings.workers);
+    mSettings.batchWorkers = std::clamp(settings.batchWorkers, 1U, mSettings.workers);
+    mStopping = false;
+    for (unsigned i = mWorkers.size(); i < mSettings.workers; i++)
+        mWorkers.emplace_back(&RenderPool::work, this);
+}
+
+void RenderPool::stop()
+{
+    std::vector<Entry> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+        for (auto& cls : mClasses)
+        {
+            std::move(cls.queue.begin(), cls.queue.end(), std::back_inserter(dropped));
+            cls.queue.clear();
+            cls.queuedCost = 0;
+        }
+        for (auto& it : mEndpoints)
+            it.second.queued = 0;
+    }
+    mCondition.notify_all();
+    for (auto& thread : mWorkers)
+        thread.join();
+    mWorkers.clear();
+
+    // 等待中的用戶端須得到回應，不能等到逾時
+    for (auto& entry : dropped)
+    {
+        if (entry.reject)
+            entry.reject();
+    }
+}
+
+RenderPool::Admission RenderPool::post(Ticket& ticket, Task task, Task reject)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (ticket.priority == Priority::INTERACTIVE && mSettings.heavyCost
+            && ticket.cost >= mSettings.heavyCost)
+        {
+            ticket.priority = Priority::BATCH;
+            mDemoted++;
+        }
+        Class& cls = classOf(ticket.priority);
+
+        // 佇列中尚未被空閒執行緒取走的工作不佔等待名額
+        const std::size_t queued = mClasses[0].queue.size() + mClasses[1].queue.size();
+        const std::size_t idle = mWorkers.size() - mRunning;
+        if (mStopping || mWorkers.empty() || queued >= mSettings.maxQueued + idle)
+        {
+            cls.rejected++;
+            mRejected++;
+            return Admission::BUSY;
+        }
+
+        // 同一個範本除了執行中的工作，最多再佔一半的等待名額
+        Endpoint& endpoint = mEndpoints[ticket.endpt];
+        if (mSettings.endpointLimit
+            && endpoint.running + endpoint.queued
+                   >= mSettings.endpointLimit + std::max<std::size_t>(1, mSettings.maxQueued / 2))
+        {
+            cls.rejected++;
+            mRejected++;
+            mLimited++;
+            return Admission::LIMITED;
+        }
+
+        endpoint.queued++;
+        cls.queuedCost += ticket.cost;
+        cls.queue.push_back(
+            { ticket, std::move(task), std::move(reject), std::chrono::steady_clock::now() });
+    }
+    // 閒置的執行緒不一定能執行這個工作(範本或批次名額已滿)，全部喚醒各自判斷
+    mCondition.notify_all();
+    return Admission::ACCEPTED;
+}
+
+unsigned RenderPool::retryAfter(Priority priority)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mWorkers.empty())
+        return MAX_RETRY_AFTER;
+
+    // 排在前面的工作平均分給該類可用的執行緒
+    const std::size_t workers
+        = priority == Priority::BATCH ? mSettings.batchWorkers : mWorkers.size();
+    const double rounds = static_cast<double>(classOf(priority).queue.size() + 1) / workers;
+    const double seconds = std::ceil(rounds * mAverageSeconds);
+    return std::clamp(static_cast<unsigned>(seconds), MIN_RETRY_AFTER, MAX_RETRY_AFTER);
+}
+
+RenderPool::Settings RenderPool::settings()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSettings;
+}
+
+RenderPool::Statistics RenderPool::statistics()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto now = std::chrono::steady_clock::now();
+
+    Statistics stats;
+    stats.settings = mSettings;
+    stats.completed = mCompleted;
+    stats.rejected = mRejected;
+    stats.limited = mLimited;
+    stats.demoted = mDemoted;
+    stats.averageSeconds = mAverageSeconds;
+    stats.interactive = classStatistics(classOf(Priority::INTERACTIVE), now);
+    stats.batch = classStatistics(classOf(Priority::BATCH), now);
+    return stats;
+}
+
+RenderPool::ClassStatistics
+RenderPool::classStatistics(const Class& cls, std::chrono::steady_clock::time_point now) const
+{
+    ClassStatistics stats;
+    stats.running = cls.running;
+    stats.queued = cls.queue.size();
+    stats.queuedCost = cls.queuedCost;
+    stats.completed = cls.completed;
+    stats.rejected = cls.rejected;
+    stats.averageWaitSeconds = cls.averageWaitSeconds;
+    if (!cls.queue.empty())
+        stats.longestWaitSeconds
+            = std::chrono::duration<double>(now - cls.queue.front().queued).count();
+    return stats;
+}
+
+/// 工作所屬的範本是否還能再執行一個(呼叫前須已鎖定)
+bool RenderPool::runnable(const Entry& entry) const
+{
+    if (!mSettings.endpointLimit)
+        return true;
+
+    const auto found = mEndpoints.find(entry.ticket.endpt);
+    return found == mEndpoints.end() || found->second.running < mSettings.endpointLimit;
+}
+
+/// 取出下一個可執行的工作: 互動優先，同類依加入順序(呼叫前須已鎖定)
+bool RenderPool::takeNext(Entry& entry)
+{
+    Class& interactive = classOf(Priority::INTERACTIVE);
+    Class& batch = classOf(Priority::BATCH);
+
+    std::vector<Class*> order = { &interactive };
+    if (batch.running < mSettings.batchWorkers)
+    {
+        const bool starving = batch.running == 0 && !batch.queue.empty()
+                              && std::chrono::steady_clock::now() - batch.queue.front().queued
+                                     >= MAX_BATCH_WAIT;
+        order.insert(starving ? order.begin() : order.end(), &batch);
+    }
+
+    for (Class* cls : order)
+    {
+        for (auto it = cls->queue.begin(); it != cls->queue.end(); ++it)
+        {
+            if (!runnable(*it))
+                continue;
+
+            entry = std::move(*it);
+            cls->queue.erase(it);
+            cls->queuedCost -= entry.ticket.cost;
+            cls->running++;
+            cls->started++;
+            const std::chrono::duration<double> wait
+                = std::chrono::steady_clock::now() - entry.queued;
+            cls->averageWaitSeconds
+                = movingAverage(cls->averageWaitSeconds, wait.count(), cls->started);
+
+            Endpoint& endpoint = mEndpoints[entry.ticket.endpt];
+            endpoint.queued--;
+            endpoint.running++;
+            mRunning++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void RenderPool::work()
+{
+    while (true)
+    {
+        Entry entry;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this, &entry]() { return mStopping || takeNext(entry); });
+            if (mStopping)
+                return;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        entry.task();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            Class& cls = classOf(entry.ticket.priority);
+            cls.running--;
+            cls.completed++;
+            mRunning--;
+            mCompleted++;
+            mAverageSeconds = movingAverage(mAverageSeconds, elapsed.count(), mCompleted);
+
+            const auto found = mEndpoints.find(entry.ticket.endpt);
+            if (found != mEndpoints.end() && --found->second.running == 0
+                && found->second.queued == 0)
+                mEndpoints.erase(found);
+        }
+        // 範本或批次的名額釋出，其他執行緒可能可以接著執行
+        mCondition.notify_all();
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
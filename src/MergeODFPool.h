@@ -0,0 +1,162 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/Types.h>
+
+/// 產生報表用的執行緒池: 固定數量的執行緒及有上限的等待佇列。
+/// 報表在這裡產生，收到請求的執行緒不必等待，可以繼續處理其他輕量的請求；
+/// 佇列已滿時 post() 傳回 BUSY，由呼叫者回覆忙碌中。
+///
+/// 工作分成兩類: 互動(有人在等回應)及批次(?priority=batch、非同步工作、估計成本過高的請求)。
+/// 互動的工作優先執行，批次工作最多同時使用 batchWorkers 個執行緒，
+/// 其餘的執行緒保留給互動的工作；同一個範本同時執行的工作數另有上限，
+/// 大量的匯出不會佔滿所有執行緒。
+class RenderPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    enum class Priority
+    {
+        INTERACTIVE = 0,
+        BATCH = 1
+    };
+
+    enum class Admission
+    {
+        ACCEPTED, // 已加入佇列
+        BUSY, // 佇列已滿(503)
+        LIMITED // 這個範本的工作過多(429)
+    };
+
+    /// 工作的排程資訊
+    struct Ticket
+    {
+        std::string endpt; // 範本代碼，同時執行的數量有上限
+        Priority priority = Priority::INTERACTIVE;
+        Poco::UInt64 cost = 0; // 估計成本，超過 heavyCost 的互動工作改爲批次
+    };
+
+    struct Settings
+    {
+        unsigned workers = 1; // 執行緒數量
+        std::size_t maxQueued = 0; // 等待佇列上限(兩類合計)
+        unsigned batchWorkers = 1; // 批次工作最多同時使用的執行緒數
+        unsigned endpointLimit = 0; // 同一個範本同時執行的上限，0 表示不限制
+        Poco::UInt64 heavyCost = 0; // 互動工作的成本上限，0 表示不改爲批次
+    };
+
+    struct ClassStatistics
+    {
+        std::size_t running = 0;
+        std::size_t queued = 0;
+        Poco::UInt64 queuedCost = 0; // 等待中工作的估計成本合計
+        Poco::UInt64 completed = 0;
+        Poco::UInt64 rejected = 0; // 含 BUSY 及 LIMITED
+        double averageWaitSeconds = 0; // 最近工作的平均等待時間
+        double longestWaitSeconds = 0; // 目前等待最久的工作已等待的時間
+    };
+
+    struct Statistics
+    {
+        Settings settings;
+        Poco::UInt64 completed = 0;
+        Poco::UInt64 rejected = 0;
+        Poco::UInt64 limited = 0; // 因範本上限而拒絕的數量
+        Poco::UInt64 demoted = 0; // 成本過高而改爲批次的數量
+        double averageSeconds = 0; // 最近工作的平均執行時間
+        ClassStatistics interactive;
+        ClassStatistics batch;
+    };
+
+    RenderPool();
+    RenderPool(const RenderPool&) = delete;
+    RenderPool& operator=(const RenderPool&) = delete;
+    ~RenderPool();
+
+    /// @brief 啓動執行緒
+    void start(const Settings& settings);
+
+    /// @brief 等待執行中的工作結束後停止，尚未執行的工作改呼叫其 reject
+    void stop();
+
+    /// @brief 加入工作，工作不可丟出例外
+    /// @param ticket 排程資訊，priority 可能因成本過高而改爲 BATCH
+    /// @param reject 停止時工作尚未執行就呼叫(例如回覆 503)，可爲空
+    Admission post(Ticket& ticket, Task task, Task reject = nullptr);
+
+    /// @brief 目前的設定(啓動時已補上預設值)
+    Settings settings();
+
+    /// @brief 依該類工作的佇列長度及平均執行時間，估計多久後再試(秒，供 Retry-After 使用)
+    unsigned retryAfter(Priority priority);
+
+    Statistics statistics();
+
+private:
+    struct Entry
+    {
+        Ticket ticket;
+        Task task;
+        Task reject;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    /// 一類工作的佇列及統計
+    struct Class
+    {
+        std::deque<Entry> queue;
+        std::size_t running = 0;
+        Poco::UInt64 queuedCost = 0;
+        Poco::UInt64 completed = 0;
+        Poco::UInt64 rejected = 0;
+        double averageWaitSeconds = 0;
+        Poco::UInt64 started = 0; // 已開始執行的數量，計算平均等待時間用
+    };
+
+    /// 範本目前的工作數
+    struct Endpoint
+    {
+        std::size_t running = 0;
+        std::size_t queued = 0;
+    };
+
+    void work();
+    bool takeNext(Entry& entry);
+    bool runnable(const Entry& entry) const;
+    Class& classOf(Priority priority) { return mClasses[static_cast<int>(priority)]; }
+    ClassStatistics classStatistics(const Class& cls,
+                                    std::chrono::steady_clock::time_point now) const;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    Class mClasses[2];
+    std::map<std::string, Endpoint> mEndpoints;
+    std::vector<std::thread> mWorkers;
+    Settings mSettings;
+    std::size_t mRunning;
+    Poco::UInt64 mCompleted;
+    Poco::UInt64 mRejected;
+    Poco::UInt64 mLimited;
+    Poco::UInt64 mDemoted;
+    double mAverageSeconds;
+    bool mStopping;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,229 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFSegment.h"
+#include "MergeODFParser.h"
+#include "MergeODFStream.h"
+
+#include <sstream>
+
+#include <Poco/DOM/Document.h>
+#include <Poco/DOM/NamedNodeMap.h>
+#include <Poco/DOM/NodeList.h>
+#include <Poco/DOM/Attr.h>
+#include <Poco/JSON/Array.h>
+
+namespace
+{
+/// 變數型別是否只需要換成文字
+bool isPlainType(Parser& parser, const Poco::XML::Element* elm)
+{
+    const VarType type = parser.varDescriptor(elm)->type;
+    return type != VarType::FILE && type != VarType::STATISTIC;
+}
+}
+
+bool SegmentedTemplate::supports(Parser& parser, const std::list<Poco::XML::Element*>& singleVar,
+                                 const std::list<Poco::XML::Element*>& groupVar)
+{
+    if (!parser.isText())
+        return false;
+
+    for (const auto elm : singleVar)
+    {
+        if (!isPlainType(parser, elm))
+            return false;
+    }
+
+    std::set<const Poco::XML::Node*> groupRows(groupVar.begin(), groupVar.end());
+    for (const auto row : groupVar)
+    {
+        Poco::AutoPtr<Poco::XML::NodeList> vars = row->getElementsByTagName("text:placeholder");
+        for (unsigned long i = 0; i < vars->length(); i++)
+        {
+            if (!isPlainType(parser, static_cast<Poco::XML::Element*>(vars->item(i))))
+                return false;
+        }
+
+        // 上一列也是群組樣板列時，跨列數要在前一個群組展開後才能決定
+        if (row->previousSibling() && groupRows.count(row->previousSibling()))
+            return false;
+    }
+    return true;
+}
+
+SegmentedTemplate::SegmentedTemplate(Parser& parser, const std::list<Poco::XML::Element*>& groupVar)
+{
+    for (const auto row : groupVar)
+    {
+        mGroupRows.insert(row);
+        for (auto node = parser.rowsSpannedStart(row); node; node = node->nextSibling())
+        {
+            if (node->nodeType() == Poco::XML::Node::ELEMENT_NODE
+                && static_cast<Poco::XML::Element*>(node)->hasAttribute("table:number-rows-spanned"))
+                mRowsSpanned[node].push_back(row->getAttribute("grpname"));
+        }
+    }
+
+    build(parser, parser.docXML->documentElement(), mSegments, false);
+
+    // 切段完成後就不再參照 DOM
+    mGroupRows.clear();
+    mRowsSpanned.clear();
+}
+
+std::string& SegmentedTemplate::literal(std::vector<Segment>& segments)
+{
+    if (segments.empty() || segments.back().kind != Segment::Kind::LITERAL)
+        segments.emplace_back();
+    return segments.back().text;
+}
+
+void SegmentedTemplate::build(Parser& parser, const Poco::XML::Node* node,
+                              std::vector<Segment>& segments, bool inGroup)
+{
+    if (node->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+    {
+        // 文字、註解等固定內容
+        std::ostringstream oss;
+        StreamRenderer::writeNode(oss, node);
+        literal(segments) += oss.str();
+        return;
+    }
+
+    auto elm = static_cast<const Poco::XML::Element*>(node);
+    if (elm->nodeName() == "text:placeholder")
+    {
+        // 與 setSingleVar() 相同，變數名稱是去掉前後 <> 的內容
+        const std::string key = elm->innerText();
+        Segment segment;
+        segment.kind = Segment::Kind::VARIABLE;
+        segment.text = key.size() >= 2 ? key.substr(1, key.size() - 2) : std::string();
+        segment.descriptor = parser.varDescriptor(elm);
+        segments.push_back(segment);
+        return;
+    }
+
+    if (!inGroup && mGroupRows.count(node))
+    {
+        Segment segment;
+        segment.kind = Segment::Kind::GROUP;
+        segment.text = elm->getAttribute("grpname");
+        build(parser, node, segment.firstRow, true);
+        Poco::AutoPtr<Poco::XML::Node> initRow = parser.initGroupRow(const_cast<Poco::XML::Node*>(node));
+        build(parser, initRow, segment.otherRows, true);
+        segments.push_back(segment);
+        return;
+    }
+
+    auto spanned = mRowsSpanned.find(node);
+    literal(segments) += '<' + elm->nodeName();
+    Poco::AutoPtr<Poco::XML::NamedNodeMap> attrs = elm->attributes();
+    for (unsigned long i = 0; i < attrs->length(); i++)
+    {
+        auto attr = static_cast<Poco::XML::Attr*>(attrs->item(i));
+        literal(segments) += ' ' + attr->name() + "=\"";
+        if (spanned != mRowsSpanned.end() && attr->name() == "table:number-rows-spanned")
+        {
+            Segment segment;
+            segment.kind = Segment::Kind::ROWS_SPANNED;
+            segment.text = attr->value();
+            segment.groups = spanned->second;
+            segments.push_back(segment);
+        }
+        else
+        {
+            std::ostringstream oss;
+            StreamRenderer::writeEscaped(oss, attr->value().data(), attr->value().size(), true);
+            literal(segments) += oss.str();
+        }
+        literal(segments) += '"';
+    }
+
+    if (!node->hasChildNodes())
+    {
+        literal(segments) += "/>";
+        return;
+    }
+
+    literal(segments) += '>';
+    for (auto child = node->firstChild(); child; child = child->nextSibling())
+        build(parser, child, segments, inGroup);
+    literal(segments) += "</" + elm->nodeName() + '>';
+}
+
+void SegmentedTemplate::render(Parser& parser, Poco::JSON::Object::Ptr jsonData,
+                               std::ostream& out) const
+{
+    render(parser, mSegments, jsonData, jsonData, out);
+    out.flush();
+}
+
+void SegmentedTemplate::render(Parser& parser, const std::vector<Segment>& segments,
+                               const Poco::JSON::Object::Ptr& jsonData,
+                               const Poco::JSON::Object::Ptr& rowData, std::ostream& out) const
+{
+    for (const auto& segment : segments)
+    {
+        switch (segment.kind)
+        {
+            case Segment::Kind::LITERAL:
+                out.write(segment.text.data(), segment.text.size());
+                break;
+
+            case Segment::Kind::VARIABLE:
+            {
+                // 沒有資料的變數直接移除
+                if (rowData.isNull())
+                    break;
+                Poco::Dynamic::Var value = rowData->get(segment.text);
+                if (value.isEmpty())
+                    break;
+
+                const std::string text = segment.descriptor->translate(value.toString());
+                StreamRenderer::writeEscaped(out, text.data(), text.size(), false);
+                break;
+            }
+
+            case Segment::Kind::GROUP:
+            {
+                // 沒有資料或不是陣列時，樣板列直接移除
+                if (!jsonData->has(segment.text))
+                    break;
+                Poco::Dynamic::Var data = jsonData->get(segment.text);
+                if (!data.isArray())
+                    break;
+
+                auto arr = data.extract<Poco::JSON::Array::Ptr>();
+                for (std::size_t times = 0; times < arr->size(); times++)
+                    render(parser, times == 0 ? segment.firstRow : segment.otherRows, jsonData,
+                           arr->getObject(times), out);
+                break;
+            }
+
+            case Segment::Kind::ROWS_SPANNED:
+            {
+                // 與 setGroupVar() 相同：有資料的群組才更新，多個群組時以最後一個為準
+                std::string value = segment.text;
+                for (const auto& grpname : segment.groups)
+                {
+                    if (!jsonData->has(grpname))
+                        continue;
+                    Poco::Dynamic::Var data = jsonData->get(grpname);
+                    if (data.isArray())
+                        value = std::to_string(data.extract<Poco::JSON::Array::Ptr>()->size() + 1);
+                }
+                StreamRenderer::writeEscaped(out, value.data(), value.size(), true);
+                break;
+            }
+        }
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
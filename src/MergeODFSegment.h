@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <Poco/JSON/Object.h>
+#include <Poco/DOM/Element.h>
+
+class Parser;
+struct VarDescriptor;
+
+/// 範本 content.xml 的一段: 固定內容或待填值的位置
+struct Segment
+{
+    enum class Kind
+    {
+        LITERAL, // 固定內容，已跳脫，直接輸出
+        VARIABLE, // 變數值
+        GROUP, // 群組，每筆資料輸出一列
+        ROWS_SPANNED // 群組上一列儲存格的 table:number-rows-spanned 值
+    };
+
+    Kind kind = Kind::LITERAL;
+    std::string text; // LITERAL: 內容；VARIABLE: 變數名稱；GROUP: 群組名稱；ROWS_SPANNED: 原值
+    std::shared_ptr<const VarDescriptor> descriptor; // VARIABLE: 變數描述
+    std::vector<std::string> groups; // ROWS_SPANNED: 影響跨列數的群組
+    std::vector<Segment> firstRow; // GROUP: 第一列(保留原格式)
+    std::vector<Segment> otherRows; // GROUP: 第二列以後
+};
+
+/// 預先切段的範本。
+/// Writer 範本若沒有圖片及統計變數，輸出的 content.xml 就是範本內容把變數換成文字、
+/// 群組樣板列依資料重複，因此編譯時先切成固定內容與待填值的位置，
+/// 輸出時依序串接即可，完全不需解析 XML。
+class SegmentedTemplate
+{
+public:
+    /// @brief 範本是否可以切段輸出
+    static bool supports(Parser& parser, const std::list<Poco::XML::Element*>& singleVar,
+                         const std::list<Poco::XML::Element*>& groupVar);
+
+    /// @brief 由 scanVarPtr() 處理過的 DOM 切段
+    SegmentedTemplate(Parser& parser, const std::list<Poco::XML::Element*>& groupVar);
+
+    /// @brief 填入資料並輸出 content.xml
+    void render(Parser& parser, Poco::JSON::Object::Ptr jsonData, std::ostream& out) const;
+
+private:
+    void build(Parser& parser, const Poco::XML::Node* node, std::vector<Segment>& segments,
+               bool inGroup);
+
+    void render(Parser& parser, const std::vector<Segment>& segments,
+                const Poco::JSON::Object::Ptr& jsonData, const Poco::JSON::Object::Ptr& rowData,
+                std::ostream& out) const;
+
+    static std::string& literal(std::vector<Segment>& segments);
+
+    std::set<const Poco::XML::Node*> mGroupRows; // 切段時用: 群組樣板列
+    std::map<const Poco::XML::Node*, std::vector<std::string>> mRowsSpanned; // 切段時用: 跨列儲存格
+    std::vector<Segment> mSegments;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
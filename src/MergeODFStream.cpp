@@ -0,0 +1,285 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFStream.h"
+#include "MergeODFParser.h"
+
+#include <Poco/DOM/Document.h>
+#include <Poco/DOM/NamedNodeMap.h>
+#include <Poco/DOM/Attr.h>
+#include <Poco/DOM/Text.h>
+#include <Poco/JSON/Array.h>
+#include <Poco/SAX/Attributes.h>
+#include <Poco/SAX/SAXParser.h>
+
+StreamRenderer::StreamRenderer(Parser& parser, const TemplatePlan& plan,
+                               Poco::JSON::Object::Ptr jsonData, std::ostream& out)
+    : mParser(parser)
+    , mPlan(plan)
+    , mJsonData(jsonData)
+    , mOut(out)
+    , mOrdinal(0)
+    , mSkipDepth(0)
+    , mStartTagOpen(false)
+    , mContainer(parser.docXML->createElement("fragment"))
+{
+}
+
+void StreamRenderer::render()
+{
+    // 與 scanVarPtr() 的 DOMParser 設定相同，元素名稱一律是含前置詞的 qname
+    Poco::XML::SAXParser parser;
+    parser.setFeature(Poco::XML::XMLReader::FEATURE_NAMESPACES, false);
+    parser.setFeature(Poco::XML::XMLReader::FEATURE_NAMESPACE_PREFIXES, true);
+    parser.setContentHandler(this);
+    parser.parseMemoryNP(mPlan.contentSource.data(), mPlan.contentSource.size());
+    closeStartTag();
+    mOut.flush();
+}
+
+void StreamRenderer::startElement(const Poco::XML::XMLString& /*uri*/,
+                                  const Poco::XML::XMLString& /*localName*/,
+                                  const Poco::XML::XMLString& qname,
+                                  const Poco::XML::Attributes& attributes)
+{
+    // 群組註解不輸出，也不計入序號
+    if (mSkipDepth > 0)
+    {
+        mSkipDepth++;
+        return;
+    }
+    if (qname == "office:annotation" || qname == "office:annotation-end")
+    {
+        mSkipDepth = 1;
+        return;
+    }
+
+    const unsigned ordinal = mOrdinal++;
+    std::string spanned;
+    const bool updateSpanned = rowsSpanned(ordinal, spanned);
+
+    // 進入含變數的範圍，開始組成 DOM 片段
+    if (mFragmentStack.empty() && mPlan.bufferRootOrdinals.count(ordinal))
+    {
+        closeStartTag();
+        mFragmentStack.push_back(mContainer.get());
+    }
+
+    if (!mFragmentStack.empty())
+    {
+        Poco::AutoPtr<Poco::XML::Element> elm = mParser.docXML->createElement(qname);
+        for (int i = 0; i < attributes.getLength(); i++)
+            elm->setAttribute(attributes.getQName(i), attributes.getValue(i));
+        if (updateSpanned)
+            elm->setAttribute("table:number-rows-spanned", spanned);
+
+        if (mPlan.singleVarOrdinals.count(ordinal))
+            mSingleVar.push_back(elm.get());
+
+        if (auto it = mPlan.groupRowOrdinals.find(ordinal); it != mPlan.groupRowOrdinals.end())
+        {
+            elm->setAttribute("grpname", it->second);
+            mGroupVar.push_back(elm.get());
+        }
+
+        mFragmentStack.back()->appendChild(elm);
+        mFragmentStack.push_back(elm.get());
+        return;
+    }
+
+    closeStartTag();
+    mOut << '<' << qname;
+    for (int i = 0; i < attributes.getLength(); i++)
+    {
+        const std::string& name = attributes.getQName(i);
+        const std::string& value
+            = updateSpanned && name == "table:number-rows-spanned" ? spanned : attributes.getValue(i);
+        mOut << ' ' << name << "=\"";
+        writeEscaped(mOut, value.data(), value.size(), true);
+        mOut << '"';
+    }
+    mStartTagOpen = true;
+}
+
+void StreamRenderer::endElement(const Poco::XML::XMLString& /*uri*/,
+                                const Poco::XML::XMLString& /*localName*/,
+                                const Poco::XML::XMLString& qname)
+{
+    if (mSkipDepth > 0)
+    {
+        mSkipDepth--;
+        return;
+    }
+
+    if (!mFragmentStack.empty())
+    {
+        mFragmentStack.pop_back();
+        // 只剩暫存父節點，表示片段已完整
+        if (mFragmentStack.size() == 1)
+        {
+            mFragmentStack.clear();
+            flushFragment();
+        }
+        return;
+    }
+
+    if (mStartTagOpen)
+    {
+        mOut << "/>";
+        mStartTagOpen = false;
+    }
+    else
+        mOut << "</" << qname << '>';
+}
+
+void StreamRenderer::characters(const Poco::XML::XMLChar ch[], int start, int length)
+{
+    if (mSkipDepth > 0 || length <= 0)
+        return;
+
+    if (!mFragmentStack.empty())
+    {
+        Poco::AutoPtr<Poco::XML::Text> text
+            = mParser.docXML->createTextNode(std::string(ch + start, length));
+        mFragmentStack.back()->appendChild(text);
+        return;
+    }
+
+    closeStartTag();
+    writeEscaped(mOut, ch + start, length, false);
+}
+
+void StreamRenderer::ignorableWhitespace(const Poco::XML::XMLChar ch[], int start, int length)
+{
+    characters(ch, start, length);
+}
+
+bool StreamRenderer::rowsSpanned(unsigned ordinal, std::string& value) const
+{
+    auto it = mPlan.rowsSpannedOrdinals.find(ordinal);
+    if (it == mPlan.rowsSpannedOrdinals.end())
+        return false;
+
+    // 與 setGroupVar() 相同：有資料的群組才更新，多個群組時以最後一個為準
+    bool found = false;
+    for (const auto& grpname : it->second)
+    {
+        if (!mJsonData->has(grpname))
+            continue;
+
+        Poco::Dynamic::Var data = mJsonData->get(grpname);
+        if (data.isArray())
+        {
+            value = std::to_string(data.extract<Poco::JSON::Array::Ptr>()->size() + 1);
+            found = true;
+        }
+    }
+    return found;
+}
+
+void StreamRenderer::flushFragment()
+{
+    if (!mSingleVar.empty())
+        mParser.setSingleVar(mJsonData, mSingleVar);
+    if (!mGroupVar.empty())
+        mParser.setGroupVar(mJsonData, mGroupVar);
+    mSingleVar.clear();
+    mGroupVar.clear();
+
+    while (Poco::XML::Node* child = mContainer->firstChild())
+    {
+        writeNode(mOut, child);
+        mContainer->removeChild(child);
+    }
+    // 釋放片段用過的節點
+    mParser.docXML->collectGarbage();
+}
+
+void StreamRenderer::closeStartTag()
+{
+    if (mStartTagOpen)
+    {
+        mOut << '>';
+        mStartTagOpen = false;
+    }
+}
+
+void StreamRenderer::writeNode(std::ostream& out, const Poco::XML::Node* node)
+{
+    switch (node->nodeType())
+    {
+        case Poco::XML::Node::ELEMENT_NODE:
+        {
+            out << '<' << node->nodeName();
+            Poco::AutoPtr<Poco::XML::NamedNodeMap> attrs = node->attributes();
+            for (unsigned long i = 0; i < attrs->length(); i++)
+            {
+                auto attr = static_cast<Poco::XML::Attr*>(attrs->item(i));
+                out << ' ' << attr->name() << "=\"";
+                writeEscaped(out, attr->value().data(), attr->value().size(), true);
+                out << '"';
+            }
+
+            if (!node->hasChildNodes())
+            {
+                out << "/>";
+                break;
+            }
+
+            out << '>';
+            for (auto child = node->firstChild(); child; child = child->nextSibling())
+                writeNode(out, child);
+            out << "</" << node->nodeName() << '>';
+            break;
+        }
+        case Poco::XML::Node::TEXT_NODE:
+        case Poco::XML::Node::CDATA_SECTION_NODE:
+        {
+            const std::string text = node->nodeValue();
+            writeEscaped(out, text.data(), text.size(), false);
+            break;
+        }
+        case Poco::XML::Node::COMMENT_NODE:
+            out << "<!--" << node->nodeValue() << "-->";
+            break;
+        default:
+            break;
+    }
+}
+
+void StreamRenderer::writeEscaped(std::ostream& out, const char* text, std::size_t length,
+                                  bool attribute)
+{
+    const char* begin = text;
+    const char* const end = text + length;
+    for (const char* p = text; p != end; ++p)
+    {
+        const char* entity = nullptr;
+        switch (*p)
+        {
+            case '&': entity = "&amp;"; break;
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '"': entity = "&quot;"; break;
+            case '\t': entity = attribute ? "&#9;" : nullptr; break;
+            case '\n': entity = attribute ? "&#10;" : nullptr; break;
+            case '\r': entity = attribute ? "&#13;" : nullptr; break;
+            default: break;
+        }
+        if (entity)
+        {
+            out.write(begin, p - begin);
+            out << entity;
+            begin = p + 1;
+        }
+    }
+    out.write(begin, end - begin);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
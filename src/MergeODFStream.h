@@ -0,0 +1,78 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <list>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <Poco/AutoPtr.h>
+#include <Poco/JSON/Object.h>
+#include <Poco/DOM/Element.h>
+#include <Poco/SAX/DefaultHandler.h>
+
+class Parser;
+struct TemplatePlan;
+
+/// 以 SAX 讀取範本的 content.xml，邊讀邊輸出。
+/// 只有含變數的範圍(群組樣板列、變數所在的段落或列)會暫時組成 DOM 片段，
+/// 交給 Parser 原有的填值邏輯處理後立即輸出並釋放，記憶體用量與文件大小無關。
+class StreamRenderer : public Poco::XML::DefaultHandler
+{
+public:
+    StreamRenderer(Parser& parser, const TemplatePlan& plan,
+                   Poco::JSON::Object::Ptr jsonData, std::ostream& out);
+
+    /// @brief 解析範本並輸出 content.xml
+    void render();
+
+    void startElement(const Poco::XML::XMLString& uri, const Poco::XML::XMLString& localName,
+                      const Poco::XML::XMLString& qname,
+                      const Poco::XML::Attributes& attributes) override;
+
+    void endElement(const Poco::XML::XMLString& uri, const Poco::XML::XMLString& localName,
+                    const Poco::XML::XMLString& qname) override;
+
+    void characters(const Poco::XML::XMLChar ch[], int start, int length) override;
+
+    void ignorableWhitespace(const Poco::XML::XMLChar ch[], int start, int length) override;
+
+    /// @brief 將 DOM 節點以 XML 輸出(格式與 DOMWriter 相同，不含 namespace 處理)
+    static void writeNode(std::ostream& out, const Poco::XML::Node* node);
+
+    /// @brief XML 跳脫字元
+    static void writeEscaped(std::ostream& out, const char* text, std::size_t length,
+                             bool attribute);
+
+private:
+    /// @brief 依群組列數取得 table:number-rows-spanned 的新值，不需更新時傳回 false
+    bool rowsSpanned(unsigned ordinal, std::string& value) const;
+
+    /// @brief 片段結束: 填值、輸出並釋放
+    void flushFragment();
+
+    /// @brief 補上尚未結束的開始標籤
+    void closeStartTag();
+
+    Parser& mParser;
+    const TemplatePlan& mPlan;
+    Poco::JSON::Object::Ptr mJsonData;
+    std::ostream& mOut;
+
+    unsigned mOrdinal; // 下一個元素的序號
+    int mSkipDepth; // 略過群組註解(office:annotation)時的深度
+    bool mStartTagOpen; // 直接輸出的開始標籤還沒寫出 '>'
+
+    Poco::AutoPtr<Poco::XML::Element> mContainer; // 片段的暫存父節點
+    std::vector<Poco::XML::Node*> mFragmentStack; // 片段中目前開啟的元素
+    std::list<Poco::XML::Element*> mSingleVar; // 片段中的單一變數
+    std::list<Poco::XML::Element*> mGroupVar; // 片段中的群組樣板列
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,451 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "MergeODFZip.h"
+
+#include <ctime>
+#include <memory>
+#include <sstream>
+
+#include <Poco/Checksum.h>
+#include <Poco/CountingStream.h>
+#include <Poco/DeflatingStream.h>
+#include <Poco/InflatingStream.h>
+#include <Poco/MemoryStream.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/Exception.h>
+
+namespace
+{
+constexpr Poco::UInt32 LOCAL_HEADER_SIGNATURE = 0x04034b50;
+constexpr Poco::UInt32 CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+constexpr Poco::UInt32 END_OF_CENTRAL_SIGNATURE = 0x06054b50;
+constexpr Poco::UInt32 DATA_DESCRIPTOR_SIGNATURE = 0x08074b50;
+constexpr Poco::UInt32 ZIP64_END_OF_CENTRAL_SIGNATURE = 0x06064b50;
+constexpr Poco::UInt32 ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+constexpr Poco::UInt16 ZIP64_EXTRA_ID = 0x0001;
+constexpr std::size_t LOCAL_HEADER_SIZE = 30;
+constexpr std::size_t CENTRAL_HEADER_SIZE = 46;
+constexpr std::size_t END_OF_CENTRAL_SIZE = 22;
+constexpr Poco::UInt16 FLAG_DATA_DESCRIPTOR = 0x0008;
+constexpr Poco::UInt16 FLAG_UTF8 = 0x0800;
+constexpr Poco::UInt16 METHOD_STORED = 0;
+constexpr Poco::UInt16 METHOD_DEFLATED = 8;
+constexpr Poco::UInt16 VERSION_DEFAULT = 20;
+constexpr Poco::UInt16 VERSION_ZIP64 = 45;
+/// 超過這些值的欄位改記在 ZIP64 的延伸欄位，原欄位填入最大值
+constexpr Poco::UInt16 MAX_ENTRIES = 0xffff;
+constexpr Poco::UInt32 MAX_OFFSET = 0xffffffff;
+constexpr int DEFLATE_LEVEL = 6;
+constexpr std::size_t BUFFER_SIZE = 64 * 1024;
+
+Poco::UInt16 get16(const std::string& buf, std::size_t pos)
+{
+    if (pos + 2 > buf.size())
+        throw Poco::DataFormatException("Truncated zip archive");
+    return static_cast<Poco::UInt16>(static_cast<unsigned char>(buf[pos])
+                                     | static_cast<unsigned char>(buf[pos + 1]) << 8);
+}
+
+Poco::UInt32 get32(const std::string& buf, std::size_t pos)
+{
+    return static_cast<Poco::UInt32>(get16(buf, pos)) | static_cast<Poco::UInt32>(get16(buf, pos + 2)) << 16;
+}
+
+void put16(std::string& buf, Poco::UInt16 value)
+{
+    buf.push_back(static_cast<char>(value & 0xff));
+    buf.push_back(static_cast<char>(value >> 8));
+}
+
+void put32(std::string& buf, Poco::UInt32 value)
+{
+    put16(buf, static_cast<Poco::UInt16>(value & 0xffff));
+    put16(buf, static_cast<Poco::UInt16>(value >> 16));
+}
+
+void put64(std::string& buf, Poco::UInt64 value)
+{
+    put32(buf, static_cast<Poco::UInt32>(value & 0xffffffff));
+    put32(buf, static_cast<Poco::UInt32>(value >> 32));
+}
+
+/// 項目的大小只以 32 位元記錄，超過時無法寫出
+Poco::UInt32 entrySize(std::size_t size)
+{
+    if (size > MAX_OFFSET)
+        throw Poco::RangeException("Zip entry exceeds 4GB");
+    return static_cast<Poco::UInt32>(size);
+}
+
+/// 目前時間轉為 DOS 格式
+void dosNow(Poco::UInt16& dosTime, Poco::UInt16& dosDate)
+{
+    const std::time_t now = std::time(nullptr);
+    std::tm tm;
+    localtime_r(&now, &tm);
+    dosTime = static_cast<Poco::UInt16>(tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2);
+    dosDate = static_cast<Poco::UInt16>((tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday);
+}
+
+/// 壓縮寫出項目內容，同時計算 CRC 及壓縮前後的大小
+class EntryStreamBuf : public std::streambuf
+{
+public:
+    explicit EntryStreamBuf(std::ostream& out)
+        : mCounter(out)
+        , mDeflater(mCounter, -15, DEFLATE_LEVEL) // raw deflate
+        , mCrc(Poco::Checksum::TYPE_CRC32)
+        , mSize(0)
+        , mBuffer(BUFFER_SIZE)
+    {
+        setp(mBuffer.data(), mBuffer.data() + mBuffer.size());
+    }
+
+    /// 結束壓縮，並填入 CRC 及大小
+    void finish(ZipEntry& entry)
+    {
+        flushBuffer();
+        mDeflater.close();
+        entry.crc32 = mCrc.checksum();
+        entry.uncompressedSize = entrySize(mSize);
+        entry.compressedSize = entrySize(mCounter.chars());
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        flushBuffer();
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override
+    {
+        flushBuffer();
+        return 0;
+    }
+
+private:
+    void flushBuffer()
+    {
+        const auto count = pptr() - pbase();
+        if (count > 0)
+        {
+            mCrc.update(pbase(), static_cast<unsigned>(count));
+            mSize += count;
+            mDeflater.write(pbase(), count);
+            setp(mBuffer.data(), mBuffer.data() + mBuffer.size());
+        }
+    }
+
+    Poco::CountingOutputStream mCounter; // 壓縮後的大小
+    Poco::DeflatingOutputStream mDeflater;
+    Poco::Checksum mCrc;
+    std::size_t mSize; // 壓縮前的大小
+    std::vector<char> mBuffer;
+};
+}
+
+class ZipWriter::EntryStream : public std::ostream
+{
+public:
+    explicit EntryStream(std::ostream& out)
+        : std::ostream(nullptr)
+        , mBuf(out)
+    {
+        rdbuf(&mBuf);
+    }
+
+    EntryStreamBuf mBuf;
+};
+
+std::vector<ZipEntry> ZipReader::entries(const std::string& archive)
+{
+    // 由檔尾往前找 end of central directory(後面可能接最長 65535 bytes 的註解)
+    if (archive.size() < END_OF_CENTRAL_SIZE)
+        throw Poco::DataFormatException("Not a zip archive");
+
+    std::size_t eocd = archive.size() - END_OF_CENTRAL_SIZE;
+    const std::size_t lowest = eocd > 0xffff ? eocd - 0xffff : 0;
+    while (get32(archive, eocd) != END_OF_CENTRAL_SIGNATURE)
+    {
+        if (eocd == lowest)
+            throw Poco::DataFormatException("Not a zip archive");
+        eocd--;
+    }
+
+    const std::size_t count = get16(archive, eocd + 10);
+    std::size_t pos = get32(archive, eocd + 16);
+
+    std::vector<ZipEntry> result;
+    result.reserve(count);
+    for (std::size_t idx = 0; idx < count; idx++)
+    {
+        if (get32(archive, pos) != CENTRAL_HEADER_SIGNATURE)
+            throw Poco::DataFormatException("Bad zip central directory");
+
+        ZipEntry entry;
+        entry.flags = get16(archive, pos + 8);
+        entry.method = get16(archive, pos + 10);
+        entry.modTime = get16(archive, pos + 12);
+        entry.modDate = get16(archive, pos + 14);
+        entry.crc32 = get32(archive, pos + 16);
+        entry.compressedSize = get32(archive, pos + 20);
+        entry.uncompressedSize = get32(archive, pos + 24);
+        const std::size_t nameLen = get16(archive, pos + 28);
+        const std::size_t extraLen = get16(archive, pos + 30);
+        const std::size_t commentLen = get16(archive, pos + 32);
+        const std::size_t localOffset = get32(archive, pos + 42);
+        entry.name = archive.substr(pos + CENTRAL_HEADER_SIZE, nameLen);
+
+        // local header 的 extra 長度可能與 central directory 不同，要以 local header 為準
+        if (get32(archive, localOffset) != LOCAL_HEADER_SIGNATURE)
+            throw Poco::DataFormatException("Bad zip local header");
+        entry.dataOffset = localOffset + LOCAL_HEADER_SIZE + get16(archive, localOffset + 26)
+                           + get16(archive, localOffset + 28);
+        if (entry.dataOffset + entry.compressedSize > archive.size())
+            throw Poco::DataFormatException("Truncated zip archive");
+
+        result.push_back(entry);
+        pos += CENTRAL_HEADER_SIZE + nameLen + extraLen + commentLen;
+    }
+    return result;
+}
+
+std::string ZipReader::inflate(const std::string& archive, const ZipEntry& entry)
+{
+    if (entry.method == METHOD_STORED)
+        return archive.substr(entry.dataOffset, entry.compressedSize);
+
+    Poco::MemoryInputStream compressed(archive.data() + entry.dataOffset, entry.compressedSize);
+    Poco::InflatingInputStream inflater(compressed, -15); // raw deflate
+    std::string data;
+    data.reserve(entry.uncompressedSize);
+    Poco::StreamCopier::copyToString(inflater, data);
+    return data;
+}
+
+ZipWriter::ZipWriter(std::ostream& out)
+    : mOut(out)
+    , mOffset(0)
+{
+}
+
+ZipWriter::~ZipWriter() = default;
+
+void ZipWriter::writeLocalHeader(const ZipEntry& entry)
+{
+    std::string header;
+    header.reserve(LOCAL_HEADER_SIZE + entry.name.size());
+    put32(header, LOCAL_HEADER_SIGNATURE);
+    put16(header, VERSION_DEFAULT); // version needed to extract
+    put16(header, entry.flags);
+    put16(header, entry.method);
+    put16(header, entry.modTime);
+    put16(header, entry.modDate);
+    put32(header, entry.crc32);
+    put32(header, entry.compressedSize);
+    put32(header, entry.uncompressedSize);
+    put16(header, static_cast<Poco::UInt16>(entry.name.size()));
+    put16(header, 0); // extra field length
+    header += entry.name;
+
+    mCentral.emplace_back(entry, mOffset);
+    mOut.write(header.data(), header.size());
+    mOffset += header.size();
+}
+
+void ZipWriter::addRaw(const std::string& archive, const ZipEntry& entry)
+{
+    ZipEntry copy = entry;
+    // 大小已知，直接寫在 local header，不需要 data descriptor
+    copy.flags &= ~FLAG_DATA_DESCRIPTOR;
+    writeLocalHeader(copy);
+    mOut.write(archive.data() + entry.dataOffset, entry.compressedSize);
+    mOffset += entry.compressedSize;
+}
+
+void ZipWriter::add(const std::string& name, const std::string& data, bool compress)
+{
+    Poco::MemoryInputStream input(data.data(), data.size());
+    add(name, input, compress);
+}
+
+void ZipWriter::add(const std::string& name, std::istream& data, bool compress)
+{
+    // local header 要先寫出大小，所以壓縮結果先暫存
+    ZipEntry entry;
+    const std::string compressed = prepare(data, compress, entry);
+    addPrepared(name, entry, compressed);
+}
+
+std::string ZipWriter::prepare(std::istream& data, bool compress, ZipEntry& entry)
+{
+    entry.method = compress ? METHOD_DEFLATED : METHOD_STORED;
+    std::size_t size = 0;
+
+    Poco::Checksum crc(Poco::Checksum::TYPE_CRC32);
+    std::ostringstream payload;
+    {
+        std::unique_ptr<Poco::DeflatingOutputStream> deflater;
+        if (compress)
+            deflater.reset(new Poco::DeflatingOutputStream(payload, -15, DEFLATE_LEVEL)); // raw deflate
+        std::ostream& sink = compress ? static_cast<std::ostream&>(*deflater) : payload;
+
+        char buffer[BUFFER_SIZE];
+        while (data.read(buffer, sizeof(buffer)) || data.gcount() > 0)
+        {
+            const auto count = data.gcount();
+            crc.update(buffer, static_cast<unsigned>(count));
+            sink.write(buffer, count);
+            size += count;
+        }
+        if (deflater)
+            deflater->close();
+    }
+    entry.crc32 = crc.checksum();
+    entry.uncompressedSize = entrySize(size);
+
+    std::string compressed = payload.str();
+    entry.compressedSize = entrySize(compressed.size());
+    return compressed;
+}
+
+std::string ZipWriter::prepare(const std::string& data, bool compress, ZipEntry& entry)
+{
+    Poco::MemoryInputStream input(data.data(), data.size());
+    return prepare(input, compress, entry);
+}
+
+void ZipWriter::addPrepared(const std::string& name, const ZipEntry& prepared,
+                            const std::string& compressed)
+{
+    ZipEntry entry = prepared;
+    entry.name = name;
+    entry.flags = FLAG_UTF8;
+    dosNow(entry.modTime, entry.modDate);
+    writeLocalHeader(entry);
+    mOut.write(compressed.data(), compressed.size());
+    mOffset += compressed.size();
+}
+
+std::ostream& ZipWriter::openEntry(const std::string& name)
+{
+    ZipEntry entry;
+    entry.name = name;
+    entry.flags = FLAG_UTF8 | FLAG_DATA_DESCRIPTOR;
+    entry.method = METHOD_DEFLATED;
+    dosNow(entry.modTime, entry.modDate);
+    writeLocalHeader(entry);
+
+    mEntry.reset(new EntryStream(mOut));
+    return *mEntry;
+}
+
+void ZipWriter::closeEntry()
+{
+    if (!mEntry)
+        return;
+
+    mEntry->flush();
+    ZipEntry& entry = mCentral.back().first;
+    mEntry->mBuf.finish(entry);
+    mEntry.reset();
+    mOffset += entry.compressedSize;
+
+    std::string descriptor;
+    put32(descriptor, DATA_DESCRIPTOR_SIGNATURE);
+    put32(descriptor, entry.crc32);
+    put32(descriptor, entry.compressedSize);
+    put32(descriptor, entry.uncompressedSize);
+    mOut.write(descriptor.data(), descriptor.size());
+    mOffset += descriptor.size();
+}
+
+void ZipWriter::close()
+{
+    const std::size_t centralOffset = mOffset;
+    std::string central;
+    for (const auto& it : mCentral)
+    {
+        const ZipEntry& entry = it.first;
+        // local header 的位置超過 4GB 時記在 ZIP64 延伸欄位
+        const bool zip64 = it.second >= MAX_OFFSET;
+        put32(central, CENTRAL_HEADER_SIGNATURE);
+        put16(central, zip64 ? VERSION_ZIP64 : VERSION_DEFAULT); // version made by
+        put16(central, zip64 ? VERSION_ZIP64 : VERSION_DEFAULT); // version needed to extract
+        put16(central, entry.flags);
+        put16(central, entry.method);
+        put16(central, entry.modTime);
+        put16(central, entry.modDate);
+        put32(central, entry.crc32);
+        put32(central, entry.compressedSize);
+        put32(central, entry.uncompressedSize);
+        put16(central, static_cast<Poco::UInt16>(entry.name.size()));
+        put16(central, zip64 ? 12 : 0); // extra field length
+        put16(central, 0); // comment length
+        put16(central, 0); // disk number start
+        put16(central, 0); // internal attributes
+        put32(central, 0); // external attributes
+        put32(central, zip64 ? MAX_OFFSET : static_cast<Poco::UInt32>(it.second));
+        central += entry.name;
+        if (zip64)
+        {
+            put16(central, ZIP64_EXTRA_ID);
+            put16(central, 8); // 只有 local header 的位置
+            put64(central, it.second);
+        }
+    }
+
+    const std::size_t centralSize = central.size();
+    const bool zip64 = mCentral.size() >= MAX_ENTRIES || centralSize >= MAX_OFFSET
+                       || centralOffset >= MAX_OFFSET;
+    if (zip64)
+    {
+        // 項目數或位置超出一般 end of central directory 的欄位，另外寫出 ZIP64 的版本
+        const std::size_t zip64Offset = centralOffset + centralSize;
+        put32(central, ZIP64_END_OF_CENTRAL_SIGNATURE);
+        put64(central, 44); // 這筆記錄其後的大小
+        put16(central, VERSION_ZIP64); // version made by
+        put16(central, VERSION_ZIP64); // version needed to extract
+        put32(central, 0); // number of this disk
+        put32(central, 0); // disk where central directory starts
+        put64(central, mCentral.size());
+        put64(central, mCentral.size());
+        put64(central, centralSize);
+        put64(central, centralOffset);
+
+        put32(central, ZIP64_LOCATOR_SIGNATURE);
+        put32(central, 0); // disk where ZIP64 end of central directory starts
+        put64(central, zip64Offset);
+        put32(central, 1); // total number of disks
+    }
+
+    const Poco::UInt16 entries
+        = zip64 ? MAX_ENTRIES : static_cast<Poco::UInt16>(mCentral.size());
+    put32(central, END_OF_CENTRAL_SIGNATURE);
+    put16(central, 0); // number of this disk
+    put16(central, 0); // disk where central directory starts
+    put16(central, entries);
+    put16(central, entries);
+    put32(central, zip64 ? MAX_OFFSET : static_cast<Poco::UInt32>(centralSize));
+    put32(central, zip64 ? MAX_OFFSET : static_cast<Poco::UInt32>(centralOffset));
+    put16(central, 0); // comment length
+
+    mOut.write(central.data(), central.size());
+    mOffset += central.size();
+    mOut.flush();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
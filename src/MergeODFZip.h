@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <Poco/Types.h>
+
+/// ZIP 檔內的一個項目(資料維持壓縮狀態，存在所屬的 archive 字串中)
+struct ZipEntry
+{
+    std::string name;
+    Poco::UInt16 flags = 0;
+    Poco::UInt16 method = 0; // 0: stored, 8: deflated
+    Poco::UInt16 modTime = 0; // DOS 格式時間
+    Poco::UInt16 modDate = 0; // DOS 格式日期
+    Poco::UInt32 crc32 = 0;
+    Poco::UInt32 compressedSize = 0;
+    Poco::UInt32 uncompressedSize = 0;
+    std::size_t dataOffset = 0; // 壓縮資料在 archive 中的起始位置
+};
+
+/// 讀取 ZIP 檔的目錄，不解壓縮
+class ZipReader
+{
+public:
+    /// @brief 解析 archive 的 central directory
+    /// @param archive 整個 ZIP 檔的內容
+    /// @return 依 central directory 順序排列的項目
+    static std::vector<ZipEntry> entries(const std::string& archive);
+
+    /// @brief 解壓縮單一項目
+    static std::string inflate(const std::string& archive, const ZipEntry& entry);
+};
+
+/// 循序寫出 ZIP 檔。項目數或位置超出一般欄位時改用 ZIP64 記錄，單一項目仍不可超過 4GB
+class ZipWriter
+{
+public:
+    explicit ZipWriter(std::ostream& out);
+    ~ZipWriter();
+
+    /// @brief 將其他 archive 中已壓縮的項目原封不動複製過來
+    void addRaw(const std::string& archive, const ZipEntry& entry);
+
+    /// @brief 加入新項目
+    /// @param compress false 表示不壓縮(如 ODF 的 mimetype)
+    void add(const std::string& name, const std::string& data, bool compress = true);
+
+    /// @brief 加入新項目，資料邊讀邊壓縮，不需先整份讀入記憶體
+    void add(const std::string& name, std::istream& data, bool compress = true);
+
+    /// @brief 預先壓縮資料，結果可重複以 addPrepared() 寫入
+    /// @param entry 傳回壓縮方式、大小及 CRC
+    static std::string prepare(std::istream& data, bool compress, ZipEntry& entry);
+    static std::string prepare(const std::string& data, bool compress, ZipEntry& entry);
+
+    /// @brief 加入 prepare() 產生的資料
+    void addPrepared(const std::string& name, const ZipEntry& entry, const std::string& compressed);
+
+    /// @brief 開始大小未知的項目，資料寫入傳回的 stream 時即壓縮輸出，
+    ///        寫完後呼叫 closeEntry()，大小及 CRC 記錄在資料後的 data descriptor
+    std::ostream& openEntry(const std::string& name);
+
+    /// @brief 結束 openEntry() 開始的項目
+    void closeEntry();
+
+    /// @brief 寫出 central directory，結束 ZIP 檔
+    void close();
+
+private:
+    void writeLocalHeader(const ZipEntry& entry);
+
+    class EntryStream;
+
+    std::ostream& mOut;
+    std::unique_ptr<EntryStream> mEntry; // openEntry() 開始的項目
+    std::size_t mOffset; // 目前已寫出的位元組數
+    std::vector<std::pair<ZipEntry, std::size_t>> mCentral; // 項目及其 local header 位置
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,134 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// decodeBase64() 各實作(純量、SSE4.1、AVX2)的測試: 隨機資料以參考編碼器編碼後解碼，
+// 結果須與原始資料相同。CPU 不支援的實作略過。
+
+#include "MergeODFBase64.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+
+namespace
+{
+/// 參考編碼器(RFC 4648)
+std::string encode(const std::string& data, bool padding)
+{
+    static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    std::size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3)
+    {
+        const unsigned bits = static_cast<unsigned char>(data[i]) << 16
+                              | static_cast<unsigned char>(data[i + 1]) << 8
+                              | static_cast<unsigned char>(data[i + 2]);
+        out += alphabet[bits >> 18];
+        out += alphabet[(bits >> 12) & 63];
+        out += alphabet[(bits >> 6) & 63];
+        out += alphabet[bits & 63];
+    }
+
+    const std::size_t rest = data.size() - i;
+    if (rest > 0)
+    {
+        unsigned bits = static_cast<unsigned char>(data[i]) << 16;
+        if (rest == 2)
+            bits |= static_cast<unsigned char>(data[i + 1]) << 8;
+        out += alphabet[bits >> 18];
+        out += alphabet[(bits >> 12) & 63];
+        if (rest == 2)
+            out += alphabet[(bits >> 6) & 63];
+        if (padding)
+            out.append(3 - rest, '=');
+    }
+    return out;
+}
+
+/// 每 width 個字元插入換行(MIME 的寫法)
+std::string wrap(const std::string& text, std::size_t width, const std::string& newline)
+{
+    std::string out;
+    for (std::size_t i = 0; i < text.size(); i += width)
+    {
+        if (i > 0)
+            out += newline;
+        out += text.substr(i, width);
+    }
+    return out;
+}
+
+struct Engine
+{
+    Base64Engine engine;
+    const char* name;
+};
+
+/// @return 失敗的次數
+int testEngine(const Engine& engine)
+{
+    std::string probe;
+    if (!decodeBase64(engine.engine, "", 0, probe))
+    {
+        std::printf("%s: not supported, skipped\n", engine.name);
+        return 0;
+    }
+
+    int failures = 0;
+    auto check = [&](const std::string& encoded, const std::string& expected, const char* what)
+    {
+        // 解碼結果附加在原有內容之後
+        std::string out = "prefix";
+        decodeBase64(engine.engine, encoded.data(), encoded.size(), out);
+        if (out != "prefix" + expected)
+        {
+            std::printf("%s: %s failed (%zu bytes)\n", engine.name, what, expected.size());
+            failures++;
+        }
+    };
+
+    std::mt19937 random(20240601);
+    for (int round = 0; round < 2000; round++)
+    {
+        // 包含不足一個區塊、剛好一個區塊及多個區塊的長度
+        std::string data(random() % (round < 200 ? 64 : 4096), '\0');
+        for (auto& ch : data)
+            ch = static_cast<char>(random());
+
+        check(encode(data, true), data, "padded");
+        check(encode(data, false), data, "unpadded");
+        check(wrap(encode(data, true), 76, "\r\n"), data, "CRLF wrapped");
+        check(wrap(encode(data, false), 64, "\n"), data, "LF wrapped");
+        check(wrap(encode(data, true), 4, " "), data, "space separated");
+    }
+
+    // 遇到不合法的字元就停止，保留已解出的資料
+    check("QUJD*REVG", "ABC", "invalid character");
+    check(encode(std::string(100, 'x'), true) + "=QUJD", std::string(100, 'x'), "data after padding");
+    check("", "", "empty");
+    return failures;
+}
+}
+
+int main()
+{
+    const Engine engines[] = { { Base64Engine::SCALAR, "scalar" },
+                               { Base64Engine::SSE41, "SSE4.1" },
+                               { Base64Engine::AVX2, "AVX2" },
+                               { Base64Engine::AUTO, "auto" } };
+
+    int failures = 0;
+    for (const Engine& engine : engines)
+        failures += testEngine(engine);
+
+    std::printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
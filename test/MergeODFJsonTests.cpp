@@ -0,0 +1,226 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// JsonBinder 的測試: 跳脫字元及 surrogate pair、不分大小寫的 true/false/null、註解、
+// 巢狀層數上限、JSON 陣列與 NDJSON 的批次資料，以及範本沒有用到的鍵值是否略過。
+
+#include "MergeODFJson.h"
+
+#include <cstdio>
+#include <exception>
+#include <string>
+
+#include <Poco/Exception.h>
+#include <Poco/JSON/Array.h>
+
+namespace
+{
+int failures = 0;
+
+void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::printf("%s failed\n", what);
+        failures++;
+    }
+}
+
+JsonBinding makeBinding()
+{
+    JsonBinding binding;
+    binding.keys = { "text", "yes", "no", "none", "number", "nested", "group", "logo" };
+    binding.groupKeys["group"] = { "name", "icon" };
+    binding.pictureKeys = { "logo", "icon" };
+    return binding;
+}
+
+Poco::JSON::Object::Ptr bind(const JsonBinding& binding, const std::string& json)
+{
+    JsonBinder binder(binding);
+    Poco::JSON::Object::Ptr object = binder.bind(json.data(), json.size());
+    binder.waitPictures();
+    return object;
+}
+
+/// @return true: 讀取時丟出 Poco::SyntaxException
+bool rejects(const JsonBinding& binding, const std::string& json, bool batch = false)
+{
+    try
+    {
+        JsonBinder binder(binding);
+        if (batch)
+            binder.bindBatch(json.data(), json.size());
+        else
+            binder.bind(json.data(), json.size());
+    }
+    catch (const Poco::SyntaxException&)
+    {
+        return true;
+    }
+    return false;
+}
+
+std::string text(const Poco::JSON::Object::Ptr& object, const std::string& key)
+{
+    return object->get(key).toString();
+}
+
+void testStrings(const JsonBinding& binding)
+{
+    auto object = bind(binding, R"({"text": "q\" b\\ s\/ \b\f\n\r\t"})");
+    check(text(object, "text") == "q\" b\\ s/ \b\f\n\r\t", "simple escapes");
+
+    // é、中，及 surrogate pair 組成的 U+1F600
+    object = bind(binding, R"({"text": "\u00e9\u4e2d\ud83d\ude00"})");
+    check(text(object, "text") == "\xC3\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80", "unicode escapes");
+
+    // 沒有配對的 high surrogate 照原值輸出，後面的字元不受影響
+    object = bind(binding, R"({"text": "\ud83dA"})");
+    check(text(object, "text") == "\xED\xA0\xBD" "A", "unpaired surrogate");
+
+    // 字串中的換行字元去掉(與原本逐行讀取相同)
+    object = bind(binding, "{\"text\": \"a\nb\"}");
+    check(text(object, "text") == "ab", "newline in string");
+
+    check(rejects(binding, R"({"text": "\x"})"), "invalid escape");
+    check(rejects(binding, R"({"text": "\u12"})"), "short unicode escape");
+    check(rejects(binding, R"({"text": "abc)"), "unterminated string");
+}
+
+void testKeywords(const JsonBinding& binding)
+{
+    auto object = bind(binding, R"({"yes": TRUE, "no": False, "none": nULL, "number": -12})");
+    check(object->get("yes").extract<bool>(), "TRUE");
+    check(!object->get("no").extract<bool>(), "False");
+    check(object->has("none") && object->get("none").isEmpty(), "nULL");
+    check(object->get("number").convert<Poco::Int64>() == -12, "number");
+
+    object = bind(binding, R"({"number": 1.5e2})");
+    check(object->get("number").convert<double>() == 150, "float");
+
+    check(rejects(binding, R"({"yes": tru})"), "truncated keyword");
+    check(rejects(binding, R"({"yes": yes})"), "unknown keyword");
+}
+
+void testComments(const JsonBinding& binding)
+{
+    auto object = bind(binding, "// header\n{ /* key */ \"text\" : \"a\" // value\n }\n/* end */");
+    check(text(object, "text") == "a", "comments");
+
+    // 字串中的註解符號不是註解
+    object = bind(binding, R"({"text": "http://example.com/*x*/"})");
+    check(text(object, "text") == "http://example.com/*x*/", "comment marks in string");
+
+    check(rejects(binding, "{\"text\": \"a\" /* no end }"), "unterminated comment");
+}
+
+void testDepth(const JsonBinding& binding)
+{
+    auto nested = [](const std::string& key, int depth)
+    {
+        return "{\"" + key + "\": " + std::string(depth, '[') + std::string(depth, ']') + "}";
+    };
+
+    check(!rejects(binding, nested("nested", 500)), "nesting below the limit");
+    check(rejects(binding, nested("nested", 600)), "nesting over the limit");
+    // 略過的鍵值一樣有上限
+    check(rejects(binding, nested("skipped", 600)), "skipped nesting over the limit");
+}
+
+void testBatch(const JsonBinding& binding)
+{
+    auto count = [&binding](const std::string& json)
+    {
+        JsonBinder binder(binding);
+        const auto records = binder.bindBatch(json.data(), json.size());
+        binder.waitPictures();
+        return records.size();
+    };
+
+    check(count(R"([{"text": "a"}, {"text": "b"}, {}])") == 3, "JSON array");
+    check(count("{\"text\": \"a\"}\n{\"text\": \"b\"}\r\n\n{\"text\": \"c\"}\n") == 3, "NDJSON");
+    check(count("[ ]") == 0, "empty array");
+    check(count(" \n") == 0, "blank body");
+
+    check(rejects(binding, "[1, 2]", true), "array of non-objects");
+    check(rejects(binding, R"([{"text": "a"} {"text": "b"}])", true), "missing comma");
+    check(rejects(binding, "{\"text\": \"a\"}\n[]", true), "array after NDJSON");
+
+    // 相同的圖片在所有資料中共用
+    const std::string json = R"([{"logo": "QUJD"}, {"logo": "QUJD"}])";
+    JsonBinder binder(binding);
+    const auto records = binder.bindBatch(json.data(), json.size());
+    binder.waitPictures();
+    const auto first = records[0]->get("logo").extract<PicturePtr>();
+    const auto second = records[1]->get("logo").extract<PicturePtr>();
+    check(first == second && first->data == "ABC", "shared picture");
+}
+
+void testSkippedKeys(const JsonBinding& binding)
+{
+    auto object = bind(binding, R"({
+        "skipped": {"deep": [1, {"text": "\"}"}, [true, null]], "more": "x"},
+        "text": "kept",
+        "group": [{"name": "n1", "extra": {"a": 1}}, {"name": "n2", "icon": "QUJD"}],
+        "other": [1, 2, 3]
+    })");
+    check(!object->has("skipped") && !object->has("other"), "unused keys skipped");
+    check(text(object, "text") == "kept", "used key after skipped value");
+
+    const Poco::JSON::Array::Ptr group = object->getArray("group");
+    check(group && group->size() == 2, "group rows");
+    if (group && group->size() == 2)
+    {
+        const Poco::JSON::Object::Ptr row = group->getObject(0);
+        check(text(row, "name") == "n1" && !row->has("extra"), "unused group keys skipped");
+        const Poco::Dynamic::Var icon = group->getObject(1)->get("icon");
+        check(icon.type() == typeid(PicturePtr) && icon.extract<PicturePtr>()->data == "ABC",
+              "picture in group");
+    }
+
+    // 跳脫字元的圖片先複製字串再解碼
+    object = bind(binding, R"({"logo": "QU\/J\nD"})");
+    const Poco::Dynamic::Var logo = object->get("logo");
+    check(logo.type() == typeid(PicturePtr), "escaped picture");
+
+    check(rejects(binding, R"([{"text": "a"}])"), "array as object");
+    check(rejects(binding, R"({"text": "a"} x)"), "data after object");
+}
+}
+
+int main()
+{
+    const struct
+    {
+        void (*run)(const JsonBinding&);
+        const char* name;
+    } tests[] = { { testStrings, "strings" }, { testKeywords, "keywords" },
+                  { testComments, "comments" }, { testDepth, "depth" },
+                  { testBatch, "batch" }, { testSkippedKeys, "skipped keys" } };
+
+    const JsonBinding binding = makeBinding();
+    for (const auto& test : tests)
+    {
+        try
+        {
+            test.run(binding);
+        }
+        catch (const std::exception& e)
+        {
+            std::printf("%s: unexpected exception: %s\n", test.name, e.what());
+            failures++;
+        }
+    }
+
+    std::printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
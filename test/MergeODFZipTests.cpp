@@ -0,0 +1,328 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// ZipWriter 及 ZipReader 的測試: 寫出後讀回、addRaw() 原封複製、openEntry() 的 data descriptor，
+// 以及項目數或位置超出 32 位元欄位時的 ZIP64 記錄。超過 4GB 的檔案只計數不保存，檢查結尾的記錄。
+
+#include "MergeODFZip.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <sstream>
+#include <string>
+
+namespace
+{
+constexpr Poco::UInt32 LOCAL_HEADER_SIGNATURE = 0x04034b50;
+constexpr Poco::UInt32 CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+constexpr Poco::UInt32 END_OF_CENTRAL_SIGNATURE = 0x06054b50;
+constexpr Poco::UInt32 DATA_DESCRIPTOR_SIGNATURE = 0x08074b50;
+constexpr Poco::UInt32 ZIP64_END_OF_CENTRAL_SIGNATURE = 0x06064b50;
+constexpr Poco::UInt32 ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+constexpr Poco::UInt16 FLAG_DATA_DESCRIPTOR = 0x0008;
+constexpr std::size_t END_OF_CENTRAL_SIZE = 22;
+constexpr std::size_t ZIP64_LOCATOR_SIZE = 20;
+constexpr std::size_t ZIP64_END_OF_CENTRAL_SIZE = 56;
+
+int failures = 0;
+
+void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::printf("%s failed\n", what);
+        failures++;
+    }
+}
+
+Poco::UInt16 get16(const std::string& buf, std::size_t pos)
+{
+    return static_cast<Poco::UInt16>(static_cast<unsigned char>(buf.at(pos))
+                                     | static_cast<unsigned char>(buf.at(pos + 1)) << 8);
+}
+
+Poco::UInt32 get32(const std::string& buf, std::size_t pos)
+{
+    return get16(buf, pos) | static_cast<Poco::UInt32>(get16(buf, pos + 2)) << 16;
+}
+
+Poco::UInt64 get64(const std::string& buf, std::size_t pos)
+{
+    return get32(buf, pos) | static_cast<Poco::UInt64>(get32(buf, pos + 4)) << 32;
+}
+
+/// 只計算寫出的位元組數，並保留最後 KEEP 個位元組，用來產生超過 4GB 的檔案
+class TailStreamBuf : public std::streambuf
+{
+public:
+    static constexpr std::size_t KEEP = 16 * 1024 * 1024;
+
+    Poco::UInt64 count() const { return mCount; }
+    /// 最後的資料，tail()[0] 位於檔案的 count() - tail().size()
+    const std::string& tail() const { return mTail; }
+
+protected:
+    std::streamsize xsputn(const char* data, std::streamsize size) override
+    {
+        mCount += size;
+        const std::size_t keep = std::min<std::size_t>(size, KEEP);
+        mTail.append(data + size - keep, keep);
+        if (mTail.size() > 2 * KEEP)
+            mTail.erase(0, mTail.size() - KEEP);
+        return size;
+    }
+
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            const char c = traits_type::to_char_type(ch);
+            xsputn(&c, 1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+private:
+    Poco::UInt64 mCount = 0;
+    std::string mTail;
+};
+
+std::string sampleText(std::size_t size)
+{
+    std::string text;
+    for (std::size_t i = 0; text.size() < size; i++)
+        text += "<text:p>row " + std::to_string(i) + "</text:p>\n";
+    text.resize(size);
+    return text;
+}
+
+/// 寫出後讀回，openEntry() 的項目大小記在資料後的 data descriptor
+void testRoundTrip()
+{
+    const std::string content = sampleText(200000);
+    const std::string streamed = sampleText(300000);
+
+    std::ostringstream out;
+    ZipWriter writer(out);
+    writer.add("mimetype", "application/vnd.oasis.opendocument.text", false);
+    writer.add("content.xml", content);
+    std::ostream& entry = writer.openEntry("styles.xml");
+    // 分多次寫入
+    for (std::size_t pos = 0; pos < streamed.size(); pos += 7000)
+        entry << streamed.substr(pos, 7000);
+    writer.closeEntry();
+    writer.add("empty", "");
+    writer.close();
+
+    const std::string archive = out.str();
+    const std::vector<ZipEntry> entries = ZipReader::entries(archive);
+    check(entries.size() == 4, "entry count");
+    if (entries.size() != 4)
+        return;
+
+    check(entries[0].name == "mimetype" && entries[0].method == 0, "stored entry");
+    check(ZipReader::inflate(archive, entries[0]) == "application/vnd.oasis.opendocument.text",
+          "stored data");
+    check(entries[1].method == 8 && entries[1].compressedSize < content.size(), "deflated entry");
+    check(ZipReader::inflate(archive, entries[1]) == content, "deflated data");
+    check(ZipReader::inflate(archive, entries[3]).empty(), "empty entry");
+
+    // local header 沒有大小及 CRC，由 data descriptor 記錄，與 central directory 相同
+    const ZipEntry& styles = entries[2];
+    check(ZipReader::inflate(archive, styles) == streamed, "streamed data");
+    check(styles.uncompressedSize == streamed.size(), "streamed size");
+    check((styles.flags & FLAG_DATA_DESCRIPTOR) != 0, "data descriptor flag");
+    const std::size_t local = styles.dataOffset - 30 - styles.name.size();
+    check(get32(archive, local) == LOCAL_HEADER_SIGNATURE, "local header");
+    check(get32(archive, local + 14) == 0 && get32(archive, local + 18) == 0
+              && get32(archive, local + 22) == 0,
+          "local header without sizes");
+    const std::size_t descriptor = styles.dataOffset + styles.compressedSize;
+    check(get32(archive, descriptor) == DATA_DESCRIPTOR_SIGNATURE, "data descriptor signature");
+    check(get32(archive, descriptor + 4) == styles.crc32
+              && get32(archive, descriptor + 8) == styles.compressedSize
+              && get32(archive, descriptor + 12) == styles.uncompressedSize,
+          "data descriptor fields");
+    check(get32(archive, descriptor + 16) == LOCAL_HEADER_SIGNATURE, "entry after descriptor");
+}
+
+/// addRaw() 不解壓縮直接複製，大小改記在 local header
+void testRawCopy()
+{
+    const std::string content = sampleText(100000);
+    std::ostringstream source;
+    {
+        ZipWriter writer(source);
+        writer.add("a.xml", content);
+        writer.openEntry("b.xml") << content;
+        writer.closeEntry();
+        writer.add("c.txt", "stored", false);
+        writer.close();
+    }
+    const std::string sourceArchive = source.str();
+    const std::vector<ZipEntry> sourceEntries = ZipReader::entries(sourceArchive);
+
+    std::ostringstream copy;
+    ZipWriter writer(copy);
+    for (const ZipEntry& entry : sourceEntries)
+        writer.addRaw(sourceArchive, entry);
+    writer.close();
+
+    const std::string archive = copy.str();
+    const std::vector<ZipEntry> entries = ZipReader::entries(archive);
+    check(entries.size() == sourceEntries.size(), "raw copy count");
+    if (entries.size() != sourceEntries.size())
+        return;
+
+    for (std::size_t i = 0; i < entries.size(); i++)
+    {
+        const ZipEntry& entry = entries[i];
+        const ZipEntry& original = sourceEntries[i];
+        check(entry.name == original.name && entry.method == original.method
+                  && entry.crc32 == original.crc32
+                  && entry.compressedSize == original.compressedSize,
+              "raw copy header");
+        check(archive.compare(entry.dataOffset, entry.compressedSize, sourceArchive,
+                              original.dataOffset, original.compressedSize)
+                  == 0,
+              "raw copy data");
+        check(ZipReader::inflate(archive, entry) == ZipReader::inflate(sourceArchive, original),
+              "raw copy content");
+
+        const std::size_t local = entry.dataOffset - 30 - entry.name.size();
+        check((entry.flags & FLAG_DATA_DESCRIPTOR) == 0
+                  && get32(archive, local + 14) == entry.crc32
+                  && get32(archive, local + 18) == entry.compressedSize,
+              "raw copy without data descriptor");
+    }
+}
+
+/// @brief 檢查檔尾的 ZIP64 end of central directory、locator 及 end of central directory
+/// @param tail 檔案最後的資料，起始於檔案的 total - tail.size()
+/// @return central directory 在 tail 中的位置
+std::size_t checkZip64Tail(const std::string& tail, Poco::UInt64 total, Poco::UInt64 entries)
+{
+    const std::size_t eocd = tail.size() - END_OF_CENTRAL_SIZE;
+    check(get32(tail, eocd) == END_OF_CENTRAL_SIGNATURE, "end of central directory");
+    check(get16(tail, eocd + 8) == 0xffff && get16(tail, eocd + 10) == 0xffff,
+          "end of central directory count");
+    check(get32(tail, eocd + 12) == 0xffffffff && get32(tail, eocd + 16) == 0xffffffff,
+          "end of central directory size and offset");
+
+    const std::size_t locator = eocd - ZIP64_LOCATOR_SIZE;
+    const std::size_t record = locator - ZIP64_END_OF_CENTRAL_SIZE;
+    const Poco::UInt64 tailStart = total - tail.size();
+    check(get32(tail, locator) == ZIP64_LOCATOR_SIGNATURE, "ZIP64 locator");
+    check(get64(tail, locator + 8) == tailStart + record, "ZIP64 locator offset");
+    check(get32(tail, locator + 16) == 1, "ZIP64 locator disks");
+
+    check(get32(tail, record) == ZIP64_END_OF_CENTRAL_SIGNATURE, "ZIP64 end of central directory");
+    check(get64(tail, record + 4) == ZIP64_END_OF_CENTRAL_SIZE - 12, "ZIP64 record size");
+    check(get16(tail, record + 14) == 45, "ZIP64 version needed");
+    check(get64(tail, record + 24) == entries && get64(tail, record + 32) == entries,
+          "ZIP64 entry count");
+    const Poco::UInt64 centralSize = get64(tail, record + 40);
+    const Poco::UInt64 centralOffset = get64(tail, record + 48);
+    check(centralOffset + centralSize == tailStart + record, "ZIP64 central directory position");
+
+    const std::size_t central = static_cast<std::size_t>(centralOffset - tailStart);
+    check(get32(tail, central) == CENTRAL_HEADER_SIGNATURE, "central directory start");
+    return central;
+}
+
+/// 位置超過 4GB: 之後的項目以 ZIP64 延伸欄位記錄 local header 的位置
+void testLargeOffsets()
+{
+    const std::string data(16 * 1024 * 1024, '\0');
+    ZipEntry prepared;
+    const std::string stored = ZipWriter::prepare(data, false, prepared);
+
+    TailStreamBuf buf;
+    std::ostream out(&buf);
+    ZipWriter writer(out);
+    const std::size_t count = 260; // 約 4.1GB
+    for (std::size_t i = 0; i < count; i++)
+        writer.addPrepared("p" + std::to_string(1000 + i), prepared, stored);
+    writer.close();
+
+    const std::size_t entrySize = 30 + 5 + stored.size(); // local header + 名稱 + 資料
+    check(buf.count() > 0x100000000ULL, "archive larger than 4GB");
+    std::size_t pos = checkZip64Tail(buf.tail(), buf.count(), count);
+    const std::string& tail = buf.tail();
+
+    // 逐一檢查 central directory: 位置在 4GB 以內的記在原欄位，之後的記在延伸欄位
+    std::size_t zip64Entries = 0;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        const Poco::UInt64 offset = static_cast<Poco::UInt64>(i) * entrySize;
+        const std::size_t extraLen = get16(tail, pos + 30);
+        if (offset < 0xffffffff)
+        {
+            check(get16(tail, pos + 6) == 20 && extraLen == 0
+                      && get32(tail, pos + 42) == offset,
+                  "32-bit local header offset");
+        }
+        else
+        {
+            zip64Entries++;
+            const std::size_t extra = pos + 46 + get16(tail, pos + 28);
+            check(get16(tail, pos + 6) == 45 && get32(tail, pos + 42) == 0xffffffff
+                      && extraLen == 12 && get16(tail, extra) == 0x0001
+                      && get16(tail, extra + 2) == 8 && get64(tail, extra + 4) == offset,
+                  "ZIP64 local header offset");
+        }
+        pos += 46 + get16(tail, pos + 28) + extraLen;
+    }
+    check(zip64Entries > 0, "entries past 4GB");
+    check(get32(tail, pos) == ZIP64_END_OF_CENTRAL_SIGNATURE, "central directory end");
+}
+
+/// 項目數達到 0xffff 時也要寫出 ZIP64 記錄
+void testManyEntries()
+{
+    TailStreamBuf buf;
+    std::ostream out(&buf);
+    ZipWriter writer(out);
+    const std::size_t count = 70000;
+    for (std::size_t i = 0; i < count; i++)
+        writer.add("f" + std::to_string(i), "x", false);
+    writer.close();
+
+    checkZip64Tail(buf.tail(), buf.count(), count);
+}
+}
+
+int main()
+{
+    const struct
+    {
+        void (*run)();
+        const char* name;
+    } tests[] = { { testRoundTrip, "round trip" }, { testRawCopy, "raw copy" },
+                  { testLargeOffsets, "large offsets" }, { testManyEntries, "many entries" } };
+
+    for (const auto& test : tests)
+    {
+        try
+        {
+            test.run();
+        }
+        catch (const std::exception& e)
+        {
+            std::printf("%s: unexpected exception: %s\n", test.name, e.what());
+            failures++;
+        }
+    }
+
+    std::printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */